@@ -0,0 +1,179 @@
+#!/bin/sh
+#
+# bench-boot.sh: measure uxlaunch's own startup overhead
+#
+# Runs the complete uxlaunch startup sequence inside an unprivileged
+# user and mount namespace, against a throw-away filesystem root that
+# contains stub versions of Xorg, dbus-daemon, ssh-agent, gconftool-2
+# and friends. The stub X server signals readiness after
+# $X_DELAY seconds, so whatever time remains is spent in uxlaunch.
+#
+# usage: bench-boot.sh [path/to/uxlaunch]
+#
+# environment:
+#   ITERATIONS  number of boots to measure (default: 20)
+#   X_DELAY     seconds the fake X server takes to get ready (default: 0.2)
+#   AUTOSTART   number of autostart .desktop files to create (default: 10)
+#
+
+UXLAUNCH=${1:-src/uxlaunch}
+ITERATIONS=${ITERATIONS:-20}
+X_DELAY=${X_DELAY:-0.2}
+AUTOSTART=${AUTOSTART:-10}
+
+fail() {
+	echo "bench-boot: $*" >&2
+	exit 1
+}
+
+[ -x "$UXLAUNCH" ] || fail "$UXLAUNCH: not an executable, run make first"
+UXLAUNCH=$(cd "$(dirname "$UXLAUNCH")" && pwd)/$(basename "$UXLAUNCH")
+
+command -v unshare > /dev/null || fail "unshare(1) is required"
+unshare -Urm true 2> /dev/null || fail "unprivileged user namespaces are not available"
+
+# uxlaunch runs as the namespace root user, so it gets root's home dir
+HOMEDIR=$(getent passwd root | cut -d: -f6)
+[ -n "$HOMEDIR" ] || fail "unable to find the home directory of root"
+
+ROOT=$(mktemp -d /tmp/bench-boot.XXXXXX) || fail "mktemp failed"
+trap 'rm -rf "$ROOT"' EXIT INT TERM
+
+mkdir -p "$ROOT/etc/sysconfig" "$ROOT/etc/pam.d" "$ROOT/etc/xdg/autostart" \
+	"$ROOT/usr/bin" "$ROOT/sbin" "$ROOT/usr/share/xsessions" \
+	"$ROOT/usr/share/uxlaunch" "$ROOT/var/run" "$ROOT/log"
+
+cat > "$ROOT/etc/sysconfig/uxlaunch" <<EOT
+user=root
+session=default
+EOT
+
+# no authentication stack in the namespace, let everything pass
+for t in auth account password session; do
+	echo "$t required pam_permit.so"
+done > "$ROOT/etc/pam.d/login"
+
+stub() {
+	cat > "$ROOT/usr/bin/$1"
+	chmod 755 "$ROOT/usr/bin/$1"
+}
+
+# X servers send SIGUSR1 to their parent when ready, if it's ignored
+stub Xorg <<EOT
+#!/bin/sh
+trap 'exit 0' TERM INT
+sleep $X_DELAY
+kill -USR1 \$PPID
+while :; do sleep 1 & wait \$!; done
+EOT
+
+# --print-pid and --print-address take fd numbers to write to
+stub dbus-daemon <<'EOT'
+#!/bin/sh
+while [ $# -gt 0 ]; do
+	case $1 in
+	--print-pid) pidfd=$2; shift ;;
+	--print-address) addrfd=$2; shift ;;
+	esac
+	shift
+done
+sleep 3600 > /dev/null 2>&1 &
+eval "echo $! >&$pidfd"
+eval "echo unix:abstract=/tmp/bench-boot-bus >&$addrfd"
+EOT
+
+# started as `ssh-agent -D -a <socket>`, stays in the foreground
+stub ssh-agent <<'EOT'
+#!/bin/sh
+exec sleep 3600
+EOT
+
+for s in gconftool-2 xdg-user-dirs-update gnome-screensaver \
+	 gnome-screensaver-command; do
+	printf '#!/bin/sh\nexit 0\n' | stub $s
+done
+
+# the session ends by itself so the teardown path is measured too
+stub bench-session <<'EOT'
+#!/bin/sh
+sleep 1
+EOT
+
+cat > "$ROOT/usr/share/xsessions/default.desktop" <<EOT
+[Desktop Entry]
+Name=Benchmark
+Exec=$ROOT/usr/bin/bench-session
+EOT
+
+i=0
+for prio in Highest High Low Late; do
+	n=0
+	while [ $n -lt $(( (AUTOSTART + 3) / 4 )) ] && [ $i -lt $AUTOSTART ]; do
+		cat > "$ROOT/etc/xdg/autostart/bench-$i.desktop" <<EOT
+[Desktop Entry]
+Name=bench $i
+Exec=/bin/true
+X-Priority=$prio
+EOT
+		i=$((i + 1))
+		n=$((n + 1))
+	done
+done
+
+echo "bench-boot: $ITERATIONS iterations, X delay ${X_DELAY}s, $AUTOSTART autostart entries"
+
+n=0
+while [ $n -lt $ITERATIONS ]; do
+	n=$((n + 1))
+	UXLAUNCH_ROOT=$ROOT timeout 60 unshare -Urm sh -c "
+		mount -t tmpfs tmpfs '$HOMEDIR' &&
+		mount --bind '$ROOT/etc/pam.d' /etc/pam.d &&
+		exec '$UXLAUNCH' -v" > /dev/null 2> "$ROOT/log/boot-$n.log"
+	grep -q "phase autostart:" "$ROOT/log/boot-$n.log" ||
+		fail "boot $n did not complete, see log below:
+$(cat "$ROOT/log/boot-$n.log")"
+	printf '.'
+done
+echo
+
+# turn the phase marks into per-phase durations, one "order name ms" line
+# per sample, then sort each phase's samples to pick the percentiles
+cat "$ROOT"/log/boot-*.log | awk -v xdelay="$X_DELAY" '
+/phase [a-z-]+: / {
+	for (i = 1; i <= NF; i++)
+		if ($i == "phase")
+			break
+	name = $(i + 1)
+	sub(":", "", name)
+	t = $(i + 2) * 1000
+	if (name == "options")
+		last = 0
+	if (!(name in order))
+		order[name] = ++phases
+	print order[name], name, t - last
+	last = t
+	if (name == "autostart") {
+		print 100, "total", t
+		print 101, "overhead", t - xdelay * 1000
+	}
+}' | sort -k1,1n -k3,3n | awk '
+function report() {
+	if (n)
+		printf("%-12s %10.1f %10.1f %10.1f %10.1f\n", name,
+		       v[int((n - 1) * 0.50) + 1], v[int((n - 1) * 0.90) + 1],
+		       v[int((n - 1) * 0.99) + 1], v[n])
+	n = 0
+}
+BEGIN {
+	printf("%-12s %10s %10s %10s %10s\n", "phase (ms)", "p50", "p90", "p99", "max")
+}
+$2 != name {
+	report()
+	name = $2
+}
+{
+	v[++n] = $3
+}
+END {
+	report()
+}'
@@ -0,0 +1,554 @@
+/*
+ * This file is part of uxlaunch
+ *
+ * Boot records: the startup phases and the fork and settle times of
+ * every autostart entry of a login, kept in $XDG_CACHE_HOME/uxlaunch/boots,
+ * and `uxlaunch --analyze` / `uxlaunch --diff` to read them.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+#include "uxlaunch.h"
+
+#define RECORD_MAGIC "uxlaunch-boot 1"
+
+/* keep this many boot records */
+#define MAX_RECORDS 20
+
+/* the percentile of a set of boots that --diff compares */
+int analyze_percentile = 90;
+/* and by how many percent it may get worse before --diff fails */
+int analyze_threshold = 10;
+
+#define MAX_RECORD_PHASES 32
+#define MAX_RECORD_ENTRIES 256
+
+struct record_struct {
+	char name[PATH_MAX];
+	uint64_t boot;
+	int phase_count;
+	struct {
+		char name[64];
+		uint64_t usecs;
+	} phases[MAX_RECORD_PHASES];
+	int entry_count;
+	struct {
+		char file[256];
+		int prio;
+		uint64_t forked;
+		uint64_t settled;
+	} entries[MAX_RECORD_ENTRIES];
+};
+
+/* phase or entry, for the blame list */
+struct blame_struct {
+	const char *name;
+	uint64_t at;
+	uint64_t usecs;
+};
+
+
+static int boots_dir(char *path)
+{
+	if (getenv("XDG_CACHE_HOME"))
+		snprintf(path, PATH_MAX, "%s/uxlaunch/boots", getenv("XDG_CACHE_HOME"));
+	else if (getenv("HOME"))
+		snprintf(path, PATH_MAX, "%s/.cache/uxlaunch/boots", getenv("HOME"));
+	else
+		return -1;
+	return 0;
+}
+
+
+static int is_record(const char *name)
+{
+	return !strncmp(name, "boot-", 5);
+}
+
+
+static gint record_cmp(gconstpointer a, gconstpointer b)
+{
+	return strcmp(a, b);
+}
+
+
+/*
+ * The names of all records in dir, oldest first. Names are the time of
+ * the login, zero padded, so they sort by time.
+ */
+static GList *list_records(const char *dir)
+{
+	DIR *d;
+	struct dirent *entry;
+	GList *list = NULL;
+
+	d = opendir(dir);
+	if (!d)
+		return NULL;
+	while ((entry = readdir(d)))
+		if (is_record(entry->d_name))
+			list = g_list_prepend(list, g_strdup(entry->d_name));
+	closedir(d);
+
+	return g_list_sort(list, record_cmp);
+}
+
+
+static void prune_records(const char *dir)
+{
+	GList *list, *item;
+	char path[PATH_MAX];
+	int count;
+
+	list = list_records(dir);
+	count = g_list_length(list);
+	for (item = list; item && count > MAX_RECORDS; item = g_list_next(item), count--) {
+		snprintf(path, PATH_MAX, "%s/%s", dir, (char *)item->data);
+		unlink(path);
+	}
+	g_list_free_full(list, g_free);
+}
+
+
+/*
+ * Called once the autostart entries have settled, from the history
+ * process if there are entries to wait for
+ */
+void write_boot_record(void)
+{
+	FILE *f;
+	char dir[PATH_MAX];
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	const char *name;
+	uint64_t usecs;
+	int i;
+
+	if (boots_dir(dir))
+		return;
+	g_mkdir_with_parents(dir, 0700);
+
+	snprintf(path, PATH_MAX, "%s/boot-%010llu-%d", dir,
+		 (unsigned long long) time(NULL), getpid());
+	snprintf(tmp, PATH_MAX, "%s/.record.%d", dir, getpid());
+	f = fopen(tmp, "w");
+	if (!f) {
+		lprintf("Unable to write boot record %s", tmp);
+		return;
+	}
+
+	fprintf(f, "%s\n", RECORD_MAGIC);
+	fprintf(f, "boot %llu\n", (unsigned long long) boot_usecs());
+	for (i = 0; !phase_at(i, &name, &usecs); i++)
+		fprintf(f, "phase %s %llu\n", name, (unsigned long long) usecs);
+	history_write_entries(f);
+
+	if (fclose(f) || rename(tmp, path)) {
+		lprintf("Unable to write boot record %s", path);
+		unlink(tmp);
+		return;
+	}
+
+	prune_records(dir);
+}
+
+
+static struct record_struct *read_record(const char *path)
+{
+	FILE *f;
+	char line[PATH_MAX];
+	char name[256];
+	unsigned long long a, b;
+	struct record_struct *r;
+	int prio;
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "Unable to open %s\n", path);
+		return NULL;
+	}
+
+	if (!fgets(line, sizeof(line), f) || strncmp(line, RECORD_MAGIC, strlen(RECORD_MAGIC))) {
+		fprintf(stderr, "%s: not a boot record\n", path);
+		fclose(f);
+		return NULL;
+	}
+
+	r = g_new0(struct record_struct, 1);
+	strncpy(r->name, path, PATH_MAX - 1);
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "boot %llu", &a) == 1) {
+			r->boot = a;
+		} else if (sscanf(line, "phase %63s %llu", name, &a) == 2) {
+			if (r->phase_count >= MAX_RECORD_PHASES)
+				continue;
+			strcpy(r->phases[r->phase_count].name, name);
+			r->phases[r->phase_count].usecs = a;
+			r->phase_count++;
+		} else if (sscanf(line, "entry %255s %d %llu %llu", name, &prio, &a, &b) == 4) {
+			if (r->entry_count >= MAX_RECORD_ENTRIES)
+				continue;
+			strcpy(r->entries[r->entry_count].file, name);
+			r->entries[r->entry_count].prio = prio;
+			r->entries[r->entry_count].forked = a;
+			r->entries[r->entry_count].settled = b;
+			r->entry_count++;
+		}
+	}
+	fclose(f);
+
+	return r;
+}
+
+
+/*
+ * A record file, or all records in a directory
+ */
+static GList *read_records(const char *path)
+{
+	struct stat st;
+	struct record_struct *r;
+	GList *list, *item, *records = NULL;
+	char file[PATH_MAX];
+
+	if (stat(path, &st)) {
+		fprintf(stderr, "Unable to open %s\n", path);
+		return NULL;
+	}
+
+	if (!S_ISDIR(st.st_mode)) {
+		r = read_record(path);
+		return r ? g_list_append(NULL, r) : NULL;
+	}
+
+	list = list_records(path);
+	for (item = list; item; item = g_list_next(item)) {
+		snprintf(file, PATH_MAX, "%s/%s", path, (char *)item->data);
+		r = read_record(file);
+		if (r)
+			records = g_list_append(records, r);
+	}
+	g_list_free_full(list, g_free);
+
+	return records;
+}
+
+
+static int latest_record(char *path)
+{
+	char dir[PATH_MAX];
+	GList *list;
+
+	if (boots_dir(dir))
+		return -1;
+	list = list_records(dir);
+	if (!list) {
+		fprintf(stderr, "No boot records in %s\n", dir);
+		return -1;
+	}
+	snprintf(path, PATH_MAX, "%s/%s", dir, (char *)g_list_last(list)->data);
+	g_list_free_full(list, g_free);
+
+	return 0;
+}
+
+
+static int find_phase(struct record_struct *r, const char *name, uint64_t *usecs)
+{
+	int i;
+
+	for (i = 0; i < r->phase_count; i++) {
+		if (!strcmp(r->phases[i].name, name)) {
+			*usecs = r->phases[i].usecs;
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+
+/* the end of phase i is its mark, it started at the previous one */
+static uint64_t phase_duration(struct record_struct *r, int i)
+{
+	return r->phases[i].usecs - (i ? r->phases[i - 1].usecs : 0);
+}
+
+
+static uint64_t first_pixel(struct record_struct *r)
+{
+	uint64_t usecs = 0;
+
+	/* a Wayland session is up when the compositor is */
+	if (find_phase(r, "xready", &usecs) < 0)
+		find_phase(r, "compositor", &usecs);
+	return usecs;
+}
+
+
+/*
+ * The whole desktop is up when the autostart is done and every entry
+ * settled. Returns the entry that settled last, -1 if none did so
+ * after the autostart was done.
+ */
+static int full_desktop(struct record_struct *r, uint64_t *usecs)
+{
+	int i, last = -1;
+
+	*usecs = r->phase_count ? r->phases[r->phase_count - 1].usecs : 0;
+	find_phase(r, "autostart", usecs);
+
+	for (i = 0; i < r->entry_count; i++) {
+		if (r->entries[i].settled > *usecs) {
+			*usecs = r->entries[i].settled;
+			last = i;
+		}
+	}
+
+	return last;
+}
+
+
+static void print_time(const char *prefix, const char *name, uint64_t at, uint64_t usecs)
+{
+	printf("%s%-32s @%llu.%03llus +%llu.%03llus\n", prefix, name,
+	       (unsigned long long) at / 1000000,
+	       (unsigned long long) at / 1000 % 1000,
+	       (unsigned long long) usecs / 1000000,
+	       (unsigned long long) usecs / 1000 % 1000);
+}
+
+
+/*
+ * The phases are strictly sequential, so the chain to a point in time
+ * is all phases up to it, and for the full desktop the entry that
+ * settled last.
+ */
+static void print_chain(struct record_struct *r, const char *title, uint64_t end, int entry)
+{
+	int i;
+
+	printf("%s: %llu.%03llus (%llu.%03llus after kernel boot)\n", title,
+	       (unsigned long long) end / 1000000,
+	       (unsigned long long) end / 1000 % 1000,
+	       (unsigned long long) (r->boot + end) / 1000000,
+	       (unsigned long long) (r->boot + end) / 1000 % 1000);
+
+	for (i = 0; i < r->phase_count; i++) {
+		if (entry >= 0 && r->phases[i].usecs > r->entries[entry].forked)
+			break;
+		if (r->phases[i].usecs > end)
+			break;
+		print_time("  ", r->phases[i].name, r->phases[i].usecs, phase_duration(r, i));
+	}
+
+	if (entry >= 0)
+		print_time("  ", r->entries[entry].file, r->entries[entry].settled,
+			   r->entries[entry].settled - r->entries[entry].forked);
+	printf("\n");
+}
+
+
+static gint blame_cmp(gconstpointer a, gconstpointer b)
+{
+	const struct blame_struct *A = a, *B = b;
+
+	if (A->usecs > B->usecs)
+		return -1;
+	if (A->usecs < B->usecs)
+		return 1;
+	return 0;
+}
+
+
+static void print_blame(struct record_struct *r)
+{
+	struct blame_struct *b;
+	GList *list = NULL, *item;
+	int i;
+
+	printf("blame:\n");
+
+	for (i = 0; i < r->phase_count; i++) {
+		b = g_new0(struct blame_struct, 1);
+		b->name = r->phases[i].name;
+		b->at = r->phases[i].usecs;
+		b->usecs = phase_duration(r, i);
+		list = g_list_prepend(list, b);
+	}
+	for (i = 0; i < r->entry_count; i++) {
+		b = g_new0(struct blame_struct, 1);
+		b->name = r->entries[i].file;
+		b->at = r->entries[i].settled;
+		b->usecs = r->entries[i].settled - r->entries[i].forked;
+		list = g_list_prepend(list, b);
+	}
+
+	list = g_list_sort(list, blame_cmp);
+	for (item = list; item; item = g_list_next(item)) {
+		b = item->data;
+		print_time("  ", b->name, b->at, b->usecs);
+	}
+	g_list_free_full(list, g_free);
+}
+
+
+static int analyze(const char *path)
+{
+	char latest[PATH_MAX];
+	struct record_struct *r;
+	uint64_t end;
+	int entry;
+
+	if (!path) {
+		if (latest_record(latest))
+			return 2;
+		path = latest;
+	}
+
+	r = read_record(path);
+	if (!r)
+		return 2;
+
+	printf("%s\n\n", path);
+	print_chain(r, "first pixel (xready)", first_pixel(r), -1);
+	entry = full_desktop(r, &end);
+	print_chain(r, "full desktop", end, entry);
+	print_blame(r);
+
+	g_free(r);
+	return 0;
+}
+
+
+static gint usecs_cmp(gconstpointer a, gconstpointer b)
+{
+	uint64_t A = *(const uint64_t *)a, B = *(const uint64_t *)b;
+
+	return A > B ? 1 : A < B ? -1 : 0;
+}
+
+
+/*
+ * Nearest rank percentile of a metric over a set of boots
+ */
+static uint64_t percentile(GList *records, uint64_t (*metric)(struct record_struct *))
+{
+	uint64_t *v;
+	uint64_t ret;
+	GList *item;
+	int n = 0, rank;
+
+	v = g_new0(uint64_t, g_list_length(records));
+	for (item = records; item; item = g_list_next(item))
+		v[n++] = metric(item->data);
+	qsort(v, n, sizeof(uint64_t), (int (*)(const void *, const void *))usecs_cmp);
+
+	rank = (analyze_percentile * n + 99) / 100;
+	if (rank < 1)
+		rank = 1;
+	if (rank > n)
+		rank = n;
+	ret = v[rank - 1];
+	g_free(v);
+
+	return ret;
+}
+
+
+static uint64_t full_desktop_usecs(struct record_struct *r)
+{
+	uint64_t usecs;
+
+	full_desktop(r, &usecs);
+	return usecs;
+}
+
+
+static int compare(const char *what, uint64_t base, uint64_t new)
+{
+	int regressed;
+
+	regressed = new * 100 > base * (100 + analyze_threshold);
+
+	printf("%-24s %8.3fs -> %8.3fs  %+7.1f%%%s\n", what, base / 1000000.0,
+	       new / 1000000.0, base ? (new - (double)base) * 100.0 / base : 0.0,
+	       regressed ? "  REGRESSED" : "");
+
+	return regressed;
+}
+
+
+/*
+ * Compare the configured percentile of two sets of boots. Each set is
+ * a record or a directory of records; the new set defaults to the
+ * latest boot.
+ */
+static int diff(const char *base_path, const char *new_path)
+{
+	char latest[PATH_MAX];
+	GList *base, *new;
+	int ret = 0;
+
+	if (!new_path) {
+		if (latest_record(latest))
+			return 2;
+		new_path = latest;
+	}
+
+	base = read_records(base_path);
+	new = read_records(new_path);
+	if (!base || !new) {
+		ret = 2;
+		goto out;
+	}
+
+	printf("p%d of %d boot(s) in %s\n", analyze_percentile, g_list_length(base), base_path);
+	printf("  vs p%d of %d boot(s) in %s\n\n", analyze_percentile, g_list_length(new), new_path);
+
+	ret |= compare("first pixel (xready)", percentile(base, first_pixel),
+		       percentile(new, first_pixel));
+	ret |= compare("full desktop", percentile(base, full_desktop_usecs),
+		       percentile(new, full_desktop_usecs));
+
+out:
+	g_list_free_full(base, g_free);
+	g_list_free_full(new, g_free);
+
+	return ret;
+}
+
+
+/*
+ * uxlaunch --analyze [record]
+ * uxlaunch --diff <base> [new]
+ *
+ * Returns the exit code: 1 if --diff found a regression, 2 on errors
+ */
+int analyze_boots(int diff_mode, int argc, char **argv)
+{
+	if (diff_mode) {
+		if (argc < 1) {
+			fprintf(stderr, "--diff needs a baseline boot record or directory\n");
+			return 2;
+		}
+		return diff(argv[0], argc > 1 ? argv[1] : NULL);
+	}
+
+	return analyze(argc > 0 ? argv[0] : NULL);
+}
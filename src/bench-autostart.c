@@ -0,0 +1,307 @@
+/*
+ * bench-autostart.c: autostart pipeline microbenchmark
+ *
+ * Drives get_session_type(), autostart_desktop_files() and the
+ * autostart sort over generated directories of .desktop files,
+ * and reports parse throughput and heap allocations per entry.
+ * Then compares keyfile.c with the GKeyFile lookups do_desktop_file()
+ * used to make, on the same files.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "uxlaunch.h"
+
+/*
+ * Count allocations by interposing the glibc allocator. GLib uses
+ * the system malloc, so this sees its allocations as well.
+ */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+static unsigned long allocs;
+
+void *malloc(size_t size)
+{
+	allocs++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+
+static void write_file(const char *path, const char *content)
+{
+	FILE *f;
+
+	f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "Unable to write %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	fputs(content, f);
+	fclose(f);
+}
+
+/*
+ * Generate a mix of entries: plain ones, entries filtered with
+ * OnlyShowIn/NotShowIn and ones conditional on files existing.
+ */
+static void make_entries(const char *dir, int count)
+{
+	static const char *prios[] = { "Highest", "High", "Low", "Late" };
+	char path[PATH_MAX];
+	char buf[1024];
+	int i;
+
+	for (i = 0; i < count; i++) {
+		const char *extra;
+
+		switch (i % 6) {
+		case 0:
+			extra = "OnlyShowIn=GNOME;bench;\n";
+			break;
+		case 1:
+			extra = "OnlyShowIn=GNOME;XFCE;\n";
+			break;
+		case 2:
+			extra = "NotShowIn=KDE;bench;\n";
+			break;
+		case 3:
+			extra = "X-OnlyStartIfFileExists=$HOME/exists\n";
+			break;
+		case 4:
+			extra = "X-OnlyStartIfFileExists=~/missing\n"
+				"X-Watchdog=Restart\n";
+			break;
+		default:
+			extra = "";
+			break;
+		}
+
+		snprintf(buf, sizeof(buf),
+			 "[Desktop Entry]\n"
+			 "Type=Application\n"
+			 "Name=Bench entry %d\n"
+			 "Name[de]=Bench Eintrag %d\n"
+			 "Comment=generated by bench-autostart\n"
+			 "Exec=/usr/bin/bench-%d --option %d\n"
+			 "X-Priority=%s\n"
+			 "%s",
+			 i, i, i, i, prios[i % 4], extra);
+		snprintf(path, PATH_MAX, "%s/bench-%04d.desktop", dir, i);
+		write_file(path, buf);
+	}
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/*
+ * What do_desktop_file() used to do to get at its keys
+ */
+static int parse_gkeyfile(const char *path)
+{
+	static const char *names[] = {
+		"Exec", "OnlyShowIn", "NotShowIn", "X-Priority",
+		"X-OnlyStartIfFileExists", "X-DontStartIfFileExists", "X-Watchdog"
+	};
+	GKeyFile *keyfile;
+	gchar *value;
+	unsigned int i;
+	int found = 0;
+
+	keyfile = g_key_file_new();
+	if (!g_key_file_load_from_file(keyfile, path, 0, NULL)) {
+		g_key_file_free(keyfile);
+		return -1;
+	}
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		value = g_key_file_get_string(keyfile, "Desktop Entry", names[i], NULL);
+		if (value)
+			found++;
+		g_free(value);
+	}
+	g_key_file_free(keyfile);
+
+	return found;
+}
+
+static int parse_keyfile(const char *path)
+{
+	struct keyfile_key keys[] = {
+		{ "Exec", NULL, 0 },
+		{ "OnlyShowIn", NULL, 0 },
+		{ "NotShowIn", NULL, 0 },
+		{ "X-Priority", NULL, 0 },
+		{ "X-OnlyStartIfFileExists", NULL, 0 },
+		{ "X-DontStartIfFileExists", NULL, 0 },
+		{ "X-Watchdog", NULL, 0 },
+	};
+	struct keyfile kf;
+	char exec[PATH_MAX];
+	unsigned int i;
+	int found = 0;
+
+	if (keyfile_open(&kf, path))
+		return -1;
+	if (keyfile_lookup(&kf, keys, sizeof(keys) / sizeof(keys[0]))) {
+		keyfile_close(&kf);
+		return -1;
+	}
+	keyfile_string(&keys[0], exec, PATH_MAX);
+	for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+		if (keys[i].value)
+			found++;
+	keyfile_close(&kf);
+
+	return found;
+}
+
+static void run_parser(const char *name, int (*parse)(const char *),
+		       const char *dir, int count)
+{
+	char path[PATH_MAX];
+	unsigned long a;
+	double t;
+	int rounds;
+	int r, i;
+
+	rounds = 20000 / count;
+	if (rounds < 3)
+		rounds = 3;
+
+	a = allocs;
+	t = now();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < count; i++) {
+			snprintf(path, PATH_MAX, "%s/bench-%04d.desktop", dir, i);
+			if (parse(path) < 0) {
+				fprintf(stderr, "%s: unable to parse %s\n", name, path);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	t = now() - t;
+	a = allocs - a;
+
+	printf("%-8s %6d %12.2f %12.0f %12.1f\n", name, count,
+	       t * 1000000.0 / (rounds * count), rounds * count / t,
+	       (double) a / (rounds * count));
+}
+
+static void run(const char *base, int count)
+{
+	char root[PATH_MAX];
+	char path[PATH_MAX];
+	char buf[PATH_MAX];
+	unsigned long a;
+	double t;
+	int rounds;
+	int r;
+
+	snprintf(root, PATH_MAX, "%s/%d", base, count);
+	mkdir(root, 0700);
+	snprintf(path, PATH_MAX, "%s/home", root);
+	mkdir(path, 0700);
+	setenv("HOME", path, 1);
+	snprintf(path, PATH_MAX, "%s/home/exists", root);
+	write_file(path, "");
+	snprintf(path, PATH_MAX, "%s/home/.config", root);
+	mkdir(path, 0700);
+	setenv("XDG_CONFIG_HOME", path, 1);
+	snprintf(path, PATH_MAX, "%s/home/.config/xsessions", root);
+	mkdir(path, 0700);
+	snprintf(path, PATH_MAX, "%s/home/.config/xsessions/bench.desktop", root);
+	write_file(path, "[Desktop Entry]\nName=Bench\nExec=/bin/true\n");
+	snprintf(buf, PATH_MAX, "%s/home/.config/xsessions/default.desktop", root);
+	if (symlink(path, buf))
+		perror("symlink");
+	snprintf(path, PATH_MAX, "%s/xdg", root);
+	mkdir(path, 0700);
+	setenv("XDG_CONFIG_DIRS", path, 1);
+	snprintf(path, PATH_MAX, "%s/xdg/autostart", root);
+	mkdir(path, 0700);
+	make_entries(path, count);
+
+	/* roughly the same amount of work for each directory size */
+	rounds = 20000 / count;
+	if (rounds < 3)
+		rounds = 3;
+
+	get_session_type();
+
+	a = allocs;
+	t = now();
+	for (r = 0; r < rounds; r++) {
+		autostart_desktop_files();
+		sort_desktop_entries();
+		free_desktop_entries();
+	}
+	t = now() - t;
+	a = allocs - a;
+
+	printf("%6d %8d %12.2f %12.0f %12.1f\n", count, rounds,
+	       t * 1000000.0 / (rounds * count), rounds * count / t,
+	       (double) a / (rounds * count));
+}
+
+int main(void)
+{
+	char base[] = "/tmp/bench-autostart.XXXXXX";
+	char cmd[PATH_MAX];
+	char dir[PATH_MAX];
+	int count;
+
+	if (!mkdtemp(base)) {
+		perror("mkdtemp");
+		return EXIT_FAILURE;
+	}
+
+	printf("%6s %8s %12s %12s %12s\n", "files", "rounds", "usec/entry",
+	       "entries/sec", "allocs/entry");
+	run(base, 10);
+	run(base, 100);
+	run(base, 1000);
+
+	printf("\n%-8s %6s %12s %12s %12s\n", "parser", "files", "usec/file",
+	       "files/sec", "allocs/file");
+	for (count = 10; count <= 1000; count *= 10) {
+		snprintf(dir, PATH_MAX, "%s/%d/xdg/autostart", base, count);
+		run_parser("gkeyfile", parse_gkeyfile, dir, count);
+		run_parser("keyfile", parse_keyfile, dir, count);
+	}
+
+	snprintf(cmd, PATH_MAX, "rm -rf %s", base);
+	if (system(cmd))
+		fprintf(stderr, "Unable to remove %s\n", base);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,378 @@
+/*
+ * This file is part of uxlaunch
+ *
+ * Startup boost: while X, the session and the Highest autostart
+ * entries start up, ask the scheduler (uclamp.min) and optionally the
+ * cpufreq driver (energy_performance_preference) for performance,
+ * before the governor would ramp up by itself.
+ *
+ * All of this runs in the oom_adj helper, which stays root.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <glob.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+
+#include "uxlaunch.h"
+
+/* uclamp.min to boost to, 0-1024, 0 disables boosting */
+int boost_util = 0;
+/* seconds, the boost ends even if the autostart isn't done */
+int boost_timeout = 10;
+/* e.g. "performance", empty leaves the EPP alone */
+char boost_epp[32] = "";
+
+#define SCHED_FLAG_KEEP_POLICY		0x08
+#define SCHED_FLAG_KEEP_PARAMS		0x10
+#define SCHED_FLAG_UTIL_CLAMP_MIN	0x20
+
+struct sched_attr_struct {
+	uint32_t size;
+	uint32_t sched_policy;
+	uint64_t sched_flags;
+	int32_t sched_nice;
+	uint32_t sched_priority;
+	uint64_t sched_runtime;
+	uint64_t sched_deadline;
+	uint64_t sched_period;
+	uint32_t sched_util_min;
+	uint32_t sched_util_max;
+};
+
+#define MAX_BOOSTED 32
+
+static struct {
+	pid_t pid;
+	uint32_t util_min;	/* to restore */
+	uint64_t started;
+	uint64_t deadline;
+	uint64_t cputime;
+	int tasks;
+} boosted[MAX_BOOSTED];
+
+static int boost_count = 0;
+
+#define MAX_EPP_POLICIES 64
+
+static char *epp_saved[MAX_EPP_POLICIES];
+static char *epp_paths[MAX_EPP_POLICIES];
+static int epp_count = 0;
+
+
+void boost_pid(pid_t pid)
+{
+	if (boost_util <= 0 || pid <= 0)
+		return;
+	helper_request(REQ_BOOST, pid, 0);
+}
+
+
+void unboost(void)
+{
+	if (boost_util <= 0)
+		return;
+	helper_request(REQ_UNBOOST, 0, 0);
+}
+
+
+/*
+ * The rest is only ever called in the helper
+ */
+
+static int get_util_min(pid_t tid, uint32_t *util_min)
+{
+	struct sched_attr_struct attr;
+
+	memset(&attr, 0, sizeof(attr));
+	if (syscall(__NR_sched_getattr, tid, &attr, sizeof(attr), 0))
+		return -1;
+	if (attr.size < sizeof(attr))
+		return -1;	/* kernel without uclamp */
+
+	*util_min = attr.sched_util_min;
+	return 0;
+}
+
+
+static int set_util_min(pid_t tid, uint32_t util_min)
+{
+	struct sched_attr_struct attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.sched_flags = SCHED_FLAG_KEEP_POLICY | SCHED_FLAG_KEEP_PARAMS |
+			   SCHED_FLAG_UTIL_CLAMP_MIN;
+	attr.sched_util_min = util_min;
+
+	return syscall(__NR_sched_setattr, tid, &attr, 0);
+}
+
+
+/*
+ * Set uclamp.min on all threads of a process, but only on those that
+ * still have the value "from", so we leave any the process changed
+ * itself alone. Returns the number of threads changed.
+ */
+static int set_process_util_min(pid_t pid, uint32_t from, uint32_t to)
+{
+	DIR *dir;
+	struct dirent *entry;
+	char path[PATH_MAX];
+	uint32_t cur;
+	pid_t tid;
+	int count = 0;
+
+	snprintf(path, PATH_MAX, "/proc/%d/task", pid);
+	dir = opendir(path);
+	if (!dir)
+		return 0;
+
+	while ((entry = readdir(dir))) {
+		tid = atoi(entry->d_name);
+		if (tid <= 0)
+			continue;
+		if (get_util_min(tid, &cur) || cur != from)
+			continue;
+		if (!set_util_min(tid, to)) {
+			count++;
+		} else if (errno == EOPNOTSUPP) {
+			/* CONFIG_UCLAMP_TASK is off, the EPP may still work */
+			lprintf("boost: uclamp is not supported by the kernel");
+			break;
+		} else {
+			lprintf("boost: unable to set uclamp.min of %d: %s",
+				tid, strerror(errno));
+		}
+	}
+
+	closedir(dir);
+	return count;
+}
+
+
+/*
+ * utime + stime in clock ticks
+ */
+static uint64_t process_cputime(pid_t pid)
+{
+	FILE *f;
+	char path[PATH_MAX];
+	unsigned long long utime = 0, stime = 0;
+	char *c;
+	char buf[1024];
+
+	snprintf(path, PATH_MAX, "/proc/%d/stat", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	if (!fgets(buf, sizeof(buf), f)) {
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+
+	/* the command name may contain spaces, skip past it */
+	c = strrchr(buf, ')');
+	if (!c || sscanf(c + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+			 &utime, &stime) != 2)
+		return 0;
+
+	return utime + stime;
+}
+
+
+static char *read_line(const char *path)
+{
+	FILE *f;
+	char buf[64];
+	char *c;
+
+	f = fopen(path, "r");
+	if (!f)
+		return NULL;
+	if (!fgets(buf, sizeof(buf), f)) {
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+
+	c = strchr(buf, '\n');
+	if (c)
+		*c = '\0';
+	return strdup(buf);
+}
+
+
+static int write_line(const char *path, const char *val)
+{
+	FILE *f;
+	int ret;
+
+	f = fopen(path, "w");
+	if (!f)
+		return -1;
+	ret = fputs(val, f) < 0;
+	if (fclose(f))
+		ret = -1;
+	return ret ? -1 : 0;
+}
+
+
+static void raise_epp(void)
+{
+	glob_t g;
+	char *val;
+	size_t i;
+
+	if (boost_epp[0] == '\0' || epp_count)
+		return;
+
+	if (glob("/sys/devices/system/cpu/cpufreq/policy*/energy_performance_preference",
+		 0, NULL, &g))
+		return;
+
+	for (i = 0; i < g.gl_pathc && epp_count < MAX_EPP_POLICIES; i++) {
+		val = read_line(g.gl_pathv[i]);
+		if (!val)
+			continue;
+		if (write_line(g.gl_pathv[i], boost_epp)) {
+			lprintf("boost: unable to set %s to %s", g.gl_pathv[i], boost_epp);
+			free(val);
+			continue;
+		}
+		epp_paths[epp_count] = strdup(g.gl_pathv[i]);
+		epp_saved[epp_count] = val;
+		epp_count++;
+	}
+	globfree(&g);
+
+	if (epp_count)
+		lprintf("boost: energy_performance_preference %s on %d cpufreq policies",
+			boost_epp, epp_count);
+}
+
+
+static void restore_epp(void)
+{
+	int i;
+
+	for (i = 0; i < epp_count; i++) {
+		if (write_line(epp_paths[i], epp_saved[i]))
+			lprintf("boost: unable to restore %s", epp_paths[i]);
+		free(epp_paths[i]);
+		free(epp_saved[i]);
+	}
+	if (epp_count)
+		lprintf("boost: energy_performance_preference restored");
+	epp_count = 0;
+}
+
+
+void helper_boost(pid_t pid)
+{
+	uint32_t orig;
+	int i;
+
+	for (i = 0; i < boost_count; i++)
+		if (boosted[i].pid == pid)
+			return;
+
+	if (boost_count >= MAX_BOOSTED) {
+		lprintf("boost: too many boosted processes, not boosting %d", pid);
+		return;
+	}
+	if (get_util_min(pid, &orig)) {
+		lprintf("boost: no uclamp support, not boosting %d", pid);
+		return;
+	}
+
+	i = boost_count++;
+	boosted[i].pid = pid;
+	boosted[i].util_min = orig;
+	boosted[i].started = elapsed_usecs();
+	boosted[i].deadline = boosted[i].started + boost_timeout * 1000000ULL;
+	boosted[i].cputime = process_cputime(pid);
+	boosted[i].tasks = set_process_util_min(pid, orig, boost_util);
+
+	lprintf("boost: process %d (%d threads) uclamp.min %u -> %d",
+		pid, boosted[i].tasks, orig, boost_util);
+
+	raise_epp();
+}
+
+
+static void unboost_entry(int i, const char *why)
+{
+	uint64_t usecs = elapsed_usecs() - boosted[i].started;
+	long hz = sysconf(_SC_CLK_TCK);
+	uint64_t cpu = process_cputime(boosted[i].pid) - boosted[i].cputime;
+
+	/*
+	 * threads created while boosted inherited the boost, so this may
+	 * be more than we set it on
+	 */
+	set_process_util_min(boosted[i].pid, boost_util, boosted[i].util_min);
+
+	lprintf("boost: process %d unboosted (%s) after %llu.%03llus, "
+		"used %.2fs cpu while boosted",
+		boosted[i].pid, why,
+		(unsigned long long) usecs / 1000000,
+		(unsigned long long) (usecs / 1000) % 1000,
+		hz > 0 ? (double) cpu / hz : 0.0);
+
+	boosted[i] = boosted[--boost_count];
+	if (!boost_count)
+		restore_epp();
+}
+
+
+void helper_unboost(const char *why)
+{
+	while (boost_count)
+		unboost_entry(boost_count - 1, why);
+}
+
+
+/*
+ * milliseconds until the next boost deadline, -1 if nothing is boosted
+ */
+int helper_boost_timeout(void)
+{
+	uint64_t now = elapsed_usecs();
+	uint64_t next = UINT64_MAX;
+	int i;
+
+	for (i = 0; i < boost_count; i++)
+		if (boosted[i].deadline < next)
+			next = boosted[i].deadline;
+
+	if (next == UINT64_MAX)
+		return -1;
+	if (next <= now)
+		return 0;
+	return (next - now + 999) / 1000;
+}
+
+
+void helper_boost_expire(void)
+{
+	uint64_t now = elapsed_usecs();
+	int i;
+
+	for (i = boost_count - 1; i >= 0; i--)
+		if (boosted[i].deadline <= now)
+			unboost_entry(i, "deadline");
+}
@@ -15,82 +15,452 @@
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
 #include <sys/shm.h>
 #include <unistd.h>
 #include "uxlaunch.h"
 #include "uxlaunch-ipc.h"
 
 
+static pid_t chooser_pid = 0;
+
+/* last session picked by each user, "<user> <session>" lines */
+static const char *state_file = "/var/lib/uxlaunch/chooser";
+
+
+static void send_line(int fd, const char *fmt, ...)
+{
+	va_list args;
+	char buf[1024];
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(buf, sizeof(buf) - 1, fmt, args);
+	va_end(args);
+
+	if (len < 0)
+		return;
+	if (len > (int)sizeof(buf) - 2)
+		len = sizeof(buf) - 2;
+	buf[len++] = '\n';
+
+	/* the chooser may well quit on us, that's not fatal */
+	if (send(fd, buf, len, MSG_NOSIGNAL) != len)
+		dprintf("chooser: short write on the IPC socket");
+}
+
+
+struct send_struct {
+	int fd;
+	const char *user;
+};
+
+static void send_session(struct session_entry *s, void *data)
+{
+	struct send_struct *send = data;
+
+	send_line(send->fd, "SESSION %s %s %s", send->user, s->name, s->path);
+}
+
+
+/*
+ * Index the system sessions, and those in the ~/.config of a user. We
+ * are still root here, so the latter are read with the user's ids.
+ */
+static void index_user_sessions(uid_t uid, gid_t gid, const char *home)
+{
+	char config_home[PATH_MAX];
+
+	index_sessions(NULL);
+
+	if (setegid(gid)) {
+		lprintf("chooser: unable to setegid(%d), only system sessions", gid);
+		return;
+	}
+	if (seteuid(uid)) {
+		lprintf("chooser: unable to seteuid(%d), only system sessions", uid);
+	} else {
+		snprintf(config_home, PATH_MAX, "%s%s/.config", sysroot, home);
+		index_sessions(config_home);
+		if (seteuid(getuid())) {
+			lprintf("Fatal: chooser: unable to restore our euid");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (setegid(getgid())) {
+		lprintf("Fatal: chooser: unable to restore our egid");
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+static void send_sessions(int fd, const char *user, uid_t uid, gid_t gid,
+			  const char *home)
+{
+	struct send_struct send = { fd, user };
+
+	index_user_sessions(uid, gid, home);
+	foreach_session(send_session, &send);
+}
+
+
+static void send_last_choices(int fd)
+{
+	FILE *f;
+	char path[PATH_MAX];
+	char user[256];
+	char name[UXLAUNCH_NAME_LIMIT];
+
+	snprintf(path, PATH_MAX, "%s%s", sysroot, state_file);
+	f = fopen(path, "r");
+	if (!f)
+		return;
+
+	while (fscanf(f, "%255s %49s\n", user, name) == 2)
+		send_line(fd, "LAST %s %s", user, name);
+
+	fclose(f);
+}
+
+
+static void save_last_choice(const char *user, const char *name)
+{
+	FILE *in, *out;
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	char u[256];
+	char n[UXLAUNCH_NAME_LIMIT];
+
+	snprintf(path, PATH_MAX, "%s/var/lib/uxlaunch", sysroot);
+	mkdir(path, 0755);
+
+	snprintf(path, PATH_MAX, "%s%s", sysroot, state_file);
+	snprintf(tmp, PATH_MAX, "%s.tmp", path);
+
+	out = fopen(tmp, "w");
+	if (!out) {
+		lprintf("chooser: unable to write %s", tmp);
+		return;
+	}
+
+	fprintf(out, "%s %s\n", user, name);
+	in = fopen(path, "r");
+	if (in) {
+		while (fscanf(in, "%255s %49s\n", u, n) == 2)
+			if (strcmp(u, user))
+				fprintf(out, "%s %s\n", u, n);
+		fclose(in);
+	}
+	fclose(out);
+
+	if (rename(tmp, path))
+		lprintf("chooser: unable to rename %s", tmp);
+}
+
+
+/*
+ * Stream everything the chooser needs to know, so it never has to
+ * scan for users or sessions itself.
+ */
+static void send_metadata(int fd)
+{
+	char gecos[256];
+	char *c;
+	int i;
+
+	send_line(fd, "VERSION %d", UXLAUNCH_IPC_VERSION);
+
+	for (i = 0; i < home_user_count; i++) {
+		/* only the full name part of the GECOS field */
+		strncpy(gecos, home_users[i].gecos, sizeof(gecos) - 1);
+		gecos[sizeof(gecos) - 1] = '\0';
+		c = strchr(gecos, ',');
+		if (c)
+			*c = '\0';
+
+		send_line(fd, "USER %s %d %s", home_users[i].name,
+			  home_users[i].uid, gecos);
+		send_sessions(fd, home_users[i].name, home_users[i].uid,
+			      home_users[i].gid, home_users[i].dir);
+	}
+
+	/* the configured user may not live in /home */
+	if (!home_user_count) {
+		send_line(fd, "USER %s %d %s", pass->pw_name, pass->pw_uid,
+			  pass->pw_gecos ? pass->pw_gecos : "");
+		send_sessions(fd, pass->pw_name, pass->pw_uid, pass->pw_gid,
+			      pass->pw_dir);
+	}
+
+	send_last_choices(fd);
+	send_line(fd, "DEFAULT %s", username);
+	send_line(fd, "END");
+}
+
+
+/*
+ * Was user one of those send_metadata() offered?
+ */
+static int offered_user(const char *user)
+{
+	int i;
+
+	if (!home_user_count)
+		return !strcmp(user, pass->pw_name);
+
+	for (i = 0; i < home_user_count; i++)
+		if (!strcmp(user, home_users[i].name))
+			return 1;
+	return 0;
+}
+
+
+/*
+ * Switch to the chooser's pick, if it is one of the users we offered,
+ * with one of the sessions we sent for that user. Returns 0 if it is.
+ */
+static int select_choice(const char *user, const char *name)
+{
+	struct passwd *p;
+
+	p = offered_user(user) ? getpwnam(user) : NULL;
+	if (!p) {
+		lprintf("Error: chooser: user \"%s\" was not offered", user);
+		return -1;
+	}
+
+	/* the index now holds what we sent for that user */
+	index_user_sessions(p->pw_uid, p->pw_gid, p->pw_dir);
+	if (!lookup_session(name)) {
+		lprintf("Error: chooser: no session \"%s\" for user \"%s\"",
+			name, user);
+		return -1;
+	}
+
+	lprintf("chooser: switching to user '%s', with session '%s'\n",
+		user, name);
+	strncpy(username, user, 255);
+	strncpy(session, name, 255);
+	pass = p;
+
+	return 0;
+}
+
+
+/*
+ * Read the SELECT reply, returns 0 when a valid choice was made, and 1
+ * when the chooser closed the socket without saying anything, which is
+ * what a protocol version 1 chooser does.
+ */
+static int read_selection(int fd)
+{
+	FILE *f;
+	char *line = NULL;
+	size_t len = 0;
+	char user[256];
+	char name[UXLAUNCH_NAME_LIMIT];
+	int ret = 1;
+
+	f = fdopen(dup(fd), "r");
+	if (!f)
+		return -1;
+
+	while (getline(&line, &len, f) > 0) {
+		if (sscanf(line, "SELECT %255s %49s", user, name) != 2) {
+			lprintf("chooser: ignoring unknown message \"%s\"", line);
+			ret = -1;
+			continue;
+		}
+
+		ret = select_choice(user, name);
+		break;
+	}
+
+	free(line);
+	fclose(f);
+
+	return ret;
+}
+
+
+/*
+ * Protocol version 1: the chooser finds a uxlaunch_chooser_shm through
+ * $SHM_ID, prefilled with our defaults, and leaves its pick there when
+ * it exits. Returns the shm id, or -1.
+ */
+static int setup_chooser_shm(uxlaunch_chooser_shm **shm)
+{
+	struct shmid_ds ds;
+	int shm_id;
+
+	shm_id = shmget(IPC_PRIVATE, sizeof(uxlaunch_chooser_shm),
+			IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
+	if (shm_id < 0)
+		return -1;
+
+	*shm = shmat(shm_id, NULL, 0);
+	if (*shm == (void *)-1 || shmctl(shm_id, IPC_STAT, &ds)) {
+		lprintf("chooser: unable to set up the version 1 SHM");
+		shmctl(shm_id, IPC_RMID, NULL);
+		*shm = NULL;
+		return -1;
+	}
+
+	/* only the chooser, which runs as the user, may touch it */
+	ds.shm_perm.uid = pass->pw_uid;
+	ds.shm_perm.gid = pass->pw_gid;
+	shmctl(shm_id, IPC_SET, &ds);
+
+	memset(*shm, 0, sizeof(uxlaunch_chooser_shm));
+	strncpy((*shm)->user, username, sizeof((*shm)->user) - 1);
+	strncpy((*shm)->session_path, session, sizeof((*shm)->session_path) - 1);
+
+	return shm_id;
+}
+
+
+/*
+ * Read what a version 1 chooser left in the SHM, once it has exited.
+ * The chooser process is left for wait_for_chooser() to reap.
+ */
+static int read_chooser_shm(uxlaunch_chooser_shm *shm)
+{
+	siginfo_t info;
+	char user[sizeof(shm->user)];
+	char name[UXLAUNCH_NAME_LIMIT];
+	char *c;
+
+	while (waitid(P_PID, chooser_pid, &info, WEXITED | WNOWAIT) < 0)
+		if (errno != EINTR)
+			return -1;
+
+	strncpy(user, shm->user, sizeof(user) - 1);
+	user[sizeof(user) - 1] = '\0';
+
+	/* the name, or else the .desktop file the session path points to */
+	if (shm->session_name[0] != '\0') {
+		strncpy(name, shm->session_name, sizeof(name) - 1);
+	} else {
+		shm->session_path[sizeof(shm->session_path) - 1] = '\0';
+		c = strrchr(shm->session_path, '/');
+		strncpy(name, c ? c + 1 : shm->session_path, sizeof(name) - 1);
+	}
+	name[sizeof(name) - 1] = '\0';
+	c = strstr(name, ".desktop");
+	if (c && c[strlen(".desktop")] == '\0')
+		*c = '\0';
+
+	lprintf("chooser: got a protocol version 1 selection");
+	return select_choice(user, name);
+}
+
+
+/*
+ * Start the chooser and return as soon as it reports its choice. The
+ * chooser process itself is reaped by wait_for_chooser().
+ */
 void setup_chooser(void)
 {
-	int ret, shm_id;
-	uxlaunch_chooser_shm *shm;
-	char shm_id_str[50];
-	const int shm_size = sizeof(uxlaunch_chooser_shm);
-	pid_t pid;
-	gid_t old_gid;
+	int ret;
+	int sv[2];
+	int shm_id;
+	uxlaunch_chooser_shm *shm = NULL;
+	char fd_str[16];
 
 	d_in();
 
-	old_gid = getegid();
-	setegid(pass->pw_gid);
-	shm_id = shmget(IPC_PRIVATE, shm_size,
-		IPC_CREAT | IPC_EXCL | S_IRGRP | S_IWGRP);
-		//IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR | S_IROTH | S_IWOTH);
-	shm = (uxlaunch_chooser_shm *)shmat(shm_id, NULL, 0);
-	if (shm == (void*)-1) {
-		lprintf("chooser: Unable to allocate SHM, abort\n");
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv)) {
+		lprintf("chooser: Unable to create IPC socket, abort\n");
 		return;
 	}
 
-	snprintf(shm_id_str, 50, "%i", shm_id);
-	lprintf("chooser: shared memory with key %i attached at address %p\n",
-		shm_id, shm);
+	shm_id = setup_chooser_shm(&shm);
 
-	strncpy(shm->user, username, 255);
-	strncpy(shm->session_path, session, 256);
+	prepare_X_handover();
 
-	if ((pid = fork()) < 0) {
+	if ((chooser_pid = fork()) < 0) {
 		lprintf("Error: chooser: Failed to fork in setup_chooser");
+		chooser_pid = 0;
+		close(sv[0]);
+		close(sv[1]);
+		if (shm) {
+			shmdt(shm);
+			shmctl(shm_id, IPC_RMID, NULL);
+		}
 		return;
-	} else if (pid == 0) {
+	} else if (chooser_pid == 0) {
 		/* child process */
 		lprintf("chooser: start authentication");
+		close(sv[0]);
 
 		switch_to_user();
+		/* so the session can have it with a new cookie */
+		x_noreset = 0;
 		start_X_server();
 		wait_for_X_signal();
 
-		setenv("SHM_ID", shm_id_str, 1);
+		/* the chooser is the only one to inherit its end */
+		fcntl(sv[1], F_SETFD, 0);
+		snprintf(fd_str, sizeof(fd_str), "%d", sv[1]);
+		setenv(UXLAUNCH_IPC_FD_ENV, fd_str, 1);
+		if (shm) {
+			snprintf(fd_str, sizeof(fd_str), "%d", shm_id);
+			setenv(UXLAUNCH_IPC_SHM_ENV, fd_str, 1);
+		}
 		ret = system(chooser);
 
-		/* kill Xorg, clean up */
-		kill(xpid, SIGTERM);
-		wait_for_X_exit();
+		/* keep Xorg running, the session may reuse it */
+		hand_over_X_server();
 
 		exit(ret);
 	}
 
 	/* parent */
-	if ((pid = waitpid(pid, &ret, 0)) < 0) {
-		lprintf("Error: chooser: setup_chooser waitpid error");
-	} else {
-		lprintf("chooser: switching to user '%s', with session '%s'\n",
-			shm->user, shm->session_path);
-		strncpy(username, shm->user, 255);
-		strncpy(session, shm->session_path, 256);
-		pass = getpwnam(username);
-		if (!pass) {
-			lprintf("Error: can't find user \"%s\"", username);
-			exit(EXIT_FAILURE);
-		}
+	close(sv[1]);
+
+	send_metadata(sv[0]);
+	ret = read_selection(sv[0]);
+	if (ret > 0 && shm)
+		ret = read_chooser_shm(shm);
+	if (ret)
+		lprintf("chooser: no selection made, using user '%s'", username);
+	else
+		save_last_choice(username, session);
+
+	close(sv[0]);
+	if (shm) {
+		shmdt(shm);
+		shmctl(shm_id, IPC_RMID, NULL);
 	}
 
-	shmctl(shm_id, IPC_RMID, NULL);
-	setegid(old_gid);
+	d_out();
+}
+
+
+/*
+ * Reap the chooser once it's done tearing down, and adopt its X server.
+ */
+void wait_for_chooser(void)
+{
+	int status;
+
+	if (!chooser_pid)
+		return;
+
+	d_in();
+
+	if (waitpid(chooser_pid, &status, 0) < 0)
+		lprintf("Error: chooser: waitpid error");
+	chooser_pid = 0;
+
+	take_over_X_server();
 
 	d_out();
 }
@@ -13,9 +13,12 @@
  */
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
 #include <pwd.h>
 
 #include "uxlaunch.h"
@@ -25,6 +28,36 @@
 
 static CkConnector *connector = NULL;
 
+/* its connection to the system bus, the session ends when it closes */
+#define MAX_FDS 1024
+static int ck_fd = -1;
+
+
+/*
+ * libdbus doesn't let us at the fd of the connection ck-connector
+ * opens, so we look for the socket that wasn't there before
+ */
+static void list_sockets(char *sockets)
+{
+	struct dirent *entry;
+	struct stat st;
+	DIR *dir;
+	int fd;
+
+	memset(sockets, 0, MAX_FDS);
+	dir = opendir("/proc/self/fd");
+	if (!dir)
+		return;
+	while ((entry = readdir(dir))) {
+		fd = atoi(entry->d_name);
+		if (fd <= 2 || fd >= MAX_FDS || fd == dirfd(dir))
+			continue;
+		if (!fstat(fd, &st) && S_ISSOCK(st.st_mode))
+			sockets[fd] = 1;
+	}
+	closedir(dir);
+}
+
 
 /*
  * Set up a ConsoleKit session. This is as easy as calling
@@ -43,6 +76,9 @@ void setup_consolekit_session(void)
 	char *d = &displaydev[0];
 	char *n = &displayname[0];
 	int is_local = 1;
+	char before[MAX_FDS];
+	char after[MAX_FDS];
+	int fd;
 
 	d_in();
 
@@ -51,6 +87,7 @@ void setup_consolekit_session(void)
 		exit(EXIT_FAILURE);
 
 	dbus_error_init(&error);
+	list_sockets(before);
 
 	/*
 	 * Note: ck_connector_open_* require a pointer to the value,
@@ -69,6 +106,13 @@ void setup_consolekit_session(void)
 		return;
 	}
 
+	list_sockets(after);
+	for (fd = 0; fd < MAX_FDS; fd++)
+		if (after[fd] && !before[fd]) {
+			ck_fd = fd;
+			break;
+		}
+
 	/*
 	 * put the session cookie up as an environment variable
 	 */
@@ -93,3 +137,16 @@ void close_consolekit_session(void)
 	unsetenv("XDG_SESSION_COOKIE");
 	d_out();
 }
+
+
+/*
+ * The supervisor keeps the session open by keeping the connection, and
+ * only that, of all the sockets we have
+ */
+void hand_over_consolekit(void)
+{
+	if (ck_fd >= 0)
+		keep_fd(ck_fd);
+	else
+		lprintf("No ConsoleKit connection to hand over, the session ends");
+}
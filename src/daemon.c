@@ -0,0 +1,300 @@
+/*
+ * This file is part of uxlaunch
+ *
+ * Launch policies for the helper daemons uxlaunch starts itself
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <asm/unistd.h>
+
+#include "uxlaunch.h"
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_IDLE_LOWEST (7 | (IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT))
+
+/* CPUs that PIN daemons are restricted to, e.g. "0" or "0-1,3" */
+char pin_cpus[256] = "";
+
+static struct {
+	pid_t pid;
+	char name[64];
+} daemons[MAX_DAEMONS];
+
+
+/*
+ * The same priority as Low and Late autostart entries get
+ */
+void set_low_priority(void)
+{
+	syscall(__NR_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_IDLE_LOWEST);
+	if (nice(5) == -1)
+		dprintf("nice() failed");
+}
+
+
+static int uptime(float *up)
+{
+	FILE *uptime;
+	int ret;
+
+	uptime = fopen("/proc/uptime", "r");
+	if (!uptime) {
+		lprintf("Unable to open /proc/uptime! disabling synchronization!");
+		return -1;
+	}
+
+	ret = fscanf(uptime, "%*f %f", up);
+	if (ret < 1) {
+		lprintf("Error reading /proc/uptime (%d)! disabling synchronization!", ret);
+		fclose(uptime);
+		return -1;
+	}
+
+	fclose(uptime);
+	return 0;
+}
+
+
+/*
+ * Wait until the system has "some" idle time available, but no more
+ * than 15 seconds. tick, if set, is called every 100ms meanwhile.
+ */
+void wait_for_idle(void (*tick)(void))
+{
+	float in, out;
+	int c = 0;
+
+	if (uptime(&in))
+		return;
+
+	while(1) {
+		usleep(100000);
+		c++;
+		if (tick)
+			tick();
+
+		if (uptime(&out))
+			return;
+
+		/* exit condition: there is "some" idle time available */
+		if (((out - in) / ((c > 5) ? 5.0 : c)) > 0.1)
+			break;
+
+		/* don't wait more than 15 seconds ever */
+		if (c >= 150)
+			break;
+	}
+	lprintf("wait_for_idle: done after %0.1fsecs", c / 10.0);
+}
+
+
+/*
+ * Parse a cpu list like "0-1,3" into a cpu set
+ */
+static int parse_cpus(const char *list, cpu_set_t *set)
+{
+	char buf[256];
+	char *tok, *save = NULL;
+	int first, last;
+
+	CPU_ZERO(set);
+	strncpy(buf, list, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+
+	for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		switch (sscanf(tok, "%d-%d", &first, &last)) {
+		case 1:
+			last = first;
+			break;
+		case 2:
+			break;
+		default:
+			return -1;
+		}
+		if (first < 0 || last < first || last >= CPU_SETSIZE)
+			return -1;
+		for (; first <= last; first++)
+			CPU_SET(first, set);
+	}
+
+	return CPU_COUNT(set) ? 0 : -1;
+}
+
+
+static void pin_to_cpus(void)
+{
+	cpu_set_t set;
+
+	if (pin_cpus[0] == '\0')
+		return;
+
+	if (parse_cpus(pin_cpus, &set)) {
+		lprintf("Invalid pin= cpu list \"%s\"", pin_cpus);
+		return;
+	}
+	if (sched_setaffinity(0, sizeof(set), &set))
+		lprintf("Unable to pin to cpus %s: %s", pin_cpus, strerror(errno));
+}
+
+
+static void track_daemon(pid_t pid, const char *cmd)
+{
+	const char *c;
+	int i;
+
+	c = strrchr(cmd, '/');
+	c = c ? c + 1 : cmd;
+
+	for (i = 0; i < MAX_DAEMONS; i++) {
+		if (daemons[i].pid)
+			continue;
+		daemons[i].pid = pid;
+		strncpy(daemons[i].name, c, sizeof(daemons[i].name) - 1);
+		return;
+	}
+
+	lprintf("Too many daemons, not tracking %s[%d]", c, pid);
+}
+
+
+/*
+ * Start a helper program. args is split at whitespace, like autostart
+ * Exec= lines. flags:
+ *  NICE       - run at the priority of Low autostart entries
+ *  PIN        - restrict to the cpus from the pin= config option
+ *  DELAYED    - don't start before the system is idle
+ *  BACKGROUND - don't wait for it to exit, and keep track of it
+ *
+ * Returns the pid for BACKGROUND daemons, otherwise the exit code of
+ * the program. Returns -1 on failure.
+ */
+int start_daemon(int flags, const char *cmd, const char *args)
+{
+	char *ptrs[256];
+	const char *c;
+	char *buf;
+	int count = 1;
+	int status;
+	pid_t pid;
+
+	d_in();
+
+	pid = fork();
+	if (pid < 0) {
+		lprintf("Failed to fork for %s", cmd);
+		return -1;
+	}
+
+	if (pid == 0) {
+		if (flags & NICE)
+			set_low_priority();
+		if (flags & PIN)
+			pin_to_cpus();
+		if (flags & DELAYED)
+			wait_for_idle(NULL);
+
+		c = strrchr(cmd, '/');
+		log_output(c ? c + 1 : cmd);
+
+		memset(ptrs, 0, sizeof(ptrs));
+		buf = strdup(args ? args : "");
+		ptrs[0] = (char *)cmd;
+		ptrs[1] = strtok(buf, " \t");
+		while (ptrs[count] && count < 255)
+			ptrs[++count] = strtok(NULL, " \t");
+
+		execvp(ptrs[0], ptrs);
+		lprintf("Failed to execvp(%s)", cmd);
+		exit(EXIT_FAILURE);
+	}
+
+	if (flags & BACKGROUND) {
+		track_daemon(pid, cmd);
+		d_out();
+		return pid;
+	}
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			lprintf("waitpid for %s failed: %s", cmd, strerror(errno));
+			return -1;
+		}
+	}
+
+	d_out();
+
+	if (WIFEXITED(status))
+		return WEXITSTATUS(status);
+	return -1;
+}
+
+
+/*
+ * Called for every child reaped elsewhere, so we never signal a pid
+ * that got reused
+ */
+void daemon_exited(pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < MAX_DAEMONS; i++) {
+		if (daemons[i].pid != pid)
+			continue;
+		lprintf("%s[%d] exited", daemons[i].name, pid);
+		daemons[i].pid = 0;
+	}
+}
+
+
+void stop_daemon(pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < MAX_DAEMONS; i++) {
+		if (!pid || daemons[i].pid != pid)
+			continue;
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, WNOHANG);
+		daemons[i].pid = 0;
+	}
+}
+
+
+void stop_daemons(void)
+{
+	int i;
+
+	d_in();
+
+	for (i = 0; i < MAX_DAEMONS; i++)
+		stop_daemon(daemons[i].pid);
+
+	d_out();
+}
+
+
+void hand_over_daemons(struct handover *h)
+{
+	int i;
+
+	for (i = 0; i < MAX_DAEMONS; i++) {
+		h->daemons[i].pid = daemons[i].pid;
+		strncpy(h->daemons[i].name, daemons[i].name, sizeof(h->daemons[i].name) - 1);
+	}
+}
@@ -17,6 +17,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <limits.h>
 
 #include <dbus/dbus.h>
 
@@ -30,7 +31,8 @@ void start_dbus_session_bus(void)
 {
 	int p_fd[2];
 	int a_fd[2];
-	char cmd[255];
+	char cmd[PATH_MAX];
+	char address[PATH_MAX];
 	int ret;
 	ssize_t result;
 
@@ -44,8 +46,13 @@ void start_dbus_session_bus(void)
 		exit(EXIT_FAILURE);
 	}
 
-	snprintf(cmd, 254, "dbus-daemon --fork --session --print-pid %d --print-address %d",
-		p_fd[1], a_fd[1]);
+	/* listen in the runtime dir, instead of where session.conf says */
+	address[0] = '\0';
+	if (getenv("XDG_RUNTIME_DIR"))
+		snprintf(address, PATH_MAX, " --address=unix:path=%s/bus", getenv("XDG_RUNTIME_DIR"));
+
+	snprintf(cmd, PATH_MAX, "dbus-daemon --fork --session --print-pid %d --print-address %d%s",
+		p_fd[1], a_fd[1], address);
 
 	lprintf("launching session bus: %s", cmd);
 
@@ -83,3 +90,8 @@ void stop_dbus_session_bus(void)
 	unsetenv("DBUS_SESSION_BUS_ADDRESS");
 	d_out();
 }
+
+void hand_over_dbus(struct handover *h)
+{
+	h->dbus_pid = atoi(dbus_pid);
+}
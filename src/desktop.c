@@ -26,38 +26,20 @@
 #include <limits.h>
 #include <pwd.h>
 #include <wordexp.h>
-#include <asm/unistd.h>
 
 #include "uxlaunch.h"
 
-#define IOPRIO_WHO_PROCESS 1
-#define IOPRIO_CLASS_IDLE 3
-#define IOPRIO_CLASS_SHIFT 13
-#define IOPRIO_IDLE_LOWEST (7 | (IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT))
-
 
 int session_pid;
 static gchar *session_filter = NULL;
 static gchar *session_exec = NULL;
-static int delay = 0;
-
-/*
- * 50ms steps in between async job startups
- * lower priority jobs are started up further apart
- */
-#define DELAY_UNIT 50000
-
-/* watchdog types */
-#define WD_NONE 0
-#define WD_HALT 1
-#define WD_RESTART 2
-#define WD_FAIL 3
 
 struct desktop_entry_struct {
 	gchar *file;
 	gchar *exec;
 	int prio;
 	int watchdog;
+	const char *hidden;	/* why exec is NULL */
 };
 
 static GList *desktop_entries;
@@ -97,7 +79,15 @@ static int file_expand_exists(const char *path)
 	return 0;
 }
 
-static void desktop_entry_add(const gchar *file, const gchar *exec, int prio, int wd)
+static void desktop_entry_free(struct desktop_entry_struct *entry)
+{
+	g_free(entry->exec);
+	g_free(entry->file);
+	free(entry);
+}
+
+static void desktop_entry_add(const gchar *file, const gchar *exec, int prio, int wd,
+			      const char *hidden)
 {
 	GList *item;
 	struct desktop_entry_struct *entry;
@@ -112,6 +102,7 @@ static void desktop_entry_add(const gchar *file, const gchar *exec, int prio, in
 			dprintf("Overwriting existing entry: %s", file);
 			/* overwrite existing entry with higher priority */
 			desktop_entries = g_list_remove(desktop_entries, entry);
+			desktop_entry_free(entry);
 			goto overwrite;
 		}
 		item = g_list_next(item);
@@ -130,6 +121,7 @@ overwrite:
 	entry->exec = g_strdup(exec);
 	entry->file = g_strdup(file);
 	entry->watchdog = wd;
+	entry->hidden = hidden;
 	if (entry->exec)
 		dprintf("Adding %s with prio %d", file, entry->prio);
 	else 
@@ -141,21 +133,125 @@ overwrite:
 }
 
 
+/*
+ * By bracket, and within a bracket the cheapest entries (as learned
+ * from previous logins) first
+ */
 static gint sort_entries(gconstpointer a, gconstpointer b)
 {
 	const struct desktop_entry_struct *A = a, *B = b;
+	uint64_t cost_a, cost_b;
 
 	if (A->prio > B->prio)
 		return 1;
 	if (A->prio < B->prio)
 		return -1;
-	if (A->exec && B->exec)
+	if (A->exec && B->exec) {
+		cost_a = history_cost(A->file);
+		cost_b = history_cost(B->file);
+		if (cost_a != cost_b)
+			return cost_a > cost_b ? 1 : -1;
 		return strcmp(A->exec, B->exec);
+	}
 	if (A->exec)
 		return 1;
 	return -1;
 }
 
+void sort_desktop_entries(void)
+{
+	load_history();
+	desktop_entries = g_list_sort(desktop_entries, sort_entries);
+}
+
+void free_desktop_entries(void)
+{
+	GList *item;
+
+	item = g_list_first(desktop_entries);
+	while (item) {
+		desktop_entry_free(item->data);
+		item = g_list_next(item);
+	}
+	g_list_free(desktop_entries);
+	desktop_entries = NULL;
+}
+
+static const char *prio_name(int prio)
+{
+	switch (prio) {
+	case -1:
+		return "Highest";
+	case 0:
+		return "High";
+	case 1:
+		return "Normal";
+	case 2:
+		return "Low";
+	default:
+		return "Late";
+	}
+}
+
+static const char *watchdog_name(int wd)
+{
+	switch (wd) {
+	case WD_HALT:
+		return "Halt";
+	case WD_RESTART:
+		return "Restart";
+	case WD_FAIL:
+		return "Fail";
+	default:
+		return "None";
+	}
+}
+
+/*
+ * Print the autostart queue in the order do_autostart() would
+ * launch it, including the entries that are hidden and why.
+ */
+void print_autostart_plan(void)
+{
+	GList *item;
+	struct desktop_entry_struct *entry;
+
+	sort_desktop_entries();
+
+	printf("%-8s %-8s %-32s %s\n", "bracket", "watchdog", "file", "exec");
+
+	item = g_list_first(desktop_entries);
+	while (item) {
+		entry = item->data;
+		if (entry->exec)
+			printf("%-8s %-8s %-32s %s\n", prio_name(entry->prio),
+			       watchdog_name(entry->watchdog), entry->file,
+			       entry->exec);
+		item = g_list_next(item);
+	}
+
+	item = g_list_first(desktop_entries);
+	while (item) {
+		entry = item->data;
+		if (!entry->exec)
+			printf("%-8s %-8s %-32s (hidden: %s)\n", "-", "-",
+			       entry->file, entry->hidden);
+		item = g_list_next(item);
+	}
+}
+
+
+/* the keys do_desktop_file() looks at */
+enum {
+	KEY_EXEC,
+	KEY_ONLYSHOWIN,
+	KEY_NOTSHOWIN,
+	KEY_PRIORITY,
+	KEY_ONLYSTART,
+	KEY_DONTSTART,
+	KEY_WATCHDOG,
+	KEYS
+};
 
 /*
  * Process a .desktop file
@@ -169,137 +265,121 @@ static gint sort_entries(gconstpointer a, gconstpointer b)
  */
 static void do_desktop_file(const gchar *dir, const gchar *file)
 {
-
-	GKeyFile *keyfile;
+	struct keyfile_key keys[KEYS] = {
+		[KEY_EXEC] = { "Exec" },
+		[KEY_ONLYSHOWIN] = { "OnlyShowIn" },
+		[KEY_NOTSHOWIN] = { "NotShowIn" },
+		[KEY_PRIORITY] = { "X-Priority" },
+		[KEY_ONLYSTART] = { "X-OnlyStartIfFileExists" },
+		[KEY_DONTSTART] = { "X-DontStartIfFileExists" },
+		[KEY_WATCHDOG] = { "X-Watchdog" },
+	};
+	struct keyfile kf;
 	GError *error = NULL;
-	gchar *exec_key;
-	gchar *onlyshowin_key;
-	gchar *notshowin_key;
-	gchar *prio_key;
-	gchar *onlystart_key;
-	gchar *dontstart_key;
-	gchar *wd_key;
-	gchar *filename = NULL;
+	gchar *exec;
+	char exec_key[PATH_MAX];
+	char path[PATH_MAX];
+	char filename[PATH_MAX];
+	const char *hidden = "no Exec key";
+	int prio = 1; /* medium/normal prio */
 	int wd = 0;
 
 	d_in();
 
-	filename = g_strdup_printf("%s/%s", dir, file);
-
-	int prio = 1; /* medium/normal prio */
+	snprintf(filename, PATH_MAX, "%s/%s", dir, file);
 
 	dprintf("Parsing %s", filename);
 
-	keyfile = g_key_file_new();
-	if (!g_key_file_load_from_file(keyfile, filename, 0, &error)) {
-		g_error("%s\n", error->message);
+	if (keyfile_open(&kf, filename)) {
+		lprintf("Unable to read %s, skipping it", filename);
+		d_out();
+		return;
+	}
+	if (keyfile_lookup(&kf, keys, KEYS)) {
+		lprintf("%s is malformed, skipping it", filename);
+		keyfile_close(&kf);
+		d_out();
 		return;
 	}
 
-	exec_key = g_key_file_get_string(keyfile, "Desktop Entry", "Exec", NULL);
-	if (!exec_key)
+	if (!keyfile_string(&keys[KEY_EXEC], exec_key, PATH_MAX))
 		goto hide;
 
-	onlyshowin_key = g_key_file_get_string(keyfile, "Desktop Entry", "OnlyShowIn", NULL);
-	notshowin_key = g_key_file_get_string(keyfile, "Desktop Entry", "NotShowIn", NULL);
-	prio_key = g_key_file_get_string(keyfile, "Desktop Entry", "X-Priority", NULL);
-	onlystart_key = g_key_file_get_string(keyfile, "Desktop Entry", "X-OnlyStartIfFileExists", NULL);
-	dontstart_key = g_key_file_get_string(keyfile, "Desktop Entry", "X-DontStartIfFileExists", NULL);
-
 	/*
 	 * Filtering desktop files is case insensitive, e.g.
 	 * when using gnome, GNOME is also matched in these keys.
 	 */
-	if (onlyshowin_key) {
-		gchar **partial;
-		int n;
-
-		dprintf("OnlyShowIn=%s", onlyshowin_key);
-		partial = g_strsplit(onlyshowin_key, ";", -1);
-
-		for (n = 0; partial[n] != NULL; n++) {
-			dprintf("...%s", partial[n]);
-			if (!g_ascii_strcasecmp(partial[n], session_filter)) {
-				g_strfreev(partial);
-				goto notshowin;
-			}
-		}
-		g_strfreev(partial);
+	if (keys[KEY_ONLYSHOWIN].value &&
+	    !keyfile_list_match(&keys[KEY_ONLYSHOWIN], session_filter)) {
 		/* nothing matched - hide */
+		hidden = "OnlyShowIn";
 		goto hide;
 	}
-notshowin:
-	if (notshowin_key) {
-		gchar **partial;
-		int n;
-
-		dprintf("NotShowIn=%s", notshowin_key);
-		partial = g_strsplit(notshowin_key, ";", -1);
-
-		for (n = 0; partial[n] != NULL; n++) {
-			dprintf("...%s", partial[n]);
-			if (!g_ascii_strcasecmp(partial[n], session_filter)) {
-				g_strfreev(partial);
-				goto hide;
-			}
-		}
-		g_strfreev(partial);
+	if (keyfile_list_match(&keys[KEY_NOTSHOWIN], session_filter)) {
+		hidden = "NotShowIn";
+		goto hide;
 	}
 
-	if (onlystart_key)
-		if (!file_expand_exists(onlystart_key))
+	if (keyfile_string(&keys[KEY_ONLYSTART], path, PATH_MAX))
+		if (!file_expand_exists(path)) {
+			hidden = "X-OnlyStartIfFileExists";
 			goto hide;
-	if (dontstart_key)
-		if (file_expand_exists(dontstart_key))
+		}
+	if (keyfile_string(&keys[KEY_DONTSTART], path, PATH_MAX))
+		if (file_expand_exists(path)) {
+			hidden = "X-DontStartIfFileExists";
 			goto hide;
+		}
 
-	if (prio_key) {
-		gchar *p = g_utf8_casefold(prio_key, g_utf8_strlen(prio_key, -1));
-		if (g_strstr_len(p, -1, "highest"))
+	if (keys[KEY_PRIORITY].value) {
+		if (keyfile_value_has(&keys[KEY_PRIORITY], "highest"))
 			prio = -1;
-		else if (g_strstr_len(p, -1, "high"))
+		else if (keyfile_value_has(&keys[KEY_PRIORITY], "high"))
 			prio = 0;
-		else if (g_strstr_len(p, -1, "low"))
+		else if (keyfile_value_has(&keys[KEY_PRIORITY], "low"))
 			prio = 2;
-		else if (g_strstr_len(p, -1, "late"))
+		else if (keyfile_value_has(&keys[KEY_PRIORITY], "late"))
 			prio = 3;
 		else
-			lprintf("Unknown value for key X-Priority: %s", prio_key);
+			lprintf("Unknown value for key X-Priority: %.*s",
+				keys[KEY_PRIORITY].len, keys[KEY_PRIORITY].value);
 	}
 
-	wd_key = g_key_file_get_string(keyfile, "Desktop Entry", "X-Watchdog", NULL);
-	if (wd_key) {
-		gchar *p = g_utf8_casefold(wd_key, g_utf8_strlen(wd_key, -1));
-		if (g_strstr_len(p, -1, "halt"))
+	if (keys[KEY_WATCHDOG].value) {
+		if (keyfile_value_has(&keys[KEY_WATCHDOG], "halt"))
 			wd = WD_HALT;
-		else if (g_strstr_len(p, -1, "restart"))
+		else if (keyfile_value_has(&keys[KEY_WATCHDOG], "restart"))
 			wd = WD_RESTART;
-		else if (g_strstr_len(p, -1, "fail"))
+		else if (keyfile_value_has(&keys[KEY_WATCHDOG], "fail"))
 			wd = WD_FAIL;
 		else
-			lprintf("Unknown value for key X-Watchdog: %s", wd_key);
+			lprintf("Unknown value for key X-Watchdog: %.*s",
+				keys[KEY_WATCHDOG].len, keys[KEY_WATCHDOG].value);
 	}
 
-	desktop_entry_add(file, g_shell_unquote(exec_key, &error), prio, wd);
+	exec = g_shell_unquote(exec_key, &error);
+	if (!exec) {
+		lprintf("%s: %s", filename, error->message);
+		g_error_free(error);
+		hidden = "unbalanced quotes in Exec";
+		goto hide;
+	}
+	desktop_entry_add(file, exec, prio, wd, NULL);
+	g_free(exec);
 	dprintf("NOT hiding %s", file);
 	goto done;
 hide:
 	dprintf("Hiding %s", file);
-	desktop_entry_add(file, NULL, -1, wd);
+	desktop_entry_add(file, NULL, -1, wd, hidden);
 done:
-	g_free(filename);
+	keyfile_close(&kf);
 	d_out();
 }
 
 
 void get_session_type(void)
 {
-	GKeyFile *keyfile;
-	GError *error = NULL;
-	gchar *filename = NULL;
-	char buf[PATH_MAX];
-	char *c;
-	struct stat st;
+	struct session_entry *s;
 
 	d_in();
 	/*
@@ -323,19 +403,22 @@ void get_session_type(void)
 	 *
 	 * if you change the session, it will look for the identifier
 	 * you provided instead (and append ".desktop")
+	 *
+	 * all of these are indexed once by the session registry, see
+	 * sessions.c
 	 */
 
-	filename = g_strdup_printf("%s/xsessions/%s.desktop", getenv("XDG_CONFIG_HOME"), session);
-	if (!access(filename, R_OK))
-		goto found_session;
-	filename = g_strdup_printf("/etc/X11/dm/Sessions/%s.desktop", session);
-	if (!access(filename, R_OK))
-		goto found_session;
-	filename = g_strdup_printf("/usr/share/xsessions/%s.desktop", session);
-	if (!access(filename, R_OK))
-		goto found_session;
+	index_sessions(getenv("XDG_CONFIG_HOME"));
+	s = lookup_session(session);
+	if (s) {
+		session_exec = g_strdup(s->exec);
+		session_filter = g_strdup(s->filter);
+		session_notify = s->notify;
+		wayland_session = s->wayland;
+		goto session_done;
+	}
 
-	lprintf("Unable to find session \"%s.desktop\"!", filename);
+	lprintf("Unable to find session \"%s.desktop\"!", session);
 
 	lprintf("WARNING: using DEPRECATED session mechanics. Please read `man uxlaunch` on");
 	lprintf("how to setup a session file properly instead!");
@@ -349,59 +432,10 @@ void get_session_type(void)
 	}
 
 	session_filter = g_strdup("X-UNKNOWN");
-	goto session_done;
-
-found_session:
-	keyfile = g_key_file_new();
-	if (!g_key_file_load_from_file(keyfile, filename, 0, &error)) {
-		g_error("%s\n", error->message);
-		return;
-	}
-
-	session_exec = g_key_file_get_string(keyfile, "Desktop Entry", "Exec", NULL);
-	if (!session_exec) {
-		lprintf("%s: invalid session file: no valid Exec= key", filename);
-		exit(EXIT_FAILURE);
-	}
-
-	/* is the file a symlink? e.g. default.desktop -> gnome.desktop? */
-	if (lstat(filename, &st)) {
-		lprintf("%s: unable to lstat()", filename);
-		exit(EXIT_FAILURE);
-	}
-	if (S_ISLNK(st.st_mode)) {
-		ssize_t l;
-		/* now, readlink() the file.desktop and look at the basename */
-		l = readlink(filename, buf, sizeof(buf) -1);
-		if (l < 0) {
-			lprintf("%s: unable to determine link target", filename);
-			exit(EXIT_FAILURE);
-		}
-		buf[l] = 0;
-		c = buf;
-	} else {
-		c = filename;
-	}
-
-	/* get the basename without .desktop */
-	c = strrchr(c, '/');
-	if (!c)
-		c = buf; /* relative link, ignore */
-	else
-		c++; /* leading / itself */
-
-	if (strlen(c) <= strlen(".desktop")) {
-		lprintf("%s: funny, malformed link target", filename);
-		exit(EXIT_FAILURE);
-	}
-	*(c + strlen(c) - strlen(".desktop")) = 0;
-
-	/* and use that as session_filter */
-	session_filter = g_strdup(c);
 
 session_done:
 	lprintf("Session filter key = \"%s\"", session_filter);
-	lprintf("Session program = \"%s\"", session_exec);
+	lprintf("Session program = \"%s\"%s", session_exec, wayland_session ? " (wayland)" : "");
 
 	setenv("X_DESKTOP_SESSION", session_filter, 1);
 	d_out();
@@ -480,7 +514,7 @@ void autostart_desktop_files(void)
 	if (getenv("XDG_CONFIG_DIRS"))
 		xdg_config_dirs = g_strdup(getenv("XDG_CONFIG_DIRS"));
 	else
-		xdg_config_dirs = g_strdup("/etc/xdg");
+		xdg_config_dirs = g_strdup_printf("%s/etc/xdg", sysroot);
 
 	/* count how many dirs are listed, so we can iterate backwards */
 	xdg_config_dir = g_strsplit(xdg_config_dirs, ";", -1);
@@ -505,67 +539,17 @@ void autostart_desktop_files(void)
 }
 
 
-static int uptime(float *up)
-{
-	FILE *uptime;
-	int ret;
-
-	uptime = fopen("/proc/uptime", "r");
-	if (!uptime) {
-		lprintf("Unable to open /proc/uptime! disabling synchronization!");
-		return -1;
-	}
-
-	ret = fscanf(uptime, "%*f %f", up);
-	if (ret < 1) {
-		lprintf("Error reading /proc/uptime (%d)! disabling synchronization!", ret);
-		fclose(uptime);
-		return -1;
-	}
-
-	fclose(uptime);
-	return 0;
-}
-
-
-static void do_timeout(void)
-{
-	float in, out;
-	int c = 0;
-
-	if (uptime(&in))
-		return;
-
-	while(1) {
-		usleep(100000);
-		c++;
-
-		if (uptime(&out))
-			return;
-
-		/* exit condition: there is "some" idle time available */
-		if (((out - in) / ((c > 5) ? 5.0 : c)) > 0.1)
-			break;
-
-		/* don't wait more than 15 seconds ever */
-		if (c >= 150)
-			break;
-	}
-	lprintf("do_timeout: done after %0.1fsecs", c / 10.0);
-}
-
-
 void do_autostart(void)
 {
 	GList *item;
 	struct desktop_entry_struct *entry;
-	int restarts = 0;
 	int last_prio = -1;
+	int launched = 0;
 
 	d_in();
 
 	/* sort by priority */
-	desktop_entries = g_list_sort(desktop_entries, sort_entries);
+	sort_desktop_entries();
 
 #if DEBUG
 	dprintf("desktop file queue:");
@@ -575,7 +559,7 @@ void do_autostart(void)
 		dprintf("==== file=%s ====", entry->file);
 		dprintf("exec=%s", entry->exec);
 		dprintf("prio=%d", entry->prio);
-		dprintf("wdog=%s", entry->watchdog);
+		dprintf("wdog=%s", watchdog_name(entry->watchdog));
 		item = g_list_next(item);
 	}
 #endif /* DEBUG */
@@ -583,91 +567,46 @@ void do_autostart(void)
 	item = g_list_first(desktop_entries);
 
 	while (item) {
-		char *ptrs[256];
-		int count = 0;
-		int ret = 0;
-		int pid;
-		int status;
+		pid_t pid;
 
 		entry = item->data;
 
 		if (!entry->exec) {
 			/* hidden item */
+			metrics_autostart("hidden");
 			item = g_list_next(item);
 			continue;
 		}
 
+		if (launched && entry->prio != last_prio)
+			metrics_bracket_done(last_prio);
 		if ((entry->prio != last_prio) || (entry->prio >= 3))
-			do_timeout();
+			wait_for_idle(sample_history);
+		if (entry->prio >= 2)
+			wait_for_input_quiet();
 		last_prio = entry->prio;
 
-		if (fork()) {
+		pid = zygote_spawn(entry->file, entry->exec, entry->prio, entry->watchdog);
+		if (pid < 0) {
+			lprintf("Failed to start %s", entry->exec);
+			metrics_autostart("fork_failed");
 			item = g_list_next(item);
 			continue;
 		}
 
-		if (entry->prio >= 1) {
-			syscall(__NR_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_IDLE_LOWEST);
-			ret = nice(5);
-		}
-
-		memset(ptrs, 0, sizeof(ptrs));
-
-		ptrs[0] = strtok(entry->exec, " \t");
-		while (ptrs[count] && count < 255)
-			ptrs[++count] = strtok(NULL, " \t");
-
-		usleep(delay);
-		dprintf("Starting %s:%s with prio %d at %d", entry->file, entry->exec, entry->prio, delay);
-
-		/* watchdog handling */
-		if (entry->watchdog == WD_NONE) {
-			execvp(ptrs[0], ptrs);
-			exit(ret);
-		}
-
-restart:
-		pid = fork();
-		if (pid == 0) {
-			execvp(ptrs[0], ptrs);
-			lprintf("Failed to execvp(%s)", entry->exec);
-			exit(EXIT_FAILURE);
-		} else if (pid < 0) {
-			lprintf("Failed to fork for %s", entry->exec);
-			exit(EXIT_FAILURE);
-		}
-
-		/* stop and wait for child to exit */
-		ret = waitpid(pid, &status, 0);
-
-		if (WIFEXITED(status))
-			lprintf("process %d (%s:%s) exited with exit code %d",
-				ret, entry->file, entry->exec, WEXITSTATUS(status));
-
-		if (WIFSIGNALED(status))
-			lprintf("process %d (%s:%s) was killed by signal %d",
-				ret, entry->file, entry->exec, WTERMSIG(status));
-
-		if (((entry->watchdog == WD_FAIL) && (WEXITSTATUS(status))) ||
-		    ((entry->watchdog == WD_FAIL) && (WIFSIGNALED(status))) ||
-		     (entry->watchdog == WD_RESTART)) {
-			/* safety: reasonable sleep here */
-			sleep((restarts++ < 5) ? restarts : 900); /* 15 mins */
-			lprintf("Watchdog: restarting %s:%s", entry->file, entry->exec);
-			goto restart;
-		}
-
-		if (entry->watchdog == WD_HALT) {
-			/* tear down the session */
-			lprintf("Watchdog: %s:%s exited, tearing down session", entry->file, entry->exec);
-			kill(session_pid, SIGTERM);
-			exit(EXIT_FAILURE);
-		}
-
-		lprintf("Watchdog: unhandled exception");
-		exit(EXIT_FAILURE);
+		if (entry->prio == -1)
+			boost_pid(pid);
+		if (entry->prio >= 2)
+			background_pid(pid);
+		history_forked(entry->file, entry->prio, pid);
+		metrics_autostart("started");
+		launched = 1;
+		item = g_list_next(item);
 	}
 
+	if (launched)
+		metrics_bracket_done(last_prio);
+
 	d_out();
 }
 
@@ -696,19 +635,28 @@ void start_desktop_session(void)
 	int ret;
 	int count = 0;
 	char *ptrs[256];
+	char cmd[PATH_MAX];
 
 	d_in();
 
+	setup_session_notify();
+
 	ret = fork();
 
 	if (ret) {
 		session_pid = ret;
+		session_notify_parent();
 		return; /* parent continues */
 	}
 
-	ret = system("/usr/bin/xdg-user-dirs-update");
+	session_notify_child();
+	log_output("session");
+
+	/* the session may need the user dirs right away, so wait for it */
+	snprintf(cmd, PATH_MAX, "%s/usr/bin/xdg-user-dirs-update", sysroot);
+	ret = start_daemon(NORMAL, cmd, NULL);
 	if (ret)
-		lprintf("/usr/bin/xdg-user-dirs-update failed");
+		lprintf("%s failed", cmd);
 
 	memset(ptrs, 0, sizeof(ptrs));
 
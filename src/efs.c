@@ -18,6 +18,9 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <limits.h>
+#include <string.h>
+#include <poll.h>
 #include "uxlaunch.h"
 
 
@@ -61,7 +64,6 @@ static int grep(const char *filename, const char *pattern)
 		return 1;
 	}
 	while (getline(&buf, &buf_n, f) > 0) {
-		printf("n: %d\n", buf_n);
 		if (strstr(buf, pattern)) {
 			ret = 0;
 			break;
@@ -77,44 +79,185 @@ static int grep(const char *filename, const char *pattern)
 
 
 /*
- * Check if the homedir is already mounted
+ * mountinfo escapes space, tab, newline and backslash as \ooo
  */
-static int ecryptfs_mounted(void)
+static void unescape_octal(char *s)
 {
-	char *search_pattern;
+	char *d = s;
+
+	while (*s) {
+		if (s[0] == '\\' && s[1] >= '0' && s[1] <= '7' &&
+		    s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+			*d++ = ((s[1] - '0') << 6) | ((s[2] - '0') << 3) | (s[3] - '0');
+			s += 4;
+		} else {
+			*d++ = *s++;
+		}
+	}
+	*d = '\0';
+}
+
+
+/*
+ * Check if the homedir is already mounted. /proc/self/mountinfo lines
+ * look like:
+ *
+ * 36 35 98:0 / /home/user rw,noatime master:1 - ecryptfs /home/.user rw
+ *
+ * with the mount point in field 5 and the fs type after the "-".
+ */
+static int ecryptfs_mounted(FILE *f)
+{
+	char *buf = NULL;
+	size_t buf_n;
+	int ret = 0;
 
 	d_in();
 
-	if (asprintf(&search_pattern, " %s ecryptfs ", pass->pw_dir) < 0) {
-		lprintf("Error: EFS: %s asprintf failed", __func__);
+	rewind(f);
+	while (getline(&buf, &buf_n, f) > 0) {
+		char *mnt;
+		char *fstype;
+		int n;
+
+		mnt = strtok(buf, " ");
+		for (n = 1; mnt && n < 5; n++)
+			mnt = strtok(NULL, " ");
+		if (!mnt)
+			continue;
+
+		fstype = strtok(NULL, " ");
+		while (fstype && strcmp(fstype, "-"))
+			fstype = strtok(NULL, " ");
+		if (fstype)
+			fstype = strtok(NULL, " ");
+		if (!fstype || strcmp(fstype, "ecryptfs"))
+			continue;
+
+		unescape_octal(mnt);
+		if (!strcmp(mnt, pass->pw_dir)) {
+			ret = 1;
+			break;
+		}
+	}
+
+	free(buf);
+
+	d_out();
+	return ret;
+}
+
+
+/*
+ * The mount table changing makes /proc/self/mountinfo signal POLLPRI,
+ * so we don't have to rescan it in a loop while waiting.
+ */
+static int wait_for_efs_mount(int timeout)
+{
+	struct pollfd pfd;
+	FILE *f;
+	int ret;
+
+	d_in();
+
+	f = fopen("/proc/self/mountinfo", "r");
+	if (!f) {
+		lprintf("Error: EFS: unable to open /proc/self/mountinfo");
 		return 0;
 	}
 
+	pfd.fd = fileno(f);
+	pfd.events = POLLPRI;
+
+	while (!(ret = ecryptfs_mounted(f))) {
+		if (poll(&pfd, 1, timeout) <= 0)
+			break;
+	}
+
+	fclose(f);
+
 	d_out();
-	return grep("/proc/mounts", search_pattern) == 0;
+	return ret;
 }
 
 
 static void start_greeter(void)
 {
 	int ret;
+	char cmd[PATH_MAX];
 
 	d_in();
 
 	init_screensaver(1);
 	/* wait for screensaver to close */
-	ret = system("/usr/bin/gnome-screensaver-command --wait");
+	snprintf(cmd, PATH_MAX, "%s/usr/bin/gnome-screensaver-command --wait", sysroot);
+	ret = system(cmd);
 	if (ret)
-		lprintf("Failed on /usr/bin/gnome-screensaver-command --wait, rc: %d", ret);
+		lprintf("Failed on %s, rc: %d", cmd, ret);
 
 	d_out();
 }
 
 
-void setup_efs(void)
+/*
+ * The greeter is a gnome-screensaver daemon, make sure it doesn't
+ * stay connected to the X server that we pass on to the session.
+ */
+static void stop_greeter(void)
 {
 	int ret;
-	pid_t pid;
+	char cmd[PATH_MAX];
+
+	d_in();
+
+	snprintf(cmd, PATH_MAX, "%s/usr/bin/gnome-screensaver-command --exit", sysroot);
+	ret = system(cmd);
+	if (ret)
+		lprintf("Failed on %s, rc: %d", cmd, ret);
+
+	d_out();
+}
+
+
+static pid_t efs_pid = 0;
+static pid_t modprobe_pid = 0;
+
+
+/*
+ * Load the ecryptfs module in the background, it has all the time
+ * it needs while PAM is set up and the user types a password.
+ */
+static void start_modprobe(void)
+{
+	char cmd[PATH_MAX];
+
+	d_in();
+
+	snprintf(cmd, PATH_MAX, "%s/sbin/modprobe", sysroot);
+
+	modprobe_pid = fork();
+	if (modprobe_pid < 0) {
+		lprintf("Error: EFS: failed to fork for modprobe");
+		modprobe_pid = 0;
+	} else if (modprobe_pid == 0) {
+		execl(cmd, cmd, "ecryptfs", NULL);
+		lprintf("Error: EFS: failed to exec %s", cmd);
+		_exit(EXIT_FAILURE);
+	}
+
+	d_out();
+}
+
+
+/*
+ * Start the greeter that mounts the encrypted home directory, if
+ * needed. This doesn't wait for it: call wait_for_efs() for that,
+ * once everything that doesn't need the home directory is done.
+ */
+void setup_efs(void)
+{
+	FILE *f;
+	int mounted;
 
 	d_in();
 
@@ -123,29 +266,44 @@ void setup_efs(void)
 		return;
 
 	/* do nothing if it's alreay mounted */
-	if (ecryptfs_mounted()) {
+	f = fopen("/proc/self/mountinfo", "r");
+	if (!f) {
+		lprintf("Error: EFS: unable to open /proc/self/mountinfo");
+		return;
+	}
+	mounted = ecryptfs_mounted(f);
+	fclose(f);
+	if (mounted) {
 		lprintf("EFS is already mounted, do nothing");
 		return;
 	}
 
-	if (grep("/proc/filesystems", "ecryptfs") != 0) {
-		ret = system("/sbin/modprobe ecryptfs");
-		if (0 != ret) {
-			lprintf("Error: EFS: failed to modprobe ecryptfs");
-			return;
-		}
-	}
+	if (grep("/proc/filesystems", "ecryptfs") != 0)
+		start_modprobe();
+
+#ifdef ENABLE_CHOOSER
+	wait_for_chooser();
+#endif
 
-	if ((pid = fork()) < 0) {
+	/* the chooser's X server is ours now, the greeter can use it */
+	prepare_X_handover();
+
+	if ((efs_pid = fork()) < 0) {
 		lprintf("Error: EFS: Failed to fork in setup_efs");
+		efs_pid = 0;
 		return;
-	} else if (pid == 0) {
+	} else if (efs_pid == 0) {
 		/* child process */
 		lprintf("EFS: start authentication");
 
 		switch_to_user();
-		start_X_server();
-		wait_for_X_signal();
+		/* the chooser may already have left us an X server */
+		if (!xpid) {
+			/* so the session can have it with a new cookie */
+			x_noreset = 0;
+			start_X_server();
+			wait_for_X_signal();
+		}
 
 		/* start dbus session */
 		start_dbus_session_bus();
@@ -153,21 +311,48 @@ void setup_efs(void)
 
 		lprintf("EFS: authentication success");
 
-		/* kill Xorg, clean up */
-		kill(xpid, SIGTERM);
-		wait_for_X_exit();
+		/* clean up, but keep Xorg running for the session */
+		stop_greeter();
 		stop_dbus_session_bus();
+		hand_over_X_server();
 
 		dprintf("EFS: looks all done, exiting thread");
 
 		exit(0);
 	}
 
-	/* parent */
-	if ((pid = waitpid(pid, &ret, 0)) < 0) {
-		lprintf("Error: EFS: setup_efs waitpid error");
-		return;
+	d_out();
+}
+
+
+/*
+ * Wait for the greeter to finish, and for the home directory to
+ * actually show up as mounted.
+ */
+void wait_for_efs(void)
+{
+	int status;
+
+	d_in();
+
+	if (modprobe_pid) {
+		if (waitpid(modprobe_pid, &status, 0) < 0 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status))
+			lprintf("Error: EFS: failed to modprobe ecryptfs");
+		modprobe_pid = 0;
 	}
 
+	if (!efs_pid)
+		return;
+
+	if (waitpid(efs_pid, &status, 0) < 0)
+		lprintf("Error: EFS: setup_efs waitpid error");
+	efs_pid = 0;
+
+	take_over_X_server();
+
+	if (!wait_for_efs_mount(5000))
+		lprintf("Error: EFS: %s is still not mounted", pass->pw_dir);
+
 	d_out();
 }
@@ -0,0 +1,393 @@
+/*
+ * This file is part of uxlaunch
+ *
+ * Autostart history: how long each autostart entry took to settle
+ * after it was forked, and how much CPU time and disk reads it cost,
+ * averaged over previous logins. Used to start the cheap entries of
+ * a bracket first, so they show up without waiting for the heavy ones.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <glib.h>
+
+#include "uxlaunch.h"
+
+#define HISTORY_MAGIC "uxlaunch-history 1"
+
+/* an entry has settled when it used no CPU for this many samples */
+#define SETTLE_SAMPLES 3
+/* sampling interval when we're done starting entries */
+#define SAMPLE_USECS 100000
+/* give up on entries that keep running after this */
+#define SETTLE_MAX (30 * 1000000ULL)
+
+/* what a byte read costs, in usecs: roughly a slow eMMC */
+#define READ_BYTES_PER_USEC 32
+
+struct history_struct {
+	uint64_t settle_usecs;
+	uint64_t cpu_usecs;
+	uint64_t read_bytes;
+	int runs;
+};
+
+/* by desktop file name */
+static GHashTable *history;
+static uint64_t default_cost;
+
+#define MAX_TRACKED 256
+
+static struct {
+	const char *file;
+	int prio;
+	pid_t pid;
+	uint64_t forked;
+	uint64_t settled;
+	uint64_t cpu;
+	uint64_t read_bytes;
+	int quiet;
+	int done;
+	int lost;
+} tracked[MAX_TRACKED];
+
+static int tracked_count = 0;
+
+
+static int history_path(char *path)
+{
+	if (!getenv("XDG_CACHE_HOME"))
+		return -1;
+
+	snprintf(path, PATH_MAX, "%s/uxlaunch/history", getenv("XDG_CACHE_HOME"));
+	return 0;
+}
+
+
+static uint64_t cost(const struct history_struct *h)
+{
+	return h->settle_usecs + h->cpu_usecs + h->read_bytes / READ_BYTES_PER_USEC;
+}
+
+
+/*
+ * Read the history file, once
+ */
+void load_history(void)
+{
+	FILE *f;
+	char path[PATH_MAX];
+	char line[PATH_MAX + 128];
+	char file[PATH_MAX];
+	struct history_struct *h;
+	unsigned long long settle, cpu, bytes;
+	uint64_t total = 0;
+	int runs;
+
+	if (history)
+		return;
+	history = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	if (history_path(path))
+		return;
+	f = fopen(path, "r");
+	if (!f)
+		return;
+
+	if (!fgets(line, sizeof(line), f) || strncmp(line, HISTORY_MAGIC, strlen(HISTORY_MAGIC)))
+		goto out;
+
+	/* <file> <runs> <settle usecs> <cpu usecs> <read bytes> */
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%4095s %d %llu %llu %llu", file, &runs,
+			   &settle, &cpu, &bytes) != 5)
+			continue;
+		h = g_new0(struct history_struct, 1);
+		h->runs = runs;
+		h->settle_usecs = settle;
+		h->cpu_usecs = cpu;
+		h->read_bytes = bytes;
+		g_hash_table_replace(history, g_strdup(file), h);
+		total += cost(h);
+	}
+
+	/* entries we don't know yet are assumed to be average */
+	if (g_hash_table_size(history))
+		default_cost = total / g_hash_table_size(history);
+
+out:
+	fclose(f);
+}
+
+
+/*
+ * Expected cost of starting an entry, in usecs
+ */
+uint64_t history_cost(const char *file)
+{
+	struct history_struct *h;
+
+	if (!history)
+		return 0;
+
+	h = g_hash_table_lookup(history, file);
+	return h ? cost(h) : default_cost;
+}
+
+
+void history_forked(const char *file, int prio, pid_t pid)
+{
+	if (tracked_count >= MAX_TRACKED)
+		return;
+
+	tracked[tracked_count].file = file;
+	tracked[tracked_count].prio = prio;
+	tracked[tracked_count].pid = pid;
+	tracked[tracked_count].forked = elapsed_usecs();
+	tracked[tracked_count].settled = tracked[tracked_count].forked;
+	tracked[tracked_count].cpu = 0;
+	tracked[tracked_count].read_bytes = 0;
+	tracked[tracked_count].quiet = 0;
+	tracked[tracked_count].done = 0;
+	tracked[tracked_count].lost = 0;
+	tracked_count++;
+}
+
+
+/*
+ * CPU time (usecs) and bytes read of a process. For watchdog entries,
+ * pid is our watchdog process, so count its children too.
+ */
+static int process_cost(pid_t pid, uint64_t *cpu, uint64_t *read_bytes, int depth)
+{
+	FILE *f;
+	char path[PATH_MAX];
+	char buf[1024];
+	unsigned long long utime, stime, bytes;
+	long hz = sysconf(_SC_CLK_TCK);
+	char *c;
+	int child;
+
+	snprintf(path, PATH_MAX, "/proc/%d/stat", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (!fgets(buf, sizeof(buf), f)) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	c = strrchr(buf, ')');
+	if (c && sscanf(c + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+			&utime, &stime) == 2 && hz > 0)
+		*cpu += (utime + stime) * 1000000ULL / hz;
+
+	snprintf(path, PATH_MAX, "/proc/%d/io", pid);
+	f = fopen(path, "r");
+	if (f) {
+		while (fgets(buf, sizeof(buf), f))
+			if (sscanf(buf, "read_bytes: %llu", &bytes) == 1)
+				*read_bytes += bytes;
+		fclose(f);
+	}
+
+	if (depth)
+		return 0;
+
+	snprintf(path, PATH_MAX, "/proc/%d/task/%d/children", pid, pid);
+	f = fopen(path, "r");
+	if (f) {
+		while (fscanf(f, "%d", &child) == 1)
+			process_cost(child, cpu, read_bytes, depth + 1);
+		fclose(f);
+	}
+
+	return 0;
+}
+
+
+/*
+ * Sample all entries that haven't settled yet. Called every 100ms
+ * while we wait for the system to become idle between brackets.
+ */
+void sample_history(void)
+{
+	uint64_t now = elapsed_usecs();
+	uint64_t cpu, read_bytes;
+	int i;
+
+	for (i = 0; i < tracked_count; i++) {
+		if (tracked[i].done)
+			continue;
+
+		cpu = read_bytes = 0;
+		if (process_cost(tracked[i].pid, &cpu, &read_bytes, 0)) {
+			/*
+			 * exited, e.g. after daemonizing. If we never saw it
+			 * do anything, the work went elsewhere and this run
+			 * tells us nothing about its cost.
+			 */
+			if (!tracked[i].cpu && !tracked[i].read_bytes)
+				tracked[i].lost = 1;
+			tracked[i].done = 1;
+			continue;
+		}
+
+		if (cpu != tracked[i].cpu || read_bytes != tracked[i].read_bytes) {
+			tracked[i].cpu = cpu;
+			tracked[i].read_bytes = read_bytes;
+			tracked[i].settled = now;
+			tracked[i].quiet = 0;
+		} else if (++tracked[i].quiet >= SETTLE_SAMPLES) {
+			tracked[i].done = 1;
+		}
+
+		if (now - tracked[i].forked >= SETTLE_MAX)
+			tracked[i].done = 1;
+	}
+}
+
+
+static void save_history(void)
+{
+	FILE *f;
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	char *c;
+	GList *keys, *item;
+	struct history_struct *h;
+
+	if (history_path(path))
+		return;
+
+	c = strrchr(path, '/');
+	*c = '\0';
+	mkdir(path, 0700);
+	*c = '/';
+
+	snprintf(tmp, PATH_MAX, "%s.tmp", path);
+	f = fopen(tmp, "w");
+	if (!f)
+		return;
+
+	fprintf(f, "%s\n", HISTORY_MAGIC);
+	keys = g_hash_table_get_keys(history);
+	for (item = keys; item; item = g_list_next(item)) {
+		h = g_hash_table_lookup(history, item->data);
+		fprintf(f, "%s %d %llu %llu %llu\n", (char *)item->data, h->runs,
+			(unsigned long long) h->settle_usecs,
+			(unsigned long long) h->cpu_usecs,
+			(unsigned long long) h->read_bytes);
+	}
+	g_list_free(keys);
+	fclose(f);
+
+	if (rename(tmp, path))
+		unlink(tmp);
+}
+
+
+/* weigh the last login like the three before it together */
+#define AVERAGE(old, new) (((old) * 3 + (new)) / 4)
+
+static void record(int i)
+{
+	struct history_struct *h;
+	uint64_t settle = tracked[i].settled - tracked[i].forked;
+
+	/* keep the old history rather than learn a zero cost */
+	if (tracked[i].lost) {
+		dprintf("history: %s exited before it could be sampled", tracked[i].file);
+		return;
+	}
+
+	h = g_hash_table_lookup(history, tracked[i].file);
+	if (!h) {
+		h = g_new0(struct history_struct, 1);
+		h->settle_usecs = settle;
+		h->cpu_usecs = tracked[i].cpu;
+		h->read_bytes = tracked[i].read_bytes;
+		g_hash_table_replace(history, g_strdup(tracked[i].file), h);
+	} else {
+		h->settle_usecs = AVERAGE(h->settle_usecs, settle);
+		h->cpu_usecs = AVERAGE(h->cpu_usecs, tracked[i].cpu);
+		h->read_bytes = AVERAGE(h->read_bytes, tracked[i].read_bytes);
+	}
+	h->runs++;
+
+	dprintf("history: %s settled after %llums, %llums cpu, %llu bytes read",
+		tracked[i].file, (unsigned long long) settle / 1000,
+		(unsigned long long) tracked[i].cpu / 1000,
+		(unsigned long long) tracked[i].read_bytes);
+}
+
+
+/*
+ * Fork and settle times for the boot record
+ */
+void history_write_entries(FILE *f)
+{
+	int i;
+
+	for (i = 0; i < tracked_count; i++) {
+		if (strpbrk(tracked[i].file, " \t\n"))
+			continue;
+		fprintf(f, "entry %s %d %llu %llu\n", tracked[i].file, tracked[i].prio,
+			(unsigned long long) tracked[i].forked,
+			(unsigned long long) tracked[i].settled);
+	}
+}
+
+
+/*
+ * The last bracket has been forked. Keep sampling in the background
+ * until everything settled, then update the history file and write
+ * the boot record.
+ */
+void finish_history(void)
+{
+	pid_t pid;
+	int i, busy;
+
+	if (!tracked_count || !history) {
+		write_boot_record();
+		return;
+	}
+
+	pid = fork();
+	if (pid < 0)
+		lprintf("Failed to fork for the autostart history");
+	if (pid != 0)
+		return;
+
+	stop_oom_task();
+
+	do {
+		usleep(SAMPLE_USECS);
+		sample_history();
+		busy = 0;
+		for (i = 0; i < tracked_count; i++)
+			if (!tracked[i].done)
+				busy = 1;
+	} while (busy);
+
+	for (i = 0; i < tracked_count; i++)
+		record(i);
+	save_history();
+	write_boot_record();
+
+	lprintf("history: recorded %d autostart entries", tracked_count);
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,217 @@
+/*
+ * This file is part of uxlaunch
+ *
+ * Startup with the home directory on a network filesystem. Every file
+ * we touch in $HOME before the first pixel is a round trip to the
+ * server then, so in remote home mode:
+ *
+ * - Xauthority and the X log go to the runtime dir instead
+ * - the files we and the login shell are going to look at are looked
+ *   up all at once, in parallel, so the later sequential accesses hit
+ *   the client's caches
+ * - writes that can wait (~/.cache) are done once the session is up
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+#include "uxlaunch.h"
+
+/* -1: detect, 0: local, 1: remote */
+int remote_home = -1;
+
+static const struct {
+	unsigned long magic;
+	const char *name;
+} remote_fs[] = {
+	{ 0x6969,     "nfs" },
+	{ 0x517b,     "smbfs" },
+	{ 0xff534d42, "cifs" },
+	{ 0xfe534d42, "smb2" },
+	{ 0x564c,     "ncpfs" },
+	{ 0x73757245, "coda" },
+	{ 0x5346414f, "afs" },
+	{ 0x6b414653, "kafs" },
+	{ 0x01021997, "9p" },
+	{ 0x00c36400, "ceph" },
+	{ 0x0bd00bd0, "lustre" },
+	{ 0x01161970, "gfs2" },
+	{ 0x7461636f, "ocfs2" },
+};
+
+/*
+ * Looked up in parallel in remote home mode. Files are read, so their
+ * data is cached too, directories are read with their entries.
+ */
+static const char *prefetch_files[] = {
+	".bash_profile",
+	".bash_login",
+	".profile",
+	".bashrc",
+	".config/i18n",
+	".config/lock-screen",
+	".config/xsessions",
+	".config/autostart",
+	".cache/uxlaunch/sessions",
+	".cache/uxlaunch/history",
+};
+
+#define PREFETCH_COUNT (sizeof(prefetch_files) / sizeof(prefetch_files[0]))
+
+static char prefetch_paths[PREFETCH_COUNT][PATH_MAX];
+
+
+/*
+ * Called after switching to the user, so root squashing doesn't get
+ * in the way
+ */
+void check_home(void)
+{
+	struct statfs sfs;
+	unsigned int i;
+
+	d_in();
+
+	if (remote_home >= 0) {
+		lprintf("remote home mode %s by configuration", remote_home ? "on" : "off");
+		d_out();
+		return;
+	}
+
+	remote_home = 0;
+	if (statfs(pass->pw_dir, &sfs)) {
+		lprintf("Unable to statfs %s", pass->pw_dir);
+		d_out();
+		return;
+	}
+
+	for (i = 0; i < sizeof(remote_fs) / sizeof(remote_fs[0]); i++) {
+		if ((unsigned long)sfs.f_type == remote_fs[i].magic) {
+			lprintf("%s is on %s, using remote home mode", pass->pw_dir, remote_fs[i].name);
+			remote_home = 1;
+			break;
+		}
+	}
+
+	d_out();
+}
+
+
+static void prefetch_dir(int fd, const char *path)
+{
+	char file[PATH_MAX];
+	struct dirent *entry;
+	struct stat st;
+	DIR *dir;
+
+	dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return;
+	}
+	while ((entry = readdir(dir))) {
+		if (entry->d_name[0] == '.')
+			continue;
+		snprintf(file, PATH_MAX, "%s/%s", path, entry->d_name);
+		stat(file, &st);
+	}
+	closedir(dir);
+}
+
+
+static void *prefetch_thread(void *arg)
+{
+	const char *path = arg;
+	char buf[65536];
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (!fstat(fd, &st) && S_ISDIR(st.st_mode)) {
+		prefetch_dir(fd, path);
+		return NULL;
+	}
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	close(fd);
+	return NULL;
+}
+
+
+/*
+ * Start one lookup per file, and don't wait for them: whoever gets to
+ * a file first waits for the server, the others find it cached.
+ */
+void prefetch_home(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	unsigned int i;
+
+	if (remote_home <= 0)
+		return;
+
+	d_in();
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attr, 128 * 1024);
+
+	for (i = 0; i < PREFETCH_COUNT; i++) {
+		snprintf(prefetch_paths[i], PATH_MAX, "%s/%s", pass->pw_dir, prefetch_files[i]);
+		if (pthread_create(&thread, &attr, prefetch_thread, prefetch_paths[i]))
+			break;
+	}
+
+	pthread_attr_destroy(&attr);
+
+	d_out();
+}
+
+
+/*
+ * Put a file that would go into $HOME in the runtime dir instead, in
+ * remote home mode
+ */
+void home_file_path(char *path, const char *name)
+{
+	if (remote_home > 0 && runtime_dir[0] != '\0')
+		snprintf(path, PATH_MAX, "%s/%s", runtime_dir, name);
+	else
+		snprintf(path, PATH_MAX, "%s/.%s", pass->pw_dir, name);
+}
+
+
+/*
+ * The writes that were held back, once the session is up
+ */
+void flush_home_writes(void)
+{
+	if (remote_home <= 0)
+		return;
+
+	d_in();
+
+	if (getenv("XDG_CACHE_HOME"))
+		mkdir(getenv("XDG_CACHE_HOME"), 0700);
+	flush_sessions_cache();
+
+	d_out();
+}
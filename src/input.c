@@ -0,0 +1,163 @@
+/*
+ * This file is part of uxlaunch
+ *
+ * Hold back Low and Late autostart programs while the user is typing
+ * or moving the mouse. The input devices are opened while we're still
+ * root, and are only read to see that there is activity.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/epoll.h>
+
+#include "uxlaunch.h"
+
+/* ms without input before Low and Late programs start, 0 disables */
+int input_quiet = 0;
+/* seconds, the most we hold back the autostart in total */
+int input_max = 30;
+
+static int epoll_fd = -1;
+static uint64_t last_input;
+static uint64_t deferred_usecs;
+
+
+void open_input_devices(void)
+{
+	DIR *dir;
+	struct dirent *entry;
+	struct epoll_event ev;
+	char path[PATH_MAX];
+	int count = 0;
+	int fd;
+
+	if (input_quiet <= 0)
+		return;
+
+	d_in();
+
+	dir = opendir("/dev/input");
+	if (!dir) {
+		lprintf("input: unable to open /dev/input");
+		return;
+	}
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		closedir(dir);
+		return;
+	}
+
+	while ((entry = readdir(dir))) {
+		if (strncmp(entry->d_name, "event", 5))
+			continue;
+
+		snprintf(path, PATH_MAX, "/dev/input/%s", entry->d_name);
+		fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+			close(fd);
+			continue;
+		}
+		count++;
+	}
+	closedir(dir);
+
+	lprintf("input: watching %d input devices", count);
+
+	d_out();
+}
+
+
+/*
+ * Read all pending input events, and remember when there were any.
+ * timeout is in ms, like epoll_wait(). Devices that were unplugged
+ * keep reporting an error, those are dropped.
+ */
+static void read_input(int timeout)
+{
+	struct epoll_event ev[16];
+	char buf[1024];
+	int i, n, fd;
+	int got;
+
+	while ((n = epoll_wait(epoll_fd, ev, 16, timeout)) > 0) {
+		got = 0;
+		for (i = 0; i < n; i++) {
+			fd = ev[i].data.fd;
+			while (read(fd, buf, sizeof(buf)) > 0)
+				got = 1;
+			if (ev[i].events & (EPOLLERR | EPOLLHUP)) {
+				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+				close(fd);
+			}
+		}
+		if (got)
+			last_input = elapsed_usecs();
+		timeout = 0;
+	}
+}
+
+
+/*
+ * Wait until there has been no input for input_quiet ms, lowering the
+ * CPU weight of the background programs meanwhile. Gives up once
+ * input_max seconds have been spent waiting in total.
+ */
+void wait_for_input_quiet(void)
+{
+	uint64_t start, now, quiet;
+	int lowered = 0;
+
+	if (epoll_fd < 0)
+		return;
+
+	start = elapsed_usecs();
+	quiet = input_quiet * 1000ULL;
+
+	read_input(0);
+
+	for (;;) {
+		now = elapsed_usecs();
+		if (!last_input || now - last_input >= quiet)
+			break;
+		if (deferred_usecs + (now - start) >= input_max * 1000000ULL) {
+			lprintf("input: still busy, not holding back the autostart any longer");
+			break;
+		}
+
+		if (!lowered) {
+			background_nice(1);
+			lowered = 1;
+		}
+
+		read_input((quiet - (now - last_input) + 999) / 1000);
+	}
+
+	if (lowered)
+		background_nice(0);
+
+	now = elapsed_usecs();
+	if (now - start >= 1000) {
+		deferred_usecs += now - start;
+		lprintf("input: held back the autostart for %llums",
+			(unsigned long long) (now - start) / 1000);
+	}
+}
@@ -0,0 +1,261 @@
+/*
+ * This file is part of uxlaunch
+ *
+ * A .desktop file reader for the few keys we look at. The file is
+ * mmap()ed, only the [Desktop Entry] group is looked at, and the
+ * values point into the mapping, so looking up keys doesn't allocate
+ * anything. Values are unescaped like GKeyFile does only when they are
+ * copied out with keyfile_string(). A malformed file is an error for
+ * the caller to skip, not a reason to abort.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "uxlaunch.h"
+
+#define DESKTOP_GROUP "Desktop Entry"
+
+
+int keyfile_open(struct keyfile *kf, const char *path)
+{
+	struct stat st;
+	int fd;
+
+	kf->data = NULL;
+	kf->size = 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return -1;
+	}
+
+	/* an empty file is valid, it just has no keys */
+	if (st.st_size > 0) {
+		kf->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (kf->data == MAP_FAILED) {
+			kf->data = NULL;
+			close(fd);
+			return -1;
+		}
+		kf->size = st.st_size;
+	}
+
+	close(fd);
+	return 0;
+}
+
+
+void keyfile_close(struct keyfile *kf)
+{
+	if (kf->data)
+		munmap(kf->data, kf->size);
+	kf->data = NULL;
+	kf->size = 0;
+}
+
+
+static int is_blank(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+
+/*
+ * Point each of keys at its value in the [Desktop Entry] group, or
+ * NULL. The last one wins if a key appears twice, like in GKeyFile.
+ * Returns -1 if the file doesn't look like a key file, up to the end
+ * of that group; the groups after it aren't looked at.
+ */
+int keyfile_lookup(struct keyfile *kf, struct keyfile_key *keys, int count)
+{
+	const char *p = kf->data;
+	const char *end = kf->data + kf->size;
+	const char *s, *e, *eq, *k;
+	int in_group = 0;
+	int seen_group = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		keys[i].value = NULL;
+		keys[i].len = 0;
+	}
+
+	for (; p < end; p = e + 1) {
+		e = memchr(p, '\n', end - p);
+		if (!e)
+			e = end;
+
+		s = p;
+		while (s < e && is_blank(*s))
+			s++;
+		k = e;
+		if (k > s && k[-1] == '\r')
+			k--;
+		if (s == k || *s == '#')
+			continue;
+
+		if (*s == '[') {
+			eq = memchr(s, ']', k - s);
+			if (!eq)
+				return -1;
+			/* the entry group is done */
+			if (in_group)
+				return 0;
+			in_group = (eq - s - 1 == sizeof(DESKTOP_GROUP) - 1) &&
+				   !memcmp(s + 1, DESKTOP_GROUP, sizeof(DESKTOP_GROUP) - 1);
+			seen_group = 1;
+			continue;
+		}
+
+		/* keys before the first group */
+		if (!seen_group)
+			return -1;
+		if (!in_group)
+			continue;
+
+		eq = memchr(s, '=', k - s);
+		if (!eq || eq == s)
+			return -1;
+
+		/* "Key = value" is allowed */
+		p = eq;
+		while (p > s && is_blank(p[-1]))
+			p--;
+		eq++;
+		while (eq < k && is_blank(*eq))
+			eq++;
+
+		for (i = 0; i < count; i++) {
+			if (strlen(keys[i].name) != (size_t)(p - s) ||
+			    memcmp(keys[i].name, s, p - s))
+				continue;
+			keys[i].value = eq;
+			keys[i].len = k - eq;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * Copy out the value, with the \s, \n, \t, \r and \\ escapes of the
+ * desktop entry spec resolved. NULL if the key isn't set, has another
+ * escape (which GKeyFile rejects too) or doesn't fit.
+ */
+char *keyfile_string(const struct keyfile_key *key, char *buf, int size)
+{
+	int i, n = 0;
+	char c;
+
+	if (!key->value)
+		return NULL;
+
+	for (i = 0; i < key->len; i++) {
+		c = key->value[i];
+		if (c == '\\') {
+			if (++i == key->len)
+				return NULL;
+			switch (key->value[i]) {
+			case 's':
+				c = ' ';
+				break;
+			case 'n':
+				c = '\n';
+				break;
+			case 't':
+				c = '\t';
+				break;
+			case 'r':
+				c = '\r';
+				break;
+			case '\\':
+				c = '\\';
+				break;
+			default:
+				return NULL;
+			}
+		}
+		if (n >= size - 1)
+			return NULL;
+		buf[n++] = c;
+	}
+	buf[n] = '\0';
+
+	return buf;
+}
+
+
+/*
+ * Whether a ";" separated list like OnlyShowIn contains word, ignoring
+ * ASCII case
+ */
+int keyfile_list_match(const struct keyfile_key *key, const char *word)
+{
+	const char *p = key->value;
+	const char *end = key->value + key->len;
+	const char *e;
+	size_t len;
+
+	if (!p || !word)
+		return 0;
+
+	len = strlen(word);
+	for (; p < end; p = e + 1) {
+		e = memchr(p, ';', end - p);
+		if (!e)
+			e = end;
+		if ((size_t)(e - p) == len && !strncasecmp(p, word, len))
+			return 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Whether the value contains word, ignoring ASCII case
+ */
+int keyfile_value_has(const struct keyfile_key *key, const char *word)
+{
+	size_t len = strlen(word);
+	int i;
+
+	if (!key->value)
+		return 0;
+
+	for (i = 0; i + len <= (size_t)key->len; i++)
+		if (!strncasecmp(key->value + i, word, len))
+			return 1;
+
+	return 0;
+}
+
+
+int keyfile_boolean(const struct keyfile_key *key)
+{
+	int len = key->len;
+
+	if (!key->value)
+		return 0;
+	while (len > 0 && is_blank(key->value[len - 1]))
+		len--;
+
+	return (len == 4 && !memcmp(key->value, "true", 4)) ||
+	       (len == 1 && key->value[0] == '1');
+}
@@ -19,18 +19,71 @@
 #include <stdint.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <string.h>
 #include <syslog.h> 
+#include <limits.h>
 
 #include "uxlaunch.h"
 
 
 extern char **environ;
 
+/*
+ * Prefix for all the configuration and helper paths we use, so that
+ * the whole startup sequence can be run against a fake filesystem
+ * root (e.g. `make bench-boot`). Empty on normal systems.
+ */
+char sysroot[PATH_MAX] = "";
+
 static int first_time = 1;
 
 static struct timeval start;
+static uint64_t start_boottime;
 
+struct phase_struct {
+	const char *name;
+	uint64_t usecs;
+};
+
+static struct phase_struct phases[MAX_PHASES];
+static int phase_count = 0;
+
+
+static void start_clock(void)
+{
+	struct timespec ts;
+
+	if (first_time) {
+		first_time = 0;
+		gettimeofday(&start, NULL);
+		if (!clock_gettime(CLOCK_BOOTTIME, &ts))
+			start_boottime = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+	}
+}
+
+/*
+ * microseconds passed between kernel boot and uxlaunch starting
+ */
+uint64_t boot_usecs(void)
+{
+	start_clock();
+	return start_boottime;
+}
+
+/*
+ * microseconds passed since uxlaunch started
+ */
+uint64_t elapsed_usecs(void)
+{
+	struct timeval current;
+
+	start_clock();
+	gettimeofday(&current, NULL);
+
+	return (current.tv_sec - start.tv_sec) * 1000000ULL +
+		current.tv_usec - start.tv_usec;
+}
 
 void lprintf(const char* fmt, ...)
 {
@@ -40,10 +93,7 @@ void lprintf(const char* fmt, ...)
 	char string[8192];
 	char msg[8192];
 
-	if (first_time) {
-		first_time = 0;
-		gettimeofday(&start, NULL);
-	}
+	start_clock();
 
 	va_start(args, fmt);
 	vsnprintf(msg, 8192, fmt, args);
@@ -92,3 +142,125 @@ void log_environment(void)
 	dprintf("---");
 #endif
 }
+
+
+/*
+ * Record that a startup phase has completed. The duration of a phase
+ * is the time between its mark and the previous one.
+ */
+void mark_phase(const char *name)
+{
+	uint64_t usecs = elapsed_usecs();
+
+	if (phase_count < MAX_PHASES) {
+		phases[phase_count].name = name;
+		phases[phase_count].usecs = usecs;
+		phase_count++;
+	}
+
+	lprintf("phase %s: %llu.%06llu", name,
+		(unsigned long long) usecs / 1000000,
+		(unsigned long long) usecs % 1000000);
+}
+
+/*
+ * Look up when a phase completed, returns -1 if it didn't (yet)
+ */
+int phase_usecs(const char *name, uint64_t *usecs)
+{
+	int i;
+
+	for (i = 0; i < phase_count; i++) {
+		if (!strcmp(phases[i].name, name)) {
+			*usecs = phases[i].usecs;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * The i-th phase in the order they completed, returns -1 past the end
+ */
+int phase_at(int i, const char **name, uint64_t *usecs)
+{
+	if (i < 0 || i >= phase_count)
+		return -1;
+
+	*name = phases[i].name;
+	*usecs = phases[i].usecs;
+	return 0;
+}
+
+
+/*
+ * Resident and proportional set size of this process, in bytes
+ */
+int memory_usage(uint64_t *rss, uint64_t *pss)
+{
+	FILE *file;
+	char line[256];
+	unsigned long long kb;
+	int found = 0;
+
+	file = fopen("/proc/self/smaps_rollup", "r");
+	if (!file)
+		return -1;
+
+	while (fgets(line, sizeof(line), file)) {
+		if (sscanf(line, "Rss: %llu kB", &kb) == 1) {
+			*rss = kb * 1024;
+			found |= 1;
+		} else if (sscanf(line, "Pss: %llu kB", &kb) == 1) {
+			*pss = kb * 1024;
+			found |= 2;
+		}
+	}
+	fclose(file);
+
+	return found == 3 ? 0 : -1;
+}
+
+
+void hand_over_phases(struct handover *h)
+{
+	int i;
+
+	start_clock();
+	h->verbose = verbose;
+	strncpy(h->sysroot, sysroot, PATH_MAX - 1);
+	h->start_usecs = start.tv_sec * 1000000ULL + start.tv_usec;
+	h->start_boottime = start_boottime;
+
+	h->phase_count = phase_count;
+	for (i = 0; i < phase_count; i++) {
+		strncpy(h->phases[i].name, phases[i].name, sizeof(h->phases[i].name) - 1);
+		h->phases[i].usecs = phases[i].usecs;
+	}
+}
+
+
+/*
+ * In the supervisor: keep the clock and the phases of uxlaunch, the
+ * names point into h, which stays around
+ */
+void take_over_phases(struct handover *h)
+{
+	int i;
+
+	verbose = h->verbose;
+	strncpy(sysroot, h->sysroot, PATH_MAX - 1);
+
+	first_time = 0;
+	start.tv_sec = h->start_usecs / 1000000;
+	start.tv_usec = h->start_usecs % 1000000;
+	start_boottime = h->start_boottime;
+
+	phase_count = h->phase_count < MAX_PHASES ? h->phase_count : MAX_PHASES;
+	for (i = 0; i < phase_count; i++) {
+		h->phases[i].name[sizeof(h->phases[i].name) - 1] = '\0';
+		phases[i].name = h->phases[i].name;
+		phases[i].usecs = h->phases[i].usecs;
+	}
+}
@@ -0,0 +1,485 @@
+/*
+ * This file is part of uxlaunch
+ *
+ * Session output logger. Instead of having X, the session and all
+ * autostart programs append to one ~/.xsession-errors, each of them
+ * gets its own pipe to a logger process, which tags every line with
+ * where it came from, rate limits each source, and writes a ring of
+ * size capped files on tmpfs. The ring is only copied to
+ * ~/.xsession-errors when something crashed, or on SIGUSR1.
+ *
+ * The read ends of the pipes are passed to the logger over a
+ * SOCK_SEQPACKET socket pair with SCM_RIGHTS, the tag as payload.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+
+#include "uxlaunch.h"
+
+/* KB of output kept on tmpfs, 0 disables the logger */
+int log_size = 1024;
+/* lines per second per source, averaged over LOG_WINDOW, 0 is unlimited */
+int log_rate = 20;
+
+pid_t logger_pid = 0;
+
+#define LOG_WINDOW 10000000ULL
+#define RING_FILES 4
+#define MAX_SOURCES 128
+#define LINE_MAX_LEN 1024
+
+static int logger_fd = -1;	/* our end of the connection to the logger */
+
+/*
+ * The rest is logger state
+ */
+
+static struct {
+	int fd;
+	char tag[64];
+	char buf[LINE_MAX_LEN];
+	int len;
+	uint64_t window;
+	int lines;
+	int dropped;
+} sources[MAX_SOURCES];
+
+static int source_count = 0;
+
+static char ring_dir[PATH_MAX];
+static int ring_fd = -1;
+static int ring_cur = 0;
+static off_t ring_used = 0;
+
+
+/*
+ * Send our stdout and stderr to the logger, tagged with tag. Called in
+ * forked children right before they exec.
+ */
+int log_output(const char *tag)
+{
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char control[CMSG_SPACE(sizeof(int))];
+	int fds[2];
+	int ret;
+
+	if (logger_fd < 0)
+		return -1;
+
+	if (pipe(fds))
+		return -1;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = (void *)tag;
+	iov.iov_len = strlen(tag) + 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fds[0], sizeof(int));
+
+	ret = sendmsg(logger_fd, &msg, MSG_NOSIGNAL);
+	close(fds[0]);
+	if (ret < 0) {
+		close(fds[1]);
+		return -1;
+	}
+
+	dup2(fds[1], STDOUT_FILENO);
+	dup2(fds[1], STDERR_FILENO);
+	close(fds[1]);
+
+	return 0;
+}
+
+
+/*
+ * Ask the logger to copy the ring to ~/.xsession-errors
+ */
+void flush_log(void)
+{
+	if (logger_pid > 0)
+		kill(logger_pid, SIGUSR1);
+}
+
+
+/*
+ * Did a process die in a way that makes its output worth keeping?
+ */
+int crashed(int status)
+{
+	if (!WIFSIGNALED(status))
+		return 0;
+
+	switch (WTERMSIG(status)) {
+	case SIGSEGV:
+	case SIGBUS:
+	case SIGILL:
+	case SIGFPE:
+	case SIGABRT:
+		return 1;
+	}
+
+	return 0;
+}
+
+
+static int setup_ring(void)
+{
+	struct stat st;
+
+	if (getenv("XDG_RUNTIME_DIR"))
+		snprintf(ring_dir, PATH_MAX, "%s/uxlaunch-log-%d", getenv("XDG_RUNTIME_DIR"),
+			 atoi(displayname + 1));
+	else
+		snprintf(ring_dir, PATH_MAX, "/dev/shm/uxlaunch-log-%d-%d", getuid(),
+			 atoi(displayname + 1));
+
+	mkdir(ring_dir, 0700);
+	/* /dev/shm is shared, don't log into someone else's directory */
+	if (lstat(ring_dir, &st) || !S_ISDIR(st.st_mode) || st.st_uid != getuid()) {
+		lprintf("log: unable to use %s", ring_dir);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static void open_ring_file(int n)
+{
+	char path[PATH_MAX];
+
+	if (ring_fd >= 0)
+		close(ring_fd);
+
+	ring_cur = n;
+	ring_used = 0;
+	snprintf(path, PATH_MAX, "%s/%d", ring_dir, n);
+	ring_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+}
+
+
+static void ring_write(const char *line, size_t len)
+{
+	if (ring_used + (off_t)len > log_size * 1024LL / RING_FILES)
+		open_ring_file((ring_cur + 1) % RING_FILES);
+	if (ring_fd < 0)
+		return;
+
+	if (write(ring_fd, line, len) > 0)
+		ring_used += len;
+}
+
+
+static void report_dropped(int i, uint64_t now)
+{
+	char line[128];
+	int l;
+
+	if (!sources[i].dropped)
+		return;
+	l = snprintf(line, sizeof(line), "[%llu.%03llu] [%s] (%d lines suppressed)\n",
+		     (unsigned long long) now / 1000000,
+		     (unsigned long long) now / 1000 % 1000,
+		     sources[i].tag, sources[i].dropped);
+	if (l >= (int)sizeof(line))
+		l = sizeof(line) - 1;
+	ring_write(line, l);
+	sources[i].dropped = 0;
+}
+
+
+static void emit(int i, const char *text, int len)
+{
+	char line[LINE_MAX_LEN + 128];
+	uint64_t now = elapsed_usecs();
+	uint64_t window = now / LOG_WINDOW;
+	int l;
+
+	if (sources[i].window != window) {
+		report_dropped(i, now);
+		sources[i].window = window;
+		sources[i].lines = 0;
+		sources[i].dropped = 0;
+	}
+
+	if (log_rate > 0 && sources[i].lines >= log_rate * (int)(LOG_WINDOW / 1000000)) {
+		sources[i].dropped++;
+		return;
+	}
+	sources[i].lines++;
+
+	l = snprintf(line, sizeof(line), "[%llu.%03llu] [%s] %.*s\n",
+		     (unsigned long long) now / 1000000,
+		     (unsigned long long) now / 1000 % 1000,
+		     sources[i].tag, len, text);
+	if (l >= (int)sizeof(line))
+		l = sizeof(line) - 1;
+	ring_write(line, l);
+}
+
+
+/*
+ * Read what's there, and emit complete lines. Returns -1 at EOF.
+ */
+static int read_source(int i)
+{
+	ssize_t len;
+	char *nl;
+	int start;
+
+	len = read(sources[i].fd, sources[i].buf + sources[i].len,
+		   LINE_MAX_LEN - sources[i].len);
+	if (len <= 0) {
+		if (len < 0 && errno == EAGAIN)
+			return 0;
+		if (sources[i].len)
+			emit(i, sources[i].buf, sources[i].len);
+		report_dropped(i, elapsed_usecs());
+		return -1;
+	}
+	sources[i].len += len;
+
+	start = 0;
+	while ((nl = memchr(sources[i].buf + start, '\n', sources[i].len - start))) {
+		emit(i, sources[i].buf + start, nl - (sources[i].buf + start));
+		start = nl - sources[i].buf + 1;
+	}
+
+	/* a line that doesn't fit gets cut */
+	if (start == 0 && sources[i].len == LINE_MAX_LEN) {
+		emit(i, sources[i].buf, sources[i].len);
+		start = sources[i].len;
+	}
+
+	memmove(sources[i].buf, sources[i].buf + start, sources[i].len - start);
+	sources[i].len -= start;
+
+	return 0;
+}
+
+
+static void add_source(int ctl)
+{
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char control[CMSG_SPACE(sizeof(int))];
+	char tag[64];
+	ssize_t len;
+	int fd = -1;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(tag, 0, sizeof(tag));
+	iov.iov_base = tag;
+	iov.iov_len = sizeof(tag) - 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	len = recvmsg(ctl, &msg, MSG_CMSG_CLOEXEC);
+	if (len <= 0)
+		return;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	if (fd < 0)
+		return;
+
+	if (source_count >= MAX_SOURCES) {
+		/* the writer gets EPIPE, which is better than blocking */
+		close(fd);
+		return;
+	}
+
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	memset(&sources[source_count], 0, sizeof(sources[0]));
+	sources[source_count].fd = fd;
+	strncpy(sources[source_count].tag, tag, sizeof(sources[0].tag) - 1);
+	source_count++;
+}
+
+
+static void copy_file(int to, const char *path)
+{
+	char buf[65536];
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
+		if (write(to, buf, len) != len)
+			break;
+	close(fd);
+}
+
+
+/*
+ * Copy the ring, oldest file first, to ~/.xsession-errors. This is the
+ * only time the log touches the disk.
+ */
+static void flush_ring(void)
+{
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	char seg[PATH_MAX];
+	int fd;
+	int i;
+
+	if (!getenv("HOME"))
+		return;
+
+	snprintf(path, PATH_MAX, "%s/.xsession-errors", getenv("HOME"));
+	snprintf(tmp, PATH_MAX, "%s.tmp", path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return;
+
+	for (i = 1; i <= RING_FILES; i++) {
+		snprintf(seg, PATH_MAX, "%s/%d", ring_dir, (ring_cur + i) % RING_FILES);
+		copy_file(fd, seg);
+	}
+
+	fsync(fd);
+	close(fd);
+	if (rename(tmp, path))
+		unlink(tmp);
+	else
+		lprintf("log: flushed to %s", path);
+}
+
+
+static void logger_loop(int ctl, int sfd)
+{
+	struct pollfd pfd[2 + MAX_SOURCES];
+	struct signalfd_siginfo si;
+	int i, n;
+
+	while (ctl >= 0 || source_count) {
+		pfd[0].fd = sfd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = ctl;
+		pfd[1].events = POLLIN;
+		for (i = 0; i < source_count; i++) {
+			pfd[2 + i].fd = sources[i].fd;
+			pfd[2 + i].events = POLLIN;
+		}
+		n = 2 + source_count;
+
+		if (poll(pfd, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (pfd[0].revents & POLLIN) {
+			while (read(sfd, &si, sizeof(si)) > 0)
+				;
+			flush_ring();
+		}
+
+		for (i = n - 3; i >= 0; i--) {
+			if (!pfd[2 + i].revents)
+				continue;
+			if (!read_source(i))
+				continue;
+			close(sources[i].fd);
+			sources[i] = sources[--source_count];
+		}
+
+		if (pfd[1].revents & POLLIN)
+			add_source(ctl);
+		else if (pfd[1].revents & (POLLHUP | POLLERR)) {
+			close(ctl);
+			ctl = -1;
+		}
+	}
+}
+
+
+/*
+ * Start the logger, and send our own output to it. Returns -1 if the
+ * logger is disabled or can't run, so the caller can fall back to
+ * ~/.xsession-errors.
+ */
+int start_logger(void)
+{
+	sigset_t mask;
+	int fds[2];
+	int sfd;
+
+	if (log_size <= 0)
+		return -1;
+
+	d_in();
+
+	if (setup_ring())
+		return -1;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds)) {
+		lprintf("log: unable to create the logger socket: %s", strerror(errno));
+		return -1;
+	}
+
+	logger_pid = fork();
+	if (logger_pid < 0) {
+		lprintf("log: failed to fork the logger");
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	if (logger_pid == 0) {
+		close(fds[0]);
+		stop_oom_task();
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGUSR1);
+		sigprocmask(SIG_BLOCK, &mask, NULL);
+		sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+		open_ring_file(0);
+		logger_loop(fds[1], sfd);
+		exit(EXIT_SUCCESS);
+	}
+
+	close(fds[1]);
+	logger_fd = fds[0];
+	lprintf("log: session output goes to %s [%d]", ring_dir, logger_pid);
+
+	log_output("uxlaunch");
+
+	d_out();
+	return 0;
+}
@@ -0,0 +1,318 @@
+/*
+ * This file is part of uxlaunch
+ *
+ * Startup metrics, written in the node_exporter textfile collector
+ * format so that login times can be collected across many machines.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+
+#include "uxlaunch.h"
+
+/* empty: don't write metrics */
+char metrics_dir[PATH_MAX] = "";
+
+/* file name prefix, each seat has its own files */
+static char metrics_name[32] = "uxlaunch";
+
+/* X-Priority brackets, Highest (-1) through Late (3) */
+static const char *bracket_names[BRACKETS] = {
+	"Highest", "High", "Normal", "Low", "Late"
+};
+
+static int bracket_done[BRACKETS];
+static uint64_t bracket_usecs[BRACKETS];
+
+static struct {
+	const char *name;
+	int count;
+} outcomes[OUTCOMES] = {
+	{ "started", 0 },
+	{ "hidden", 0 },
+	{ "fork_failed", 0 },
+};
+
+/* our own memory use, at the end of startup and in the supervisor */
+static const char *memory_stages[MEM_STAGES] = {
+	"startup", "supervisor"
+};
+
+static uint64_t memory_rss[MEM_STAGES];
+static uint64_t memory_pss[MEM_STAGES];
+
+
+/*
+ * label values need ", \ and newlines escaped
+ */
+static void escape_label(char *dst, size_t len, const char *src)
+{
+	size_t i = 0;
+
+	while (*src && i + 2 < len) {
+		if (*src == '"' || *src == '\\') {
+			dst[i++] = '\\';
+			dst[i++] = *src;
+		} else if (*src == '\n') {
+			dst[i++] = '\\';
+			dst[i++] = 'n';
+		} else {
+			dst[i++] = *src;
+		}
+		src++;
+	}
+	dst[i] = '\0';
+}
+
+/*
+ * The collector may read the file at any time, so write a hidden
+ * temporary file and rename() it into place.
+ */
+static FILE *open_metrics(const char *name, char *tmp, char *path)
+{
+	FILE *f;
+
+	snprintf(path, PATH_MAX, "%s/%s.prom", metrics_dir, name);
+	snprintf(tmp, PATH_MAX, "%s/.%s.prom.%d", metrics_dir, name, getpid());
+
+	f = fopen(tmp, "w");
+	if (!f)
+		lprintf("Unable to write metrics file %s", tmp);
+	return f;
+}
+
+static void close_metrics(FILE *f, const char *tmp, const char *path)
+{
+	if (fclose(f) || rename(tmp, path)) {
+		lprintf("Unable to update metrics file %s", path);
+		unlink(tmp);
+	}
+}
+
+static void gauge(FILE *f, const char *name, const char *help, double value)
+{
+	fprintf(f, "# HELP %s %s\n", name, help);
+	fprintf(f, "# TYPE %s gauge\n", name);
+	fprintf(f, "%s %f\n", name, value);
+}
+
+/*
+ * watchdog counters are per session, drop the ones of the last session
+ * on this seat before the zygote can start any watchdog of this one.
+ * A --new-vt session is told apart by its display.
+ */
+void init_metrics(int seat, int display)
+{
+	DIR *dir;
+	struct dirent *entry;
+	char path[PATH_MAX];
+	char prefix[64];
+
+	if (seat >= 0)
+		snprintf(metrics_name, sizeof(metrics_name), "uxlaunch-seat%d", seat);
+	else if (display >= 0)
+		snprintf(metrics_name, sizeof(metrics_name), "uxlaunch-display%d", display);
+
+	if (metrics_dir[0] == '\0')
+		return;
+
+	snprintf(prefix, sizeof(prefix), "%s-watchdog-", metrics_name);
+
+	dir = opendir(metrics_dir);
+	if (!dir)
+		return;
+
+	while ((entry = readdir(dir))) {
+		if (strncmp(entry->d_name, prefix, strlen(prefix)))
+			continue;
+		snprintf(path, PATH_MAX, "%s/%s", metrics_dir, entry->d_name);
+		unlink(path);
+	}
+	closedir(dir);
+}
+
+void metrics_bracket_done(int prio)
+{
+	int i = prio + 1;
+
+	if (i < 0 || i >= BRACKETS || bracket_done[i])
+		return;
+
+	bracket_done[i] = 1;
+	bracket_usecs[i] = elapsed_usecs();
+}
+
+void metrics_autostart(const char *outcome)
+{
+	int i;
+
+	for (i = 0; i < OUTCOMES; i++)
+		if (!strcmp(outcomes[i].name, outcome))
+			outcomes[i].count++;
+}
+
+void metrics_memory(int stage, uint64_t rss, uint64_t pss)
+{
+	if (stage < 0 || stage >= MEM_STAGES)
+		return;
+
+	memory_rss[stage] = rss;
+	memory_pss[stage] = pss;
+}
+
+/*
+ * Called from the watchdog process of an autostart entry, which has
+ * no other way to report back, so each entry gets its own file.
+ */
+void metrics_watchdog_restart(const char *file, int restarts)
+{
+	FILE *f;
+	char name[PATH_MAX];
+	char tmp[PATH_MAX];
+	char path[PATH_MAX];
+	char label[PATH_MAX];
+
+	if (metrics_dir[0] == '\0')
+		return;
+
+	snprintf(name, PATH_MAX, "%s-watchdog-%s", metrics_name, file);
+	f = open_metrics(name, tmp, path);
+	if (!f)
+		return;
+
+	escape_label(label, PATH_MAX, file);
+	fprintf(f, "# HELP uxlaunch_watchdog_restarts_total Autostart entry restarts by its X-Watchdog\n");
+	fprintf(f, "# TYPE uxlaunch_watchdog_restarts_total counter\n");
+	fprintf(f, "uxlaunch_watchdog_restarts_total{entry=\"%s\"} %d\n", label, restarts);
+
+	close_metrics(f, tmp, path);
+}
+
+/*
+ * (Re)write the main metrics file from the phases recorded so far
+ */
+void write_metrics(void)
+{
+	FILE *f;
+	char tmp[PATH_MAX];
+	char path[PATH_MAX];
+	uint64_t xready = 0;
+	uint64_t session, end;
+	int have_xready;
+	int i;
+
+	if (metrics_dir[0] == '\0')
+		return;
+
+	d_in();
+
+	f = open_metrics(metrics_name, tmp, path);
+	if (!f)
+		return;
+
+	have_xready = !phase_usecs("xready", &xready);
+	if (have_xready) {
+		gauge(f, "uxlaunch_boot_to_x_ready_seconds",
+		      "Time from kernel boot until the X server was ready",
+		      (boot_usecs() + xready) / 1000000.0);
+		if (!phase_usecs("session", &session))
+			gauge(f, "uxlaunch_x_ready_to_session_seconds",
+			      "Time from X server ready until the session process was started",
+			      (session - xready) / 1000000.0);
+	}
+
+	fprintf(f, "# HELP uxlaunch_autostart_bracket_seconds Time from X server ready until all entries of an X-Priority bracket were launched\n");
+	fprintf(f, "# TYPE uxlaunch_autostart_bracket_seconds gauge\n");
+	for (i = 0; i < BRACKETS; i++)
+		if (bracket_done[i])
+			fprintf(f, "uxlaunch_autostart_bracket_seconds{bracket=\"%s\"} %f\n",
+				bracket_names[i],
+				(bracket_usecs[i] - xready) / 1000000.0);
+
+	fprintf(f, "# HELP uxlaunch_autostart_entries Autostart entries by outcome\n");
+	fprintf(f, "# TYPE uxlaunch_autostart_entries gauge\n");
+	for (i = 0; i < OUTCOMES; i++)
+		fprintf(f, "uxlaunch_autostart_entries{outcome=\"%s\"} %d\n",
+			outcomes[i].name, outcomes[i].count);
+
+	fprintf(f, "# HELP uxlaunch_memory_rss_bytes Resident set size of uxlaunch\n");
+	fprintf(f, "# TYPE uxlaunch_memory_rss_bytes gauge\n");
+	for (i = 0; i < MEM_STAGES; i++)
+		if (memory_rss[i])
+			fprintf(f, "uxlaunch_memory_rss_bytes{stage=\"%s\"} %llu\n",
+				memory_stages[i], (unsigned long long)memory_rss[i]);
+	fprintf(f, "# HELP uxlaunch_memory_pss_bytes Proportional set size of uxlaunch\n");
+	fprintf(f, "# TYPE uxlaunch_memory_pss_bytes gauge\n");
+	for (i = 0; i < MEM_STAGES; i++)
+		if (memory_pss[i])
+			fprintf(f, "uxlaunch_memory_pss_bytes{stage=\"%s\"} %llu\n",
+				memory_stages[i], (unsigned long long)memory_pss[i]);
+
+	if (!phase_usecs("session", &session)) {
+		int active = phase_usecs("exit", &end);
+
+		if (active)
+			end = elapsed_usecs();
+		gauge(f, "uxlaunch_session_active",
+		      "Whether the desktop session is still running", active ? 1 : 0);
+		gauge(f, "uxlaunch_session_duration_seconds",
+		      "Time the desktop session has been running",
+		      (end - session) / 1000000.0);
+	}
+
+	close_metrics(f, tmp, path);
+
+	d_out();
+}
+
+
+void hand_over_metrics(struct handover *h)
+{
+	int i;
+
+	strncpy(h->metrics_dir, metrics_dir, PATH_MAX - 1);
+	strncpy(h->metrics_name, metrics_name, sizeof(h->metrics_name) - 1);
+	for (i = 0; i < BRACKETS; i++) {
+		h->bracket_done[i] = bracket_done[i];
+		h->bracket_usecs[i] = bracket_usecs[i];
+	}
+	for (i = 0; i < OUTCOMES; i++)
+		h->outcomes[i] = outcomes[i].count;
+	for (i = 0; i < MEM_STAGES; i++) {
+		h->rss[i] = memory_rss[i];
+		h->pss[i] = memory_pss[i];
+	}
+}
+
+
+/*
+ * In the supervisor, which rewrites the metrics file when the session
+ * ends. The watchdog metrics of this session are already in place.
+ */
+void take_over_metrics(struct handover *h)
+{
+	int i;
+
+	strncpy(metrics_dir, h->metrics_dir, PATH_MAX - 1);
+	strncpy(metrics_name, h->metrics_name, sizeof(metrics_name) - 1);
+	for (i = 0; i < BRACKETS; i++) {
+		bracket_done[i] = h->bracket_done[i];
+		bracket_usecs[i] = h->bracket_usecs[i];
+	}
+	for (i = 0; i < OUTCOMES; i++)
+		outcomes[i].count = h->outcomes[i];
+	for (i = 0; i < MEM_STAGES; i++) {
+		memory_rss[i] = h->rss[i];
+		memory_pss[i] = h->pss[i];
+	}
+}
@@ -17,59 +17,51 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <limits.h>
 
 #include "uxlaunch.h"
 
-static int ssh_agent_pid;
+static pid_t ssh_agent_pid;
+static char ssh_agent_dir[PATH_MAX];
+static char ssh_agent_sock[PATH_MAX];
 
 /*
- * ssh-agent prints a bunch of env variables to its stdout that we need to put in
- * the environment.
+ * Run ssh-agent in the foreground on a socket we pick ourselves, so we
+ * know its pid and socket without parsing its output.
  */
 void start_ssh_agent(void)
 {
-	FILE *file;
-	char line[4096];
+	char cmd[PATH_MAX];
+	char args[PATH_MAX + 8];
+	char pid[16];
 
 	d_in();
 
-	memset(line, 0, 4096);
+	/* the runtime dir is private already, /tmp needs a dir of our own */
+	if (getenv("XDG_RUNTIME_DIR"))
+		snprintf(ssh_agent_dir, PATH_MAX, "%s/ssh-XXXXXX", getenv("XDG_RUNTIME_DIR"));
+	else
+		strcpy(ssh_agent_dir, "/tmp/ssh-XXXXXXXXXX");
+	if (!mkdtemp(ssh_agent_dir)) {
+		lprintf("Failed to create ssh-agent socket directory");
+		ssh_agent_dir[0] = '\0';
+		return;
+	}
+	snprintf(ssh_agent_sock, PATH_MAX, "%s/agent.%d", ssh_agent_dir, getpid());
 
-	file = popen("/usr/bin/ssh-agent", "r");
-	if (!file) {
+	snprintf(cmd, PATH_MAX, "%s/usr/bin/ssh-agent", sysroot);
+	snprintf(args, sizeof(args), "-D -a %s", ssh_agent_sock);
+	ssh_agent_pid = start_daemon(PIN | BACKGROUND, cmd, args);
+	if (ssh_agent_pid < 0) {
 		lprintf("Failed to start ssh-agent");
+		ssh_agent_pid = 0;
+		rmdir(ssh_agent_dir);
 		return;
 	}
-	/*
-	 * ssh-agent output looks like this:
-	 *
-	 * SSH_AUTH_SOCK=/tmp/ssh-ccZMs16230/agent.16230; export SSH_AUTH_SOCK;
-	 * SSH_AGENT_PID=16231; export SSH_AGENT_PID;
-	 * echo Agent pid 16231;
-	 *
-	 * so search for "; export", cut that off. Then split at the = for env var name
-	 * and value.
-	 */
-	while (!feof(file)) {
-		char *c;
-		if (fgets(line, 4095, file)==NULL)
-			break;
-		c = strstr(line, "; export");
-		if (c) {
-			char *c2;
-			*c = 0;
-			c2 = strchr(line, '=');
-			if (c2) {
-				*c2 = 0;
-				c2++;
-				setenv(line, c2, 1);
-				/* store PID for later */
-				if (!strcmp(line, "SSH_AGENT_PID"))
-					ssh_agent_pid = atoi(c2);
-			}
-		}
-	}
-	pclose(file);
+
+	snprintf(pid, sizeof(pid), "%d", ssh_agent_pid);
+	setenv("SSH_AUTH_SOCK", ssh_agent_sock, 1);
+	setenv("SSH_AGENT_PID", pid, 1);
 
 	d_out();
 }
@@ -77,10 +69,21 @@ void start_ssh_agent(void)
 void stop_ssh_agent(void)
 {
 	d_in();
-	kill(ssh_agent_pid, SIGTERM);
+	stop_daemon(ssh_agent_pid);
+	if (ssh_agent_dir[0] != '\0') {
+		unlink(ssh_agent_sock);
+		rmdir(ssh_agent_dir);
+	}
 	d_out();
 }
 
+void hand_over_ssh_agent(struct handover *h)
+{
+	h->ssh_agent_pid = ssh_agent_pid;
+	strncpy(h->ssh_agent_dir, ssh_agent_dir, PATH_MAX - 1);
+	strncpy(h->ssh_agent_sock, ssh_agent_sock, PATH_MAX - 1);
+}
+
 /*
  * helper function to make debug easier
  */
@@ -103,12 +106,10 @@ void start_bash(void)
  */
 void start_gconf(void)
 {
-	int ret;
-
 	d_in();
-	ret = system("gconftool-2 --spawn");
-	if (ret)
-		lprintf("failed to start gconftool-2: %d", ret);
+	/* --spawn waits for gconfd to come up, we don't have to */
+	if (start_daemon(PIN | BACKGROUND, "gconftool-2", "--spawn") < 0)
+		lprintf("failed to start gconftool-2");
 	d_out();
 }
 
@@ -120,7 +121,7 @@ void stop_gconf(void)
 	int ret;
 
 	d_in();
-	ret = system("gconftool-2 --shutdown");
+	ret = start_daemon(NORMAL, "gconftool-2", "--shutdown");
 	if (ret)
 		lprintf("failed to shut down gconf %d", ret);
 	d_out();
@@ -129,20 +130,22 @@ void stop_gconf(void)
 void init_screensaver(int lock_now)
 {
 	int ret;
+	char cmd[PATH_MAX];
 
 	d_in();
+	snprintf(cmd, PATH_MAX, "%s/usr/bin/gnome-screensaver", sysroot);
 	if (lock_now) {
-		ret = system("/usr/bin/gnome-screensaver");
+		ret = start_daemon(NORMAL, cmd, NULL);
 		if (ret)
-			lprintf("failed to launch /usr/bin/gnome-screensaver");
-		ret = system("/usr/bin/gnome-screensaver-command --lock --poke");
+			lprintf("failed to launch %s", cmd);
+		snprintf(cmd, PATH_MAX, "%s/usr/bin/gnome-screensaver-command", sysroot);
+		ret = start_daemon(NORMAL, cmd, "--lock --poke");
 		if (ret)
-			lprintf("failed to launch /usr/bin/gnome-screensaver-command --lock --poke");
+			lprintf("failed to launch %s", cmd);
 	} else {
 		/* the screensaver becomes a daemon .. but we don't need it right away */
-		ret = system("/usr/bin/gnome-screensaver &");
-		if (ret)
-			lprintf("failed to launch /usr/bin/gnome-screensaver");
+		if (start_daemon(NICE | PIN | DELAYED | BACKGROUND, cmd, "--no-daemon") < 0)
+			lprintf("failed to launch %s", cmd);
 	}
 	d_out();
 }
@@ -159,10 +162,12 @@ void init_screensaver(int lock_now)
 void maybe_start_screensaver(void)
 {
 	char home_path[4097];
+	char path[PATH_MAX];
 
 	d_in();
 	sprintf(home_path, "%s/.config/lock-screen", pass->pw_dir);
-	if (!access("/etc/sysconfig/lock-screen", R_OK) ||
+	snprintf(path, PATH_MAX, "%s/etc/sysconfig/lock-screen", sysroot);
+	if (!access(path, R_OK) ||
 	    !access(home_path, R_OK)) {
 		init_screensaver(1);
 	} else {
@@ -0,0 +1,180 @@
+/*
+ * This file is part of uxlaunch
+ *
+ * Session readiness notification. The session process gets one end of
+ * a SOCK_SEQPACKET socket pair, the fd number of which is in
+ * $UXLAUNCH_NOTIFY_FD, and sends "READY=1" on it once the window manager
+ * is managing the screen. Like sd_notify(), a message may hold several
+ * newline separated KEY=VALUE assignments; STATUS= is logged. uxlaunch
+ * stops listening after READY=1 or a timeout, so send with MSG_NOSIGNAL.
+ *
+ * Sessions that declare X-UXLaunch-Notify=true in their session file
+ * are waited for before the Highest autostart bracket is started. The
+ * uxlaunch-notify tool can send the message for sessions that don't
+ * know about this.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "uxlaunch.h"
+
+#define NOTIFY_FD_ENV "UXLAUNCH_NOTIFY_FD"
+
+/* set from the session file */
+int session_notify = 0;
+/* seconds to wait for READY=1 */
+int session_ready_timeout = 10;
+
+static int notify_fd[2] = { -1, -1 };
+
+
+/*
+ * Called before forking the session
+ */
+void setup_session_notify(void)
+{
+	if (!session_notify)
+		return;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, notify_fd)) {
+		lprintf("Unable to create the session notify socket: %s", strerror(errno));
+		notify_fd[0] = notify_fd[1] = -1;
+	}
+}
+
+
+/*
+ * In the session process: hand it our end of the socket
+ */
+void session_notify_child(void)
+{
+	char fd[16];
+
+	if (notify_fd[1] < 0)
+		return;
+
+	close(notify_fd[0]);
+	fcntl(notify_fd[1], F_SETFD, 0);
+	snprintf(fd, 16, "%d", notify_fd[1]);
+	setenv(NOTIFY_FD_ENV, fd, 1);
+}
+
+
+/*
+ * In uxlaunch, right after forking the session: only the session may
+ * hold the other end, or a session that dies early is never noticed
+ */
+void session_notify_parent(void)
+{
+	if (notify_fd[1] < 0)
+		return;
+
+	close(notify_fd[1]);
+	notify_fd[1] = -1;
+}
+
+
+/*
+ * In forked helpers that don't exec, like the zygote
+ */
+void drop_session_notify(void)
+{
+	if (notify_fd[0] >= 0)
+		close(notify_fd[0]);
+	if (notify_fd[1] >= 0)
+		close(notify_fd[1]);
+	notify_fd[0] = notify_fd[1] = -1;
+}
+
+
+/*
+ * Returns 1 if the message says READY=1
+ */
+static int parse_notify(char *msg)
+{
+	char *line, *save = NULL;
+	int ready = 0;
+
+	for (line = strtok_r(msg, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+		if (!strcmp(line, "READY=1"))
+			ready = 1;
+		else if (!strncmp(line, "STATUS=", 7))
+			lprintf("session: %s", line + 7);
+	}
+
+	return ready;
+}
+
+
+/*
+ * Wait until the session says it is ready, or for session_ready_timeout
+ * seconds at most
+ */
+void wait_for_session_ready(void)
+{
+	struct pollfd pfd;
+	char msg[1024];
+	uint64_t start, end, now;
+	ssize_t len;
+	int ready = 0;
+
+	if (notify_fd[0] < 0)
+		return;
+
+	d_in();
+
+	start = elapsed_usecs();
+	end = start + session_ready_timeout * 1000000ULL;
+
+	pfd.fd = notify_fd[0];
+	pfd.events = POLLIN;
+
+	while (!ready) {
+		now = elapsed_usecs();
+		if (now >= end) {
+			lprintf("session: not ready after %ds, starting the autostart anyway",
+				session_ready_timeout);
+			break;
+		}
+
+		if (poll(&pfd, 1, (end - now + 999) / 1000) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (pfd.revents & POLLIN) {
+			len = recv(notify_fd[0], msg, sizeof(msg) - 1, MSG_DONTWAIT);
+			if (len > 0) {
+				msg[len] = '\0';
+				ready = parse_notify(msg);
+				continue;
+			}
+		}
+		if (pfd.revents & (POLLHUP | POLLERR)) {
+			lprintf("session: exited or closed the notify socket before it was ready");
+			break;
+		}
+	}
+
+	if (ready)
+		lprintf("session: ready after %llums",
+			(unsigned long long) (elapsed_usecs() - start) / 1000);
+
+	close(notify_fd[0]);
+	notify_fd[0] = -1;
+
+	d_out();
+}
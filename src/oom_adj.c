@@ -12,6 +12,7 @@
  * of the License.
  */
 
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdio.h>
 #include <stdarg.h>
@@ -24,16 +25,128 @@
 #include <string.h>
 #include <limits.h>
 #include <errno.h>
+#include <poll.h>
+#include <pwd.h>
 
 #include "uxlaunch.h"
 
+static int oom_pipe[2];
+static int oom_task_running = 0;
 
-struct oom_adj_struct {
-	pid_t pid;
-	int prio;
-};
+/*
+ * The users whose processes the helper acts on, fixed when it is forked.
+ * Anything the session user runs could write to the pipe, so the helper
+ * doesn't take a pid or uid from a request at face value.
+ */
+#define MAX_SESSION_UIDS 16
+static uid_t session_uids[MAX_SESSION_UIDS];
+static int session_uid_count = 0;
 
-static int oom_pipe[2];
+/* the uxlaunch (or seat supervisor) that forked the helper */
+static pid_t launcher_pid;
+static int session_taken = 0;
+
+
+static void write_oom_score_adj(pid_t pid, int prio)
+{
+	char path[PATH_MAX];
+	char val[16];
+	int fd;
+
+	dprintf("OOM thread: got request pid=%d prio=%d", pid, prio);
+	snprintf(path, PATH_MAX, "/proc/%d/oom_score_adj", pid);
+	snprintf(val, 16, "%d", prio);
+	fd = open(path, O_WRONLY);
+	if (fd < 0) {
+		lprintf("Failed to write oom_core_dj score file: %s",
+		path);
+		return;
+	}
+	if (write(fd, &val, strlen(val)) < 0)
+		lprintf("Failed to write oom_score_adj value: %s: %d",
+			path, prio);
+	close(fd);
+}
+
+
+int helper_uid_allowed(uid_t uid)
+{
+	int i;
+
+	for (i = 0; i < session_uid_count; i++)
+		if (session_uids[i] == uid)
+			return 1;
+	return 0;
+}
+
+
+/*
+ * Is pid a process of one of the session users? Setuid programs they
+ * start keep their real uid, which is why it's not the effective one.
+ */
+int helper_pid_allowed(pid_t pid)
+{
+	char path[PATH_MAX];
+	char line[256];
+	FILE *f;
+	unsigned int uid;
+	int ret = 0;
+
+	if (pid <= 0)
+		return 0;
+
+	snprintf(path, PATH_MAX, "/proc/%d/status", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "Uid: %u", &uid) == 1) {
+			ret = helper_uid_allowed(uid);
+			break;
+		}
+	fclose(f);
+
+	return ret;
+}
+
+
+static int request_pid_ok(pid_t pid)
+{
+	if (helper_pid_allowed(pid))
+		return 1;
+	lprintf("Helper: ignoring request for pid %d, not a session process", pid);
+	return 0;
+}
+
+
+/*
+ * Walk up the PPid chain of pid, is the process that forked us on it?
+ */
+static int descends_from_launcher(pid_t pid)
+{
+	char path[PATH_MAX];
+	char line[256];
+	FILE *f;
+	int ppid;
+
+	while (pid > 1) {
+		snprintf(path, PATH_MAX, "/proc/%d/status", pid);
+		f = fopen(path, "r");
+		if (!f)
+			return 0;
+		ppid = 0;
+		while (fgets(line, sizeof(line), f))
+			if (sscanf(line, "PPid: %d", &ppid) == 1)
+				break;
+		fclose(f);
+
+		if (ppid == launcher_pid)
+			return 1;
+		pid = ppid;
+	}
+
+	return 0;
+}
 
 
 void start_oom_task(void)
@@ -43,11 +156,18 @@ void start_oom_task(void)
 
 	d_in();
 
-	if (pipe(oom_pipe) == -1) {
+	/* already started, e.g. shared between seats */
+	if (oom_task_running)
+		return;
+
+	/* only ever inherited by forks of ours, and the supervisor */
+	if (pipe2(oom_pipe, O_CLOEXEC) == -1) {
 		lprintf("Failed to open oom_adj pipe");
 		exit(EXIT_FAILURE);
 	}
 
+	launcher_pid = getpid();
+
 	pid = fork();
 	if (pid == -1) {
 		lprintf("Failed to fork oom_adj task");
@@ -56,6 +176,7 @@ void start_oom_task(void)
 
 	if (pid != 0) {
 		close(oom_pipe[0]);
+		oom_task_running = 1;
 		d_out();
 		return;
 	}
@@ -63,30 +184,88 @@ void start_oom_task(void)
 	/* child */
 	close(oom_pipe[1]);
 
+	/* pass is set by now, by the options or the chooser */
+	if (seat_count)
+		session_uid_count = seat_uids(session_uids, MAX_SESSION_UIDS);
+	else if (pass)
+		session_uids[session_uid_count++] = pass->pw_uid;
+
 	dprintf("oom thread: child setup succesfully");
 
 	/* handle requests */
-	while (read(oom_pipe[0], &request, sizeof(request)) > 0) {
-		char path[PATH_MAX];
-		char val[16];
-		int fd;
-
-		dprintf("OOM thread: got request pid=%d prio=%d", request.pid, request.prio);
-		snprintf(path, PATH_MAX, "/proc/%d/oom_score_adj", request.pid);
-		snprintf(val, 16, "%d", request.prio);
-		fd = open(path, O_WRONLY);
-		if (fd < 0) {
-			lprintf("Failed to write oom_core_dj score file: %s",
-			path);
-			continue;
+	for (;;) {
+		struct pollfd pfd[1 + PSI_FDS + 1];
+		int timeout, t;
+		int n, psi, ret;
+
+		pfd[0].fd = oom_pipe[0];
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+		psi = pressure_pollfds(pfd + 1);
+		n = 1 + psi + vt_pollfds(pfd + 1 + psi);
+
+		timeout = helper_boost_timeout();
+		t = pressure_timeout();
+		if (t >= 0 && (timeout < 0 || t < timeout))
+			timeout = t;
+
+		ret = poll(pfd, n, timeout);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
 		}
-		if (write(fd, &val, strlen(val)) < 0)
-			lprintf("Failed to write oom_score_adj value: %s: %d",
-				path, request.prio);
-		close(fd);
 
+		helper_boost_expire();
+		pressure_check(pfd + 1, psi);
+		vt_check(pfd + 1 + psi, n - 1 - psi);
+
+		if (!pfd[0].revents)
+			continue;
+		if (read(oom_pipe[0], &request, sizeof(request)) <= 0)
+			break;
+
+		switch (request.type) {
+		case REQ_OOM_ADJ:
+			if (request_pid_ok(request.pid))
+				write_oom_score_adj(request.pid, request.prio);
+			break;
+		case REQ_BOOST:
+			if (request_pid_ok(request.pid))
+				helper_boost(request.pid);
+			break;
+		case REQ_UNBOOST:
+			helper_unboost("autostart done");
+			break;
+		case REQ_BACKGROUND:
+			if (request_pid_ok(request.pid))
+				helper_background(request.pid);
+			break;
+		case REQ_NICE:
+			helper_background_nice(request.prio);
+			break;
+		case REQ_SESSION:
+			/* the zygote of our session, and only the first one */
+			if (session_taken || !request_pid_ok(request.pid) ||
+			    !descends_from_launcher(request.pid)) {
+				lprintf("Helper: ignoring session leader %d", request.pid);
+				break;
+			}
+			session_taken = 1;
+			helper_session(request.pid);
+			helper_watch_vt();
+			break;
+		case REQ_RUNTIME_HOLD:
+		case REQ_RUNTIME_RELEASE:
+			helper_runtime_dir(request.prio, request.type == REQ_RUNTIME_HOLD);
+			break;
+		}
 	}
 
+	helper_unboost("exiting");
+	helper_pressure_exit();
+	helper_runtime_exit();
+
 	/* close pipe and exit */
 	close(oom_pipe[0]);
 	d_out();
@@ -95,25 +274,49 @@ void start_oom_task(void)
 }
 
 
+/*
+ * Also called in forked children that don't exec: the helper only
+ * finishes once every copy of the pipe is closed
+ */
 void stop_oom_task(void)
 {
 	d_in();
-	close(oom_pipe[1]);
+	if (oom_task_running)
+		close(oom_pipe[1]);
+	oom_task_running = 0;
 	d_out();
 }
 
 
-void oom_adj(int pid, int prio)
+/*
+ * The supervisor sends its requests on the same pipe
+ */
+void hand_over_oom_task(struct handover *h)
 {
-	struct oom_adj_struct request;
+	h->helper_fd = oom_task_running ? oom_pipe[1] : -1;
+	if (oom_task_running)
+		keep_fd(oom_pipe[1]);
+}
 
-	d_in();
 
+void helper_request(int type, pid_t pid, int val)
+{
+	struct oom_adj_struct request;
+
+	memset(&request, 0, sizeof(request));
+	request.type = type;
 	request.pid = pid;
-	request.prio = prio;
+	request.prio = val;
 
 	if (write(oom_pipe[1], &request, sizeof(request)) < 0)
-		lprintf("Error: unable to write to oom_adj pipe: pid [%d] "
-			"prio %d", pid, prio);
+		lprintf("Error: unable to write to oom_adj pipe: request %d "
+			"pid [%d] value %d", type, pid, val);
+}
+
+
+void oom_adj(int pid, int prio)
+{
+	d_in();
+	helper_request(REQ_OOM_ADJ, pid, prio);
 	d_out();
 }
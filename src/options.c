@@ -29,6 +29,10 @@
 int tty = 1;
 #ifdef ENABLE_CHOOSER
 char chooser[256] = "";
+
+/* found while looking for a default user, offered by the chooser */
+struct home_user_struct home_users[MAX_HOME_USERS];
+int home_user_count = 0;
 #endif
 char session[256] = "default";
 char username[256] = DEFAULT_USERNAME;
@@ -37,8 +41,12 @@ char addn_xopts[256] = "";
 
 int verbose = 0;
 int x_session_only = 0;
+int dry_run = 0;
 int settle = 0;
 
+static int analyze = 0;
+static int diff = 0;
+
 static struct option opts[] = {
 #ifdef ENABLE_CHOOSER
 	{ "chooser",  1, NULL, 'c' },
@@ -48,6 +56,10 @@ static struct option opts[] = {
 	{ "session",  1, NULL, 's' },
 	{ "xsession", 0, NULL, 'x' },
 	{ "settle",   0, NULL, 'S' },
+	{ "new-vt",   0, NULL, 'N' },
+	{ "dry-run",  0, NULL, 'D' },
+	{ "analyze",  0, NULL, 'A' },
+	{ "diff",     0, NULL, 'd' },
 	{ "help",     0, NULL, 'h' },
 	{ "verbose",  0, NULL, 'v' },
 	{ NULL, 0, NULL, 0 }
@@ -65,6 +77,12 @@ static void usage(const char *name)
 	printf("  -s, --session   Start a non-default session\n");
 	printf("  -x, --xsession  Start X apps inside an existing X session\n");
 	printf("  -S, --settle    Wait for udev to settle\n");
+	printf("  -N, --new-vt    Start a session on a free tty, next to the running ones\n");
+	printf("  -D, --dry-run   Print the autostart plan without launching anything\n");
+	printf("  -A, --analyze [record]\n");
+	printf("                  Print the critical chain and blame list of a boot\n");
+	printf("  -d, --diff <baseline> [record]\n");
+	printf("                  Compare boots, fail if they got slower\n");
 	printf("  -n, --nosettle  Do not wait for udev to settle\n");
 	printf("  -v, --verbose   Display lots of output to the console\n");
 	printf("  -h, --help      Display this help message\n");
@@ -76,25 +94,28 @@ static void get_dmi_dpi(void)
 	 *  this board */
 	FILE *f;
 	char boardname[PATH_MAX];
+	char path[PATH_MAX];
 
 	d_in();
 
-	f = fopen("/etc/boardname", "r");
+	snprintf(path, PATH_MAX, "%s/etc/boardname", sysroot);
+	f = fopen(path, "r");
 	if (!f) {
-		lprintf("Unable to open /etc/boardname");
+		lprintf("Unable to open %s", path);
 		return;
 	}
 	if (fscanf(f, "%s", boardname) <= 0) {
-		lprintf("Unable to read /etc/boardname");
+		lprintf("Unable to read %s", path);
 		fclose(f);
 		return;
 	}
 	fclose(f);
 	dprintf("boardname=%s", boardname);
 
-	f = fopen("/usr/share/uxlaunch/dmi-dpi", "r");
+	snprintf(path, PATH_MAX, "%s/usr/share/uxlaunch/dmi-dpi", sysroot);
+	f = fopen(path, "r");
 	if (!f) {
-		lprintf("No DMI-DPI table present (/usr/share/uxlaunch/dmi-dpi)");
+		lprintf("No DMI-DPI table present (%s)", path);
 		return;
 	}
 	while (!feof(f)) {
@@ -124,6 +145,7 @@ void get_options(int argc, char **argv)
 	FILE *f;
 	DIR *dir;
 	struct dirent *entry;
+	char path[PATH_MAX];
 
 	d_in();
 	/*
@@ -131,6 +153,10 @@ void get_options(int argc, char **argv)
 	 * each step below overrides them in order
 	 */
 
+	/* relocated filesystem root, only used for testing */
+	if (getenv("UXLAUNCH_ROOT"))
+		strncpy(sysroot, getenv("UXLAUNCH_ROOT"), PATH_MAX - 1);
+
 	/* try and find a user in /home/ */
 	dir = opendir("/home");
 	while (dir) {
@@ -159,6 +185,17 @@ void get_options(int argc, char **argv)
 		if (strcmp(p->pw_dir, buf))
 			goto next;
 		strncpy(username, u, sizeof(username) - 1);
+#ifdef ENABLE_CHOOSER
+		if (home_user_count < MAX_HOME_USERS) {
+			struct home_user_struct *h = &home_users[home_user_count++];
+
+			strncpy(h->name, p->pw_name, sizeof(h->name) - 1);
+			strncpy(h->gecos, p->pw_gecos ? p->pw_gecos : "", sizeof(h->gecos) - 1);
+			strncpy(h->dir, p->pw_dir, sizeof(h->dir) - 1);
+			h->uid = p->pw_uid;
+			h->gid = p->pw_gid;
+		}
+#endif
 next:
 		free(u);
 	}
@@ -174,7 +211,8 @@ next:
 	get_dmi_dpi();
 
 	/* parse config file */
-	f = fopen("/etc/sysconfig/uxlaunch", "r");
+	snprintf(path, PATH_MAX, "%s/etc/sysconfig/uxlaunch", sysroot);
+	f = fopen(path, "r");
 	if (f) {
 		char buf[256];
 		char *key;
@@ -214,6 +252,44 @@ next:
 				settle = atoi(val);
 			if (!strcmp(key, "dpi"))
 				strncpy(dpinum, val, sizeof(dpinum) - 1);
+			if (!strcmp(key, "background"))
+				strncpy(x_background, val, 15);
+			if (!strcmp(key, "seat"))
+				add_seat(val);
+			if (!strcmp(key, "metrics"))
+				strncpy(metrics_dir, val, PATH_MAX - 1);
+			if (!strcmp(key, "pin"))
+				strncpy(pin_cpus, val, 255);
+			if (!strcmp(key, "boost"))
+				boost_util = atoi(val) > 1024 ? 1024 : atoi(val);
+			if (!strcmp(key, "boost_timeout"))
+				boost_timeout = atoi(val);
+			if (!strcmp(key, "boost_epp"))
+				strncpy(boost_epp, val, 31);
+			if (!strcmp(key, "pressure"))
+				pressure_ms = atoi(val);
+			if (!strcmp(key, "input_quiet"))
+				input_quiet = atoi(val);
+			if (!strcmp(key, "input_max"))
+				input_max = atoi(val);
+			if (!strcmp(key, "session_ready_timeout"))
+				session_ready_timeout = atoi(val);
+			if (!strcmp(key, "vt_freeze"))
+				vt_freeze = atoi(val);
+			if (!strcmp(key, "remote_home"))
+				remote_home = strcmp(val, "auto") ? atoi(val) : -1;
+			if (!strcmp(key, "log_size"))
+				log_size = atoi(val);
+			if (!strcmp(key, "log_rate"))
+				log_rate = atoi(val);
+			if (!strcmp(key, "analyze_percentile"))
+				analyze_percentile = atoi(val);
+			if (!strcmp(key, "analyze_threshold"))
+				analyze_threshold = atoi(val);
+			if (!strcmp(key, "display_backend"))
+				strncpy(display_backend, val, 15);
+			if (!strcmp(key, "headless_screen"))
+				strncpy(headless_screen, val, 31);
 			if (!strcmp(key, "xopts")) {
 			        strncpy(addn_xopts, val, sizeof(addn_xopts) - 1);
 			}
@@ -225,9 +301,9 @@ next:
 	while (1) {
 		c = getopt_long(argc, argv,
 #ifdef ENABLE_CHOOSER
-				"c:u:t:s:Shvx",
+				"c:u:t:s:SNDAdhvx",
 #else
-				"u:t:s:Shvx",
+				"u:t:s:SNDAdhvx",
 #endif
 				opts, &i);
 		if (c == -1)
@@ -251,6 +327,18 @@ next:
 		case 'S':
 			settle = 1;
 			break;
+		case 'N':
+			new_vt = 1;
+			break;
+		case 'D':
+			dry_run = 1;
+			break;
+		case 'A':
+			analyze = 1;
+			break;
+		case 'd':
+			diff = 1;
+			break;
 		case 'h':
 			usage(argv[0]);
 			exit (EXIT_SUCCESS);
@@ -268,6 +356,12 @@ next:
 		}
 	}
 
+	no_vt = !strcmp(display_backend, "xvfb");
+
+	/* reads boot records of the calling user, doesn't start anything */
+	if (analyze || diff)
+		exit(analyze_boots(diff, argc - optind, argv + optind));
+
 	/* Get session command from startup line */
 	while (i < argc) {
 		if (!strcmp(argv[i++], "--")) {
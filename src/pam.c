@@ -13,12 +13,17 @@
  * of the License.
  */
 
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <pwd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 
 #include <security/pam_appl.h>
 
@@ -27,6 +32,10 @@
 static pam_handle_t *ph;
 static struct pam_conv pc;
 
+/* the process that closes the session again, and our pipe to it */
+static pid_t pam_pid = 0;
+static int pam_fd = -1;
+
 /*
  * Sometimes PAM likes to chat with you, before it is assured
  * enough to let you log-in: fun.
@@ -73,6 +82,58 @@ pam_conversation_fn(int msg_count,
 	return PAM_SUCCESS;
 }
 
+static void end_pam_session(void)
+{
+	int err;
+
+	err = pam_close_session(ph, 0);
+	if (err)
+		lprintf("pam_close_session returned %d: %s\n", err, pam_strerror(ph, err));
+	pam_end(ph, err);
+}
+
+
+/*
+ * The PAM handle can't be passed to uxlaunch-supervisor, so a process
+ * forked off right after opening the session keeps it, and closes the
+ * session when we close our end of the pipe, or die. It stays root, so
+ * the modules can undo as root what they did as root.
+ */
+static void start_pam_keeper(void)
+{
+	int fds[2];
+	char c;
+
+	if (pipe2(fds, O_CLOEXEC)) {
+		lprintf("Unable to create the PAM pipe, closing the session ourselves");
+		return;
+	}
+
+	pam_pid = fork();
+	if (pam_pid < 0) {
+		lprintf("Failed to fork the PAM process, closing the session ourselves");
+		pam_pid = 0;
+		close(fds[0]);
+		close(fds[1]);
+		return;
+	}
+
+	if (pam_pid == 0) {
+		close(fds[1]);
+		/* ^C and init's TERM go to uxlaunch, which tells us */
+		signal(SIGTERM, SIG_IGN);
+		signal(SIGINT, SIG_IGN);
+
+		while (read(fds[0], &c, 1) < 0 && errno == EINTR)
+			;
+		end_pam_session();
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(fds[0]);
+	pam_fd = fds[1];
+}
+
 /*
  * Creating a PAM session. We need a pam "login" session so that the dbus
  * "at_console" logic will work correctly, as well as various /dev file
@@ -119,18 +180,42 @@ void setup_pam_session(void)
 		lprintf("pam_open_session returned %d: %s\n", err, pam_strerror(ph, err));
 		exit(EXIT_FAILURE);
 	}
+
+	start_pam_keeper();
 	d_out();
 }
 
-void close_pam_session(void)
+/*
+ * pam_systemd and the like set up a runtime dir of their own
+ */
+const char *pam_runtime_dir(void)
 {
-	int err;
+	return pam_getenv(ph, "XDG_RUNTIME_DIR");
+}
 
+void close_pam_session(void)
+{
 	d_in();
 
-	err = pam_close_session(ph, 0);
-	if (err)
-		lprintf("pam_close_session returned %d: %s\n", err, pam_strerror(ph, err));
-	pam_end(ph, err);
+	if (!pam_pid) {
+		end_pam_session();
+		d_out();
+		return;
+	}
+
+	close(pam_fd);
+	while (waitpid(pam_pid, NULL, 0) < 0 && errno == EINTR)
+		;
+	pam_pid = 0;
+
 	d_out();
 }
+
+
+void hand_over_pam(struct handover *h)
+{
+	h->pam_pid = pam_pid;
+	h->pam_fd = pam_fd;
+	if (pam_pid)
+		keep_fd(pam_fd);
+}
@@ -0,0 +1,642 @@
+/*
+ * This file is part of uxlaunch
+ *
+ * Freeze the Low and Late autostart programs while the system is under
+ * memory or I/O pressure, so the session the user is interacting with
+ * stays responsive. Pressure is watched with PSI triggers, and the
+ * background processes are frozen with the cgroup v2 freezer, or
+ * SIGSTOP when that is unavailable.
+ *
+ * While the user is typing, input.c has the helper lower their CPU
+ * weight instead.
+ *
+ * While our VT is in the background (vt.c), everything the launch
+ * zygote started is frozen, the background cgroup is nested in that of
+ * the zygote for this.
+ *
+ * All of this runs in the oom_adj helper, which stays root.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+#include "uxlaunch.h"
+
+/* ms of stall per PSI_WINDOW that freezes the background, 0 disables */
+int pressure_ms = 0;
+
+/* PSI trigger window, also how long pressure has to be gone to thaw */
+#define PSI_WINDOW 1000000
+
+/* don't starve the background forever, thaw for a window after this */
+#define FREEZE_MAX (30 * 1000000ULL)
+
+/* nice level while the user is busy, and what set_low_priority() gives */
+#define NICE_BUSY 19
+#define NICE_LOW 5
+
+#define MAX_BACKGROUND 64
+
+static pid_t background[MAX_BACKGROUND];
+static int background_count = 0;
+
+static char cgroup_dir[PATH_MAX] = "";
+static int cgroup_tried = 0;
+
+/* the zygote and everything it starts, frozen while the VT is hidden */
+static char session_cgroup[PATH_MAX] = "";
+static char session_path[PATH_MAX];	/* as in /proc/<pid>/cgroup */
+static pid_t session_leader;
+static int hidden = 0;
+
+static const char *psi_files[PSI_FDS] = {
+	"/proc/pressure/memory",
+	"/proc/pressure/io",
+};
+static int psi_fd[PSI_FDS] = { -1, -1 };
+static int psi_polled[PSI_FDS];
+static uint64_t next_poll;
+
+static int frozen = 0;
+static uint64_t frozen_at;
+static uint64_t last_event;
+
+
+/*
+ * Hand a process to the helper as background process, called from
+ * do_autostart() for Low and Late entries
+ */
+void background_pid(pid_t pid)
+{
+	if ((pressure_ms <= 0 && input_quiet <= 0) || pid <= 0)
+		return;
+	helper_request(REQ_BACKGROUND, pid, 0);
+}
+
+
+/*
+ * Lower the CPU weight of the background processes while there is
+ * input activity, and restore it afterwards
+ */
+void background_nice(int lower)
+{
+	helper_request(REQ_NICE, 0, lower);
+}
+
+
+/*
+ * The rest is only ever called in the helper
+ */
+
+static int write_file(const char *path, const char *val)
+{
+	int fd;
+	int ret;
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	ret = write(fd, val, strlen(val));
+	close(fd);
+
+	return ret < 0 ? -1 : 0;
+}
+
+
+/*
+ * Find the cgroup v2 mount, and our own cgroup below it
+ */
+static int own_cgroup(char *mnt, char *cg)
+{
+	FILE *f;
+	char line[PATH_MAX];
+	char fstype[64];
+	char *c;
+
+	mnt[0] = '\0';
+	cg[0] = '\0';
+
+	f = fopen("/proc/self/mountinfo", "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		/* ... mountpoint ... - fstype source options */
+		c = strstr(line, " - ");
+		if (!c || sscanf(c, " - %63s", fstype) != 1 || strcmp(fstype, "cgroup2"))
+			continue;
+		if (sscanf(line, "%*s %*s %*s %*s %4095s", mnt) == 1)
+			break;
+	}
+	fclose(f);
+
+	f = fopen("/proc/self/cgroup", "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, "0::", 3))
+			continue;
+		c = strchr(line, '\n');
+		if (c)
+			*c = '\0';
+		strncpy(cg, line + 3, PATH_MAX - 1);
+	}
+	fclose(f);
+
+	if (mnt[0] == '\0' || cg[0] == '\0')
+		return -1;
+	if (!strcmp(cg, "/"))
+		cg[0] = '\0';
+	return 0;
+}
+
+
+/*
+ * Create a child cgroup of our own cgroup v2 cgroup, or of the session
+ * cgroup if there is one. The freezer is not a controller, so this
+ * works wherever we are allowed to mkdir.
+ */
+static void setup_cgroup(void)
+{
+	char line[PATH_MAX];
+	char mnt[PATH_MAX];
+	char cg[PATH_MAX];
+
+	cgroup_tried = 1;
+
+	if (session_cgroup[0] != '\0')
+		snprintf(cgroup_dir, PATH_MAX, "%s/uxlaunch-background-%d",
+			 session_cgroup, getpid());
+	else if (own_cgroup(mnt, cg))
+		goto fail;
+	else
+		snprintf(cgroup_dir, PATH_MAX, "%s%s/uxlaunch-background-%d",
+			 mnt, cg, getpid());
+	snprintf(line, PATH_MAX, "%s/cgroup.freeze", cgroup_dir);
+	if ((mkdir(cgroup_dir, 0755) && errno != EEXIST) || access(line, W_OK)) {
+		lprintf("pressure: unable to create cgroup %s", cgroup_dir);
+		goto fail;
+	}
+
+	lprintf("pressure: background processes go to %s", cgroup_dir);
+	return;
+
+fail:
+	cgroup_dir[0] = '\0';
+	lprintf("pressure: no cgroup v2 freezer, using SIGSTOP");
+}
+
+
+static void move_to(const char *dir, pid_t pid)
+{
+	char path[PATH_MAX];
+	char val[16];
+
+	snprintf(path, PATH_MAX, "%s/cgroup.procs", dir);
+	snprintf(val, 16, "%d", pid);
+	if (write_file(path, val))
+		dprintf("pressure: unable to move %d to %s", pid, dir);
+}
+
+
+static void move_to_cgroup(pid_t pid)
+{
+	move_to(cgroup_dir, pid);
+}
+
+
+/*
+ * Call func for all (grand)children of pid, which may have been forked
+ * before the pid was handed to us
+ */
+static void for_each_descendant(pid_t pid, void (*func)(pid_t))
+{
+	DIR *dir;
+	struct dirent *entry;
+	char path[PATH_MAX];
+	char buf[512];
+	FILE *f;
+	pid_t child, ppid;
+	char *c;
+
+	dir = opendir("/proc");
+	if (!dir)
+		return;
+
+	while ((entry = readdir(dir))) {
+		child = atoi(entry->d_name);
+		if (child <= 0)
+			continue;
+		snprintf(path, PATH_MAX, "/proc/%d/stat", child);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		ppid = 0;
+		if (fgets(buf, sizeof(buf), f)) {
+			c = strrchr(buf, ')');
+			if (c)
+				sscanf(c + 2, "%*c %d", &ppid);
+		}
+		fclose(f);
+
+		/* not what became root through su and the like */
+		if (ppid == pid && helper_pid_allowed(child)) {
+			func(child);
+			for_each_descendant(child, func);
+		}
+	}
+
+	closedir(dir);
+}
+
+
+static void stop_pid(pid_t pid)
+{
+	kill(pid, SIGSTOP);
+}
+
+
+static void cont_pid(pid_t pid)
+{
+	kill(pid, SIGCONT);
+}
+
+
+static void set_frozen(int freeze)
+{
+	char path[PATH_MAX];
+	int i;
+
+	if (freeze == frozen)
+		return;
+
+	frozen = freeze;
+	frozen_at = elapsed_usecs();
+
+	if (cgroup_dir[0] != '\0') {
+		/* catch children forked before their parent was moved */
+		for (i = 0; i < background_count; i++)
+			for_each_descendant(background[i], move_to_cgroup);
+		snprintf(path, PATH_MAX, "%s/cgroup.freeze", cgroup_dir);
+		if (write_file(path, freeze ? "1" : "0"))
+			lprintf("pressure: unable to write %s", path);
+	} else {
+		for (i = 0; i < background_count; i++) {
+			if (kill(background[i], freeze ? SIGSTOP : SIGCONT) && errno == ESRCH) {
+				background[i--] = background[--background_count];
+				continue;
+			}
+			for_each_descendant(background[i], freeze ? stop_pid : cont_pid);
+		}
+	}
+
+	lprintf("pressure: %s %d background processes", freeze ? "froze" : "thawed",
+		background_count);
+}
+
+
+/*
+ * Use PSI triggers where we can, and fall back to reading the averages
+ * once per window where we can't (e.g. older kernels)
+ */
+static void open_triggers(void)
+{
+	char trigger[64];
+	int i;
+
+	snprintf(trigger, sizeof(trigger), "some %d %d", pressure_ms * 1000, PSI_WINDOW);
+
+	for (i = 0; i < PSI_FDS; i++) {
+		psi_fd[i] = open(psi_files[i], O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		if (psi_fd[i] < 0)
+			continue;
+		if (write(psi_fd[i], trigger, strlen(trigger) + 1) < 0) {
+			lprintf("pressure: no trigger support on %s (%s), polling it",
+				psi_files[i], strerror(errno));
+			close(psi_fd[i]);
+			psi_fd[i] = -1;
+			psi_polled[i] = 1;
+		}
+	}
+}
+
+
+/*
+ * Has the "some" avg10 exceeded the same share of time a trigger uses?
+ */
+static int psi_avg_exceeded(const char *file)
+{
+	FILE *f;
+	float avg10;
+	int ret = 0;
+
+	f = fopen(file, "r");
+	if (!f)
+		return 0;
+	if (fscanf(f, "some avg10=%f", &avg10) == 1)
+		ret = avg10 * PSI_WINDOW / 100 >= pressure_ms * 1000;
+	fclose(f);
+
+	return ret;
+}
+
+
+void helper_background(pid_t pid)
+{
+	if (!cgroup_tried) {
+		setup_cgroup();
+		if (pressure_ms > 0)
+			open_triggers();
+	}
+
+	if (background_count >= MAX_BACKGROUND) {
+		lprintf("pressure: too many background processes, not tracking %d", pid);
+		return;
+	}
+	background[background_count++] = pid;
+
+	if (cgroup_dir[0] != '\0')
+		move_to_cgroup(pid);
+	else if (frozen)
+		kill(pid, SIGSTOP);
+	/* in the cgroup, it's frozen along with the rest */
+}
+
+
+static int busy_nice;
+
+/*
+ * Nice is per thread, so set it for all threads of pid
+ */
+static void nice_pid(pid_t pid)
+{
+	DIR *dir;
+	struct dirent *entry;
+	char path[PATH_MAX];
+	int tid;
+
+	snprintf(path, PATH_MAX, "/proc/%d/task", pid);
+	dir = opendir(path);
+	if (!dir)
+		return;
+
+	while ((entry = readdir(dir))) {
+		tid = atoi(entry->d_name);
+		if (tid > 0)
+			setpriority(PRIO_PROCESS, tid, busy_nice);
+	}
+
+	closedir(dir);
+}
+
+
+void helper_background_nice(int lower)
+{
+	int i;
+
+	busy_nice = lower ? NICE_BUSY : NICE_LOW;
+
+	for (i = 0; i < background_count; i++) {
+		nice_pid(background[i]);
+		for_each_descendant(background[i], nice_pid);
+	}
+
+	dprintf("pressure: background processes at nice %d", busy_nice);
+}
+
+
+/*
+ * Add the PSI trigger fds to the helper's poll set
+ */
+int pressure_pollfds(struct pollfd *fds)
+{
+	int i, n = 0;
+
+	for (i = 0; i < PSI_FDS; i++) {
+		if (psi_fd[i] < 0)
+			continue;
+		fds[n].fd = psi_fd[i];
+		fds[n].events = POLLPRI;
+		fds[n].revents = 0;
+		n++;
+	}
+
+	return n;
+}
+
+
+static int polling(void)
+{
+	int i;
+
+	for (i = 0; i < PSI_FDS; i++)
+		if (psi_polled[i])
+			return background_count;
+	return 0;
+}
+
+
+/*
+ * milliseconds until we need to look at the pressure or the frozen
+ * state again, -1 if there's nothing to do until a trigger fires
+ */
+int pressure_timeout(void)
+{
+	uint64_t now = elapsed_usecs();
+	uint64_t next = UINT64_MAX;
+
+	if (polling())
+		next = next_poll;
+	if (frozen) {
+		if (last_event + 2 * PSI_WINDOW < next)
+			next = last_event + 2 * PSI_WINDOW;
+		if (frozen_at + FREEZE_MAX < next)
+			next = frozen_at + FREEZE_MAX;
+	}
+
+	if (next == UINT64_MAX)
+		return -1;
+	if (next <= now)
+		return 0;
+	return (next - now + 999) / 1000;
+}
+
+
+void pressure_check(struct pollfd *fds, int n)
+{
+	uint64_t now = elapsed_usecs();
+	int event = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (fds[i].revents & POLLERR)
+			lprintf("pressure: PSI trigger went away");
+		if (fds[i].revents & POLLPRI)
+			event = 1;
+	}
+
+	if (polling() && now >= next_poll) {
+		next_poll = now + PSI_WINDOW;
+		for (i = 0; i < PSI_FDS; i++)
+			if (psi_polled[i] && psi_avg_exceeded(psi_files[i]))
+				event = 1;
+	}
+
+	if (event) {
+		last_event = now;
+		/* after a thaw, give the background at least a window */
+		if (!frozen && background_count && now >= frozen_at + PSI_WINDOW) {
+			set_frozen(1);
+			return;
+		}
+	}
+
+	if (!frozen)
+		return;
+
+	if (now >= last_event + 2 * PSI_WINDOW) {
+		set_frozen(0);
+	} else if (now >= frozen_at + FREEZE_MAX) {
+		lprintf("pressure: still under pressure, thawing anyway");
+		set_frozen(0);
+	}
+}
+
+
+/*
+ * The launch zygote, everything it starts goes into the session cgroup
+ * with it, so it can be frozen while our VT is in the background.
+ */
+void helper_session(pid_t pid)
+{
+	char path[PATH_MAX];
+	char mnt[PATH_MAX];
+	char cg[PATH_MAX];
+
+	if (session_cgroup[0] != '\0' || own_cgroup(mnt, cg))
+		return;
+
+	snprintf(session_path, PATH_MAX, "%s/uxlaunch-session-%d", cg, getpid());
+	snprintf(session_cgroup, PATH_MAX, "%s%s", mnt, session_path);
+	snprintf(path, PATH_MAX, "%s/cgroup.freeze", session_cgroup);
+	if ((mkdir(session_cgroup, 0755) && errno != EEXIST) || access(path, W_OK)) {
+		lprintf("vt: unable to create cgroup %s", session_cgroup);
+		session_cgroup[0] = '\0';
+		return;
+	}
+
+	session_leader = pid;
+	move_to(session_cgroup, pid);
+	lprintf("vt: session processes go to %s", session_cgroup);
+}
+
+
+/*
+ * Children the zygote forked before it was moved, that aren't in the
+ * session cgroup or the background cgroup below it yet
+ */
+static void move_to_session(pid_t pid)
+{
+	char path[PATH_MAX];
+	char line[PATH_MAX];
+	size_t len = strlen(session_path);
+	FILE *f;
+	int inside = 0;
+
+	snprintf(path, PATH_MAX, "/proc/%d/cgroup", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f))
+		if (!strncmp(line, "0::", 3) && !strncmp(line + 3, session_path, len) &&
+		    (line[3 + len] == '/' || line[3 + len] == '\n'))
+			inside = 1;
+	fclose(f);
+
+	if (!inside)
+		move_to(session_cgroup, pid);
+}
+
+
+/*
+ * Freeze the session while our VT is in the background, and thaw it
+ * once it's back. The pressure freezer of the background cgroup below
+ * it keeps its own state.
+ */
+void helper_session_hidden(int hide)
+{
+	char path[PATH_MAX];
+
+	if (session_cgroup[0] == '\0' || hide == hidden)
+		return;
+
+	hidden = hide;
+	if (hide)
+		for_each_descendant(session_leader, move_to_session);
+
+	snprintf(path, PATH_MAX, "%s/cgroup.freeze", session_cgroup);
+	if (write_file(path, hide ? "1" : "0"))
+		lprintf("vt: unable to write %s", path);
+	else
+		lprintf("vt: %s the session", hide ? "froze" : "thawed");
+}
+
+
+/*
+ * Move what's still running to the parent, so the cgroup can go
+ */
+static void remove_cgroup(const char *dir)
+{
+	FILE *f;
+	char path[PATH_MAX];
+	char parent[PATH_MAX];
+	char pid[16];
+	char *c;
+
+	strcpy(parent, dir);
+	c = strrchr(parent, '/');
+	*c = '\0';
+	strcat(parent, "/cgroup.procs");
+
+	snprintf(path, PATH_MAX, "%s/cgroup.procs", dir);
+	f = fopen(path, "r");
+	if (f) {
+		while (fgets(pid, sizeof(pid), f))
+			write_file(parent, pid);
+		fclose(f);
+	}
+
+	if (rmdir(dir))
+		lprintf("pressure: unable to remove %s", dir);
+}
+
+
+/*
+ * Never leave anything frozen behind
+ */
+void helper_pressure_exit(void)
+{
+	set_frozen(0);
+	helper_session_hidden(0);
+
+	if (cgroup_dir[0] != '\0')
+		remove_cgroup(cgroup_dir);
+	if (session_cgroup[0] != '\0')
+		remove_cgroup(session_cgroup);
+}
@@ -0,0 +1,318 @@
+/*
+ * This file is part of uxlaunch
+ *
+ * The per-user runtime directory ($XDG_RUNTIME_DIR): a mode 0700 tmpfs
+ * that holds the Xauthority file, the session bus and ssh-agent
+ * sockets, the spawn socket and the log ring, so none of that goes to
+ * /tmp or the home directory. If PAM (e.g. pam_systemd) already set one
+ * up we use that, otherwise we mount /run/user/<uid> ourselves, and the
+ * oom_adj helper takes it down again once no seat uses it anymore.
+ *
+ * Only a tmpfs we mounted is ever taken down: the user's processes may
+ * still be around then, so the helper never walks what's inside.
+ *
+ * The same user can have sessions with different helpers, e.g. with
+ * --new-vt. Every uxlaunch and helper using the directory holds a shared
+ * flock() on a lock file of the uid, and it is only taken down by the
+ * helper that gets the lock exclusively.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+
+#include "uxlaunch.h"
+
+#define RUNTIME_BASE "/run/user"
+
+/* the same size limit logind uses */
+#define RUNTIME_SIZE "10%"
+
+/* the mount source, tells our mounts from those of e.g. logind */
+#define RUNTIME_SOURCE "uxlaunch"
+
+#define RUNTIME_LOCKS "/run/uxlaunch"
+
+char runtime_dir[PATH_MAX];
+
+/* set if we created runtime_dir, and have to remove it again */
+static int runtime_dir_ours = 0;
+
+/* our shared lock while we set it up and until the helper has one */
+static int runtime_lock = -1;
+
+/* helper side: how many seats use the directory of a uid */
+#define MAX_RUNTIME_USERS 16
+static struct {
+	uid_t uid;
+	int users;
+	int lock;
+} runtime_users[MAX_RUNTIME_USERS];
+
+
+static void runtime_dir_path(uid_t uid, char *path)
+{
+	snprintf(path, PATH_MAX, "%s%s/%d", sysroot, RUNTIME_BASE, uid);
+}
+
+
+/*
+ * Open the lock file of uid and flock() it, -1 if that fails or, with
+ * LOCK_NB, someone else holds it
+ */
+static int lock_runtime_dir(uid_t uid, int op)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, PATH_MAX, "%s%s", sysroot, RUNTIME_LOCKS);
+	mkdir(path, 0755);
+	snprintf(path, PATH_MAX, "%s%s/runtime-%d.lock", sysroot, RUNTIME_LOCKS, uid);
+	fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -1;
+	if (flock(fd, op)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+/*
+ * Is path a tmpfs that we mounted, e.g. for another seat of the user?
+ */
+static int our_mount(const char *path)
+{
+	FILE *f;
+	char line[PATH_MAX];
+	char mnt[PATH_MAX];
+	char fstype[64];
+	char source[64];
+	char *c;
+	int ret = 0;
+
+	f = fopen("/proc/self/mountinfo", "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		/* ... mountpoint ... - fstype source options */
+		c = strstr(line, " - ");
+		if (!c || sscanf(c, " - %63s %63s", fstype, source) != 2)
+			continue;
+		if (sscanf(line, "%*s %*s %*s %*s %4095s", mnt) != 1)
+			continue;
+		if (!strcmp(mnt, path) && !strcmp(fstype, "tmpfs") &&
+		    !strcmp(source, RUNTIME_SOURCE))
+			ret = 1;
+	}
+	fclose(f);
+
+	return ret;
+}
+
+
+/*
+ * Called as root, after the PAM session is opened
+ */
+void setup_runtime_dir(void)
+{
+	const char *pam_dir;
+	char opts[128];
+	struct stat st;
+
+	d_in();
+
+	pam_dir = pam_runtime_dir();
+	if (pam_dir && !lstat(pam_dir, &st) && S_ISDIR(st.st_mode) &&
+	    st.st_uid == pass->pw_uid) {
+		strncpy(runtime_dir, pam_dir, PATH_MAX - 1);
+		lprintf("Using runtime dir %s from PAM", runtime_dir);
+		d_out();
+		return;
+	}
+
+	snprintf(runtime_dir, PATH_MAX, "%s/run", sysroot);
+	mkdir(runtime_dir, 0755);
+	snprintf(runtime_dir, PATH_MAX, "%s%s", sysroot, RUNTIME_BASE);
+	mkdir(runtime_dir, 0755);
+	runtime_dir_path(pass->pw_uid, runtime_dir);
+
+	/* waits for a helper that is taking it down right now */
+	runtime_lock = lock_runtime_dir(pass->pw_uid, LOCK_SH);
+	if (runtime_lock < 0) {
+		lprintf("Unable to lock %s", runtime_dir);
+		runtime_dir[0] = '\0';
+		d_out();
+		return;
+	}
+
+	/* the mountpoint stays root's, the tmpfs on it is the user's */
+	if (mkdir(runtime_dir, 0700) == 0) {
+		snprintf(opts, sizeof(opts), "mode=0700,uid=%d,gid=%d,size=%s",
+			 pass->pw_uid, pass->pw_gid, RUNTIME_SIZE);
+		if (mount(RUNTIME_SOURCE, runtime_dir, "tmpfs", MS_NOSUID | MS_NODEV, opts)) {
+			lprintf("Unable to mount a tmpfs on %s: %s", runtime_dir, strerror(errno));
+			rmdir(runtime_dir);
+			close(runtime_lock);
+			runtime_lock = -1;
+			runtime_dir[0] = '\0';
+			d_out();
+			return;
+		}
+		runtime_dir_ours = 1;
+		helper_request(REQ_RUNTIME_HOLD, 0, pass->pw_uid);
+	} else if (errno == EEXIST && our_mount(runtime_dir)) {
+		/* another seat of the same user, or a leftover of ours */
+		runtime_dir_ours = 1;
+		helper_request(REQ_RUNTIME_HOLD, 0, pass->pw_uid);
+	} else {
+		lprintf("Unable to use %s as the runtime dir", runtime_dir);
+		close(runtime_lock);
+		runtime_lock = -1;
+		runtime_dir[0] = '\0';
+		d_out();
+		return;
+	}
+
+	lprintf("Using runtime dir %s", runtime_dir);
+	d_out();
+}
+
+
+/*
+ * The helper took its own lock when it got our hold request, ours
+ * would only be inherited by everything we fork from here on
+ */
+void unlock_runtime_dir(void)
+{
+	if (runtime_lock >= 0)
+		close(runtime_lock);
+	runtime_lock = -1;
+}
+
+
+void release_runtime_dir(void)
+{
+	d_in();
+	if (runtime_dir_ours)
+		helper_request(REQ_RUNTIME_RELEASE, 0, pass->pw_uid);
+	runtime_dir_ours = 0;
+	d_out();
+}
+
+
+/*
+ * The supervisor sends the release request itself
+ */
+void hand_over_runtime_dir(struct handover *h)
+{
+	h->runtime_uid = runtime_dir_ours ? (int)pass->pw_uid : -1;
+}
+
+
+/*
+ * Detach our tmpfs, which is freed once nothing has files open in it
+ * anymore, and remove the empty, root owned mountpoint under it
+ */
+static void remove_runtime_dir(uid_t uid)
+{
+	char path[PATH_MAX];
+
+	runtime_dir_path(uid, path);
+	if (!our_mount(path))
+		return;
+	lprintf("Removing runtime dir %s", path);
+
+	if (umount2(path, MNT_DETACH | UMOUNT_NOFOLLOW)) {
+		lprintf("Unable to unmount %s: %s", path, strerror(errno));
+		return;
+	}
+	if (rmdir(path))
+		lprintf("Unable to remove %s: %s", path, strerror(errno));
+}
+
+
+/*
+ * The last of our seats is done with it, take it down unless another
+ * session still holds its lock
+ */
+static void release_lock(int i)
+{
+	int fd = runtime_users[i].lock;
+
+	if (fd < 0 || flock(fd, LOCK_EX | LOCK_NB))
+		lprintf("Runtime dir of uid %d may be in use by another session, leaving it",
+			runtime_users[i].uid);
+	else
+		remove_runtime_dir(runtime_users[i].uid);
+	if (fd >= 0)
+		close(fd);
+	runtime_users[i].lock = -1;
+}
+
+
+/*
+ * The helper counts the seats using the directory of a uid, and removes
+ * it after the last one. The uid comes from the request, so only those
+ * of the session users the helper was started for are taken.
+ */
+void helper_runtime_dir(uid_t uid, int hold)
+{
+	int i, free_slot = -1;
+
+	if (!helper_uid_allowed(uid)) {
+		lprintf("Helper: ignoring runtime dir request for uid %d", uid);
+		return;
+	}
+
+	for (i = 0; i < MAX_RUNTIME_USERS; i++) {
+		if (runtime_users[i].users && runtime_users[i].uid == uid)
+			break;
+		if (!runtime_users[i].users && free_slot < 0)
+			free_slot = i;
+	}
+
+	if (i == MAX_RUNTIME_USERS) {
+		if (!hold || free_slot < 0)
+			return;
+		i = free_slot;
+		runtime_users[i].uid = uid;
+	}
+
+	if (hold) {
+		if (!runtime_users[i].users++)
+			runtime_users[i].lock = lock_runtime_dir(uid, LOCK_SH);
+		return;
+	}
+
+	if (--runtime_users[i].users == 0)
+		release_lock(i);
+}
+
+
+void helper_runtime_exit(void)
+{
+	int i;
+
+	for (i = 0; i < MAX_RUNTIME_USERS; i++) {
+		if (!runtime_users[i].users)
+			continue;
+		runtime_users[i].users = 0;
+		release_lock(i);
+	}
+}
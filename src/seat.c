@@ -0,0 +1,251 @@
+/*
+ * This file is part of uxlaunch
+ *
+ * Multi-seat support: a single uxlaunch process supervises several
+ * seats, each with its own VT, display, X server, PAM session and
+ * user. The configuration, the DMI DPI lookup and the oom_adj helper
+ * are set up once and shared by all seats.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <pwd.h>
+
+#include "uxlaunch.h"
+
+#define MAX_SEATS 16
+
+/* seconds to wait before restarting a seat whose session ended */
+#define SEAT_RESTART_DELAY 10
+
+struct seat_struct {
+	int tty;
+	int display;
+	char user[256];
+	char session[256];
+	char xopts[256];
+	pid_t pid;
+};
+
+static struct seat_struct seats[MAX_SEATS];
+int seat_count = 0;
+
+/* index of the seat this process runs, -1 when not in multi-seat mode */
+int current_seat = -1;
+
+static volatile int seats_exiting = 0;
+
+
+/*
+ * parse a "seat=<tty>:<display>:<user>[:<session>[:<xopts>]]" value
+ */
+void add_seat(const char *spec)
+{
+	struct seat_struct *s;
+	char buf[1024];
+	char *field;
+	char *next;
+	int n = 0;
+
+	if (seat_count >= MAX_SEATS) {
+		lprintf("Too many seats, ignoring \"%s\"", spec);
+		return;
+	}
+
+	s = &seats[seat_count];
+	memset(s, 0, sizeof(struct seat_struct));
+	strncpy(buf, spec, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+
+	field = buf;
+	while (field) {
+		/* xopts is last and may contain anything */
+		next = (n < 4) ? strchr(field, ':') : NULL;
+		if (next)
+			*next++ = '\0';
+
+		switch (n++) {
+		case 0:
+			s->tty = atoi(field);
+			break;
+		case 1:
+			s->display = atoi(field);
+			break;
+		case 2:
+			strncpy(s->user, field, sizeof(s->user) - 1);
+			break;
+		case 3:
+			strncpy(s->session, field, sizeof(s->session) - 1);
+			break;
+		case 4:
+			strncpy(s->xopts, field, sizeof(s->xopts) - 1);
+			break;
+		}
+		field = next;
+	}
+
+	if (n < 3 || s->tty <= 0 || s->user[0] == '\0') {
+		lprintf("Invalid seat \"%s\", needs at least <tty>:<display>:<user>", spec);
+		return;
+	}
+
+	seat_count++;
+}
+
+/*
+ * The uids of the seat users, the helper acts on their processes only
+ */
+int seat_uids(uid_t *uids, int max)
+{
+	struct passwd *p;
+	int i, n = 0;
+
+	for (i = 0; i < seat_count && n < max; i++) {
+		p = getpwnam(seats[i].user);
+		if (p)
+			uids[n++] = p->pw_uid;
+	}
+
+	return n;
+}
+
+static void seat_termhandler(int foo)
+{
+	int i;
+
+	if (foo++) foo--; /*  shut down warning */
+
+	seats_exiting = 1;
+	for (i = 0; i < seat_count; i++)
+		if (seats[i].pid > 0)
+			kill(seats[i].pid, SIGTERM);
+}
+
+/*
+ * Fork the process for a seat. Returns 0 in the seat process, which
+ * has the global tty/display/user settings switched to that seat.
+ */
+static pid_t start_seat(int i)
+{
+	struct seat_struct *s = &seats[i];
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		lprintf("Failed to fork for seat %d", i);
+		return pid;
+	}
+
+	if (pid > 0) {
+		s->pid = pid;
+		lprintf("seat %d: started [%d] on tty%d, display :%d, user \"%s\"",
+			i, pid, s->tty, s->display, s->user);
+		return pid;
+	}
+
+	current_seat = i;
+	tty = s->tty;
+	snprintf(displayname, 256, ":%d", s->display);
+	strncpy(username, s->user, 255);
+	if (s->session[0] != '\0')
+		strncpy(session, s->session, 255);
+	if (s->xopts[0] != '\0')
+		strncpy(addn_xopts, s->xopts, 255);
+
+	pass = getpwnam(username);
+	if (!pass) {
+		lprintf("Error: can't find user \"%s\" for seat %d", username, i);
+		exit(EXIT_FAILURE);
+	}
+
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+
+	/* the supervisor keeps our copy of the session index current */
+	unwatch_sessions();
+
+	return 0;
+}
+
+/*
+ * Start all configured seats and supervise them. Only returns in the
+ * forked process of a seat, the supervisor itself exits when done.
+ */
+void start_seats(void)
+{
+	struct sigaction term;
+	pid_t pid;
+	int status;
+	int running = 0;
+	int i;
+
+	d_in();
+
+	/* one oom_adj helper serves all seats */
+	start_oom_task();
+
+	/* and one session index, forked into each seat */
+	watch_sessions();
+	index_sessions(NULL);
+
+	memset(&term, 0, sizeof(struct sigaction));
+	term.sa_handler = seat_termhandler;
+	sigaction(SIGTERM, &term, NULL);
+	sigaction(SIGINT, &term, NULL);
+
+	for (i = 0; i < seat_count; i++) {
+		if (start_seat(i) == 0)
+			return;
+		if (seats[i].pid > 0)
+			running++;
+	}
+
+	while (running > 0) {
+		pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		for (i = 0; i < seat_count; i++)
+			if (seats[i].pid == pid)
+				break;
+		if (i == seat_count)
+			continue;
+
+		lprintf("seat %d: uxlaunch[%d] exited", i, pid);
+		seats[i].pid = 0;
+		running--;
+
+		if (seats_exiting)
+			continue;
+
+		/* what init would do for a single seat */
+		sleep(SEAT_RESTART_DELAY);
+		if (seats_exiting)
+			continue;
+		index_sessions(NULL);
+		if (start_seat(i) == 0)
+			return;
+		if (seats[i].pid > 0)
+			running++;
+	}
+
+	stop_oom_task();
+
+	lprintf("All seats exited, terminating");
+	d_out();
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,530 @@
+/*
+ * This file is part of uxlaunch
+ *
+ * Session registry: an index of all session .desktop files, so that
+ * looking up a session or listing them for a chooser doesn't have to
+ * probe and parse session files each time.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <glib.h>
+
+#include "uxlaunch.h"
+
+/*
+ * Session directories, highest priority first:
+ * - $XDG_CONFIG_HOME/xsessions
+ * - /etc/X11/dm/Sessions
+ * - /usr/share/xsessions
+ * - /usr/share/wayland-sessions
+ *
+ * Sessions in the last one are Wayland sessions, elsewhere they can say
+ * so with X-UXLaunch-Type=wayland.
+ */
+#define SESSION_DIRS 4
+#define USER_DIR 0
+#define WAYLAND_DIR 3
+
+struct session_dir_struct {
+	char path[PATH_MAX];
+	long long mtime;
+	GHashTable *entries;
+	int indexed;
+	int wd;
+};
+
+static struct session_dir_struct dirs[SESSION_DIRS];
+
+static int inotify_fd = -1;
+static int cache_pending = 0;
+
+#define CACHE_MAGIC "uxlaunch-sessions 3"
+
+
+static long long stat_mtime(const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st))
+		return -1;
+
+	return st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+
+static void session_entry_free(gpointer data)
+{
+	struct session_entry *s = data;
+
+	g_free(s->name);
+	g_free(s->path);
+	g_free(s->exec);
+	g_free(s->filter);
+	g_free(s->target);
+	g_free(s);
+}
+
+
+static void reset_dir(struct session_dir_struct *d)
+{
+	if (!d->entries)
+		d->entries = g_hash_table_new_full(g_str_hash, g_str_equal,
+						   NULL, session_entry_free);
+	else
+		g_hash_table_remove_all(d->entries);
+	d->indexed = 0;
+	d->mtime = -1;
+}
+
+
+/*
+ * Read one session file. The session filter is the basename of the
+ * file, or of its target if it is a symlink, so that a default.desktop
+ * pointing to gnome.desktop describes the GNOME session.
+ */
+static struct session_entry *read_session(const char *dir, const char *file, int wayland)
+{
+	struct keyfile_key keys[] = {
+		{ "Exec", NULL, 0 },
+		{ "X-UXLaunch-Notify", NULL, 0 },
+		{ "X-UXLaunch-Type", NULL, 0 },
+	};
+	struct session_entry *s;
+	struct keyfile kf;
+	gchar *path;
+	char buf[PATH_MAX];
+	const char *c;
+	struct stat st;
+	ssize_t l;
+
+	path = g_strdup_printf("%s/%s", dir, file);
+
+	if (keyfile_open(&kf, path) || keyfile_lookup(&kf, keys, 3)) {
+		lprintf("%s: unable to parse session file", path);
+		goto fail;
+	}
+
+	if (!keyfile_string(&keys[0], buf, PATH_MAX)) {
+		lprintf("%s: invalid session file: no valid Exec= key", path);
+		goto fail;
+	}
+
+	s = g_new0(struct session_entry, 1);
+	s->path = path;
+	s->exec = g_strdup(buf);
+	s->name = g_strndup(file, strlen(file) - strlen(".desktop"));
+	s->mtime = stat_mtime(path);
+	s->notify = keyfile_boolean(&keys[1]);
+	s->wayland = wayland;
+	if (keys[2].value)
+		s->wayland = keys[2].len == 7 && !memcmp(keys[2].value, "wayland", 7);
+	keyfile_close(&kf);
+
+	c = file;
+	if (!lstat(path, &st) && S_ISLNK(st.st_mode)) {
+		l = readlink(path, buf, sizeof(buf) - 1);
+		if (l < 0) {
+			lprintf("%s: unable to determine link target", path);
+			session_entry_free(s);
+			return NULL;
+		}
+		buf[l] = 0;
+		s->target = g_strdup(buf);
+		c = strrchr(buf, '/');
+		c = c ? c + 1 : buf;
+	}
+
+	if (strlen(c) <= strlen(".desktop")) {
+		lprintf("%s: funny, malformed link target", path);
+		session_entry_free(s);
+		return NULL;
+	}
+	s->filter = g_strndup(c, strlen(c) - strlen(".desktop"));
+
+	return s;
+
+fail:
+	keyfile_close(&kf);
+	g_free(path);
+	return NULL;
+}
+
+
+static void scan_dir(struct session_dir_struct *d)
+{
+	DIR *dir;
+	struct dirent *entry;
+	struct session_entry *s;
+
+	reset_dir(d);
+	d->indexed = 1;
+	if (d->path[0] == '\0')
+		return;
+
+	d->mtime = stat_mtime(d->path);
+	dir = opendir(d->path);
+	if (!dir)
+		return;
+
+	while ((entry = readdir(dir))) {
+		if (entry->d_name[0] == '.')
+			continue;
+		if (!g_str_has_suffix(entry->d_name, ".desktop"))
+			continue;
+		if (strlen(entry->d_name) <= strlen(".desktop"))
+			continue;
+
+		s = read_session(d->path, entry->d_name, d == &dirs[WAYLAND_DIR]);
+		if (s)
+			g_hash_table_replace(d->entries, s->name, s);
+	}
+
+	closedir(dir);
+}
+
+
+static int cache_path(char *path)
+{
+	if (!getenv("XDG_CACHE_HOME"))
+		return -1;
+
+	snprintf(path, PATH_MAX, "%s/uxlaunch/sessions", getenv("XDG_CACHE_HOME"));
+	return 0;
+}
+
+
+/*
+ * Fill the index from the cache file. Directories whose mtime changed
+ * (files added or removed) or that hold a modified file are left out,
+ * and get rescanned.
+ */
+static void load_cache(void)
+{
+	FILE *f;
+	char path[PATH_MAX];
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t l;
+	struct session_dir_struct *d = NULL;
+	struct session_entry *s;
+	gchar **fields;
+	int i;
+
+	if (cache_path(path))
+		return;
+	f = fopen(path, "r");
+	if (!f)
+		return;
+
+	if ((l = getline(&line, &len, f)) < 0 || strncmp(line, CACHE_MAGIC, strlen(CACHE_MAGIC)))
+		goto out;
+
+	while ((l = getline(&line, &len, f)) > 0) {
+		if (line[l - 1] == '\n')
+			line[l - 1] = '\0';
+
+		/* dir\t<mtime>\t<path> */
+		if (!strncmp(line, "dir\t", 4)) {
+			fields = g_strsplit(line + 4, "\t", 2);
+			d = NULL;
+			for (i = 0; fields[0] && fields[1] && i < SESSION_DIRS; i++) {
+				if (dirs[i].indexed || strcmp(dirs[i].path, fields[1]))
+					continue;
+				if (stat_mtime(dirs[i].path) != atoll(fields[0]))
+					break;
+				d = &dirs[i];
+				reset_dir(d);
+				d->mtime = atoll(fields[0]);
+				d->indexed = 1;
+				break;
+			}
+			g_strfreev(fields);
+			continue;
+		}
+
+		/* entry\t<mtime>\t<name>\t<path>\t<target>\t<filter>\t<notify>\t<wayland>\t<exec> */
+		if (!d || strncmp(line, "entry\t", 6))
+			continue;
+		fields = g_strsplit(line + 6, "\t", 8);
+		for (i = 0; fields[i]; i++)
+			;
+		if (i != 8) {
+			g_strfreev(fields);
+			continue;
+		}
+
+		if (stat_mtime(fields[2]) != atoll(fields[0])) {
+			/* stale, rescan this directory */
+			d->indexed = 0;
+			d = NULL;
+			g_strfreev(fields);
+			continue;
+		}
+
+		s = g_new0(struct session_entry, 1);
+		s->mtime = atoll(fields[0]);
+		s->name = g_strdup(fields[1]);
+		s->path = g_strdup(fields[2]);
+		s->target = fields[3][0] ? g_strdup(fields[3]) : NULL;
+		s->filter = g_strdup(fields[4]);
+		s->notify = atoi(fields[5]);
+		s->wayland = atoi(fields[6]);
+		s->exec = g_strdup(fields[7]);
+		g_hash_table_replace(d->entries, s->name, s);
+		g_strfreev(fields);
+	}
+
+out:
+	free(line);
+	fclose(f);
+}
+
+
+static void write_entry(gpointer key, gpointer value, gpointer data)
+{
+	struct session_entry *s = value;
+	FILE *f = data;
+
+	if (key) {} /* shut up warning */
+
+	/* can't be represented, just don't cache it */
+	if (strchr(s->exec, '\t') || strchr(s->exec, '\n'))
+		return;
+
+	fprintf(f, "entry\t%lld\t%s\t%s\t%s\t%s\t%d\t%d\t%s\n", s->mtime, s->name,
+		s->path, s->target ? s->target : "", s->filter, s->notify, s->wayland, s->exec);
+}
+
+
+static void save_cache(void)
+{
+	FILE *f;
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	char *c;
+	int i;
+
+	if (cache_path(path))
+		return;
+
+	c = strrchr(path, '/');
+	*c = '\0';
+	mkdir(path, 0700);
+	*c = '/';
+
+	snprintf(tmp, PATH_MAX, "%s.tmp", path);
+	f = fopen(tmp, "w");
+	if (!f)
+		return;
+
+	fprintf(f, "%s\n", CACHE_MAGIC);
+	for (i = 0; i < SESSION_DIRS; i++) {
+		if (dirs[i].path[0] == '\0')
+			continue;
+		fprintf(f, "dir\t%lld\t%s\n", dirs[i].mtime, dirs[i].path);
+		g_hash_table_foreach(dirs[i].entries, write_entry, f);
+	}
+	fclose(f);
+
+	if (rename(tmp, path))
+		unlink(tmp);
+}
+
+
+void flush_sessions_cache(void)
+{
+	if (cache_pending)
+		save_cache();
+	cache_pending = 0;
+}
+
+
+static void add_watch(struct session_dir_struct *d)
+{
+	d->wd = -1;
+	if (inotify_fd < 0 || d->path[0] == '\0')
+		return;
+
+	d->wd = inotify_add_watch(inotify_fd, d->path,
+				  IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+				  IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB);
+}
+
+
+/*
+ * Mark every directory that changed since the last call for rescanning
+ */
+static void read_events(void)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+	int i;
+
+	if (inotify_fd < 0)
+		return;
+
+	while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)p;
+			for (i = 0; i < SESSION_DIRS; i++)
+				if (dirs[i].wd == ev->wd)
+					dirs[i].indexed = 0;
+		}
+	}
+}
+
+
+/*
+ * Keep the index current with inotify instead of validating it against
+ * the cache file, for processes that stay around (the seat supervisor).
+ */
+void watch_sessions(void)
+{
+	int i;
+
+	if (inotify_fd >= 0)
+		return;
+
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd < 0) {
+		lprintf("Unable to watch session directories: %s", strerror(errno));
+		return;
+	}
+
+	for (i = 0; i < SESSION_DIRS; i++)
+		add_watch(&dirs[i]);
+}
+
+
+/*
+ * Forked processes get a copy of the index, but not the events
+ */
+void unwatch_sessions(void)
+{
+	if (inotify_fd < 0)
+		return;
+
+	close(inotify_fd);
+	inotify_fd = -1;
+}
+
+
+/*
+ * Bring the index up to date for a user. config_home may be NULL to
+ * only index the system wide sessions.
+ */
+void index_sessions(const char *config_home)
+{
+	char path[PATH_MAX] = "";
+	int stale = 0;
+	int i;
+
+	d_in();
+
+	if (config_home)
+		snprintf(path, PATH_MAX, "%s/xsessions", config_home);
+	if (strcmp(path, dirs[USER_DIR].path)) {
+		if (inotify_fd >= 0 && dirs[USER_DIR].wd >= 0)
+			inotify_rm_watch(inotify_fd, dirs[USER_DIR].wd);
+		strcpy(dirs[USER_DIR].path, path);
+		reset_dir(&dirs[USER_DIR]);
+		add_watch(&dirs[USER_DIR]);
+	}
+	if (!dirs[1].entries) {
+		snprintf(dirs[1].path, PATH_MAX, "%s/etc/X11/dm/Sessions", sysroot);
+		snprintf(dirs[2].path, PATH_MAX, "%s/usr/share/xsessions", sysroot);
+		snprintf(dirs[3].path, PATH_MAX, "%s/usr/share/wayland-sessions", sysroot);
+		for (i = 1; i < SESSION_DIRS; i++) {
+			reset_dir(&dirs[i]);
+			add_watch(&dirs[i]);
+		}
+	}
+
+	read_events();
+
+	if (inotify_fd < 0)
+		load_cache();
+
+	for (i = 0; i < SESSION_DIRS; i++) {
+		if (dirs[i].indexed)
+			continue;
+		scan_dir(&dirs[i]);
+		stale = 1;
+	}
+
+	/* with a remote home, the cache is written once the session is up */
+	if (stale && inotify_fd < 0 && !dry_run) {
+		if (remote_home > 0)
+			cache_pending = 1;
+		else
+			save_cache();
+	}
+
+	d_out();
+}
+
+
+/*
+ * Find a session by name, e.g. "default" for default.desktop
+ */
+struct session_entry *lookup_session(const char *name)
+{
+	struct session_entry *s;
+	int i;
+
+	for (i = 0; i < SESSION_DIRS; i++) {
+		if (!dirs[i].entries)
+			continue;
+		s = g_hash_table_lookup(dirs[i].entries, name);
+		if (s)
+			return s;
+	}
+
+	return NULL;
+}
+
+
+struct foreach_struct {
+	void (*func)(struct session_entry *, void *);
+	void *data;
+};
+
+static void foreach_visible(gpointer key, gpointer value, gpointer data)
+{
+	struct foreach_struct *fe = data;
+
+	/* shadowed by a higher priority directory */
+	if (lookup_session(key) != value)
+		return;
+
+	fe->func(value, fe->data);
+}
+
+/*
+ * Call func for every session that lookup_session() can return
+ */
+void foreach_session(void (*func)(struct session_entry *, void *), void *data)
+{
+	struct foreach_struct fe = { func, data };
+	int i;
+
+	for (i = 0; i < SESSION_DIRS; i++)
+		if (dirs[i].entries)
+			g_hash_table_foreach(dirs[i].entries, foreach_visible, &fe);
+}
@@ -0,0 +1,186 @@
+/*
+ * This file is part of uxlaunch
+ *
+ * Once the session is up, all that's left to do is to wait for it to
+ * end and tear it down, which can take days. Instead of doing that
+ * with GLib, libdbus, libpam and everything we parsed during startup
+ * still in memory, we exec uxlaunch-supervisor, which links nothing
+ * but libc. It keeps our pid, so the session processes stay its
+ * children, and gets what it needs for the teardown in a memfd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "uxlaunch.h"
+
+#define SUPERVISOR "uxlaunch-supervisor"
+
+
+/*
+ * Let fd survive the exec
+ */
+void keep_fd(int fd)
+{
+	int flags;
+
+	if (fd < 0)
+		return;
+	flags = fcntl(fd, F_GETFD);
+	if (flags >= 0)
+		fcntl(fd, F_SETFD, flags & ~FD_CLOEXEC);
+}
+
+
+/*
+ * The supervisor is installed next to us. It has to be unreadable for
+ * the user we run as by now: exec'ing a file we can read makes us
+ * dumpable again, and the user could ptrace it and get at the fds of
+ * the PAM keeper, the helper and ConsoleKit, which are all root's.
+ */
+static int supervisor_path(char *path)
+{
+	char exe[PATH_MAX];
+	char *c;
+	ssize_t len;
+
+	len = readlink("/proc/self/exe", exe, PATH_MAX - 1);
+	if (len <= 0)
+		return -1;
+	exe[len] = '\0';
+	c = strrchr(exe, '/');
+	if (!c)
+		return -1;
+	*c = '\0';
+
+	snprintf(path, PATH_MAX, "%s/%s", exe, SUPERVISOR);
+	if (access(path, X_OK))
+		return -1;
+	if (getuid() && !access(path, R_OK)) {
+		lprintf("%s is readable, it should be mode 0711", path);
+		return -1;
+	}
+	return 0;
+}
+
+
+static int write_handover(void)
+{
+	struct handover *h;
+	uint64_t rss, pss;
+	ssize_t ret;
+	int fd;
+
+	h = calloc(1, sizeof(*h));
+	if (!h)
+		return -1;
+
+	if (!memory_usage(&rss, &pss)) {
+		lprintf("Memory at the end of startup: Rss %llu kB, Pss %llu kB",
+			(unsigned long long)rss / 1024, (unsigned long long)pss / 1024);
+		metrics_memory(MEM_STARTUP, rss, pss);
+	}
+
+	h->magic = HANDOVER_MAGIC;
+	h->size = sizeof(*h);
+
+	hand_over_phases(h);
+	hand_over_metrics(h);
+
+	h->xpid = xpid;
+	h->session_pid = session_pid;
+	h->logger_pid = logger_pid;
+
+	h->no_vt = no_vt;
+	strncpy(h->displaydev, displaydev, PATH_MAX - 1);
+	strncpy(h->xauth_cookie_file, xauth_cookie_file, PATH_MAX - 1);
+	hand_over_dbus(h);
+	hand_over_ssh_agent(h);
+	hand_over_daemons(h);
+	hand_over_pam(h);
+	hand_over_runtime_dir(h);
+	hand_over_oom_task(h);
+	hand_over_zygote(h);
+
+	fd = memfd_create("uxlaunch-handover", 0);
+	if (fd < 0) {
+		free(h);
+		return -1;
+	}
+	ret = write(fd, h, sizeof(*h));
+	free(h);
+	if (ret != sizeof(*h)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+/*
+ * Only returns if the supervisor can't be started, we supervise the
+ * session ourselves then
+ */
+void supervise(void)
+{
+	char path[PATH_MAX];
+	char arg[16];
+	char *argv[3];
+	sigset_t mask, old;
+	int fd;
+
+	d_in();
+
+	if (supervisor_path(path)) {
+		lprintf("Not using %s, supervising the session ourselves", SUPERVISOR);
+		d_out();
+		return;
+	}
+
+	fd = write_handover();
+	if (fd < 0) {
+		lprintf("Unable to pass the session to %s", SUPERVISOR);
+		d_out();
+		return;
+	}
+
+#ifdef WITH_CONSOLEKIT
+	hand_over_consolekit();
+#endif
+
+	/* the supervisor sets up its handlers, and gets these then */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigprocmask(SIG_BLOCK, &mask, &old);
+	/* in case X signals us again */
+	signal(SIGUSR1, SIG_IGN);
+
+	snprintf(arg, sizeof(arg), "%d", fd);
+	argv[0] = path;
+	argv[1] = arg;
+	argv[2] = NULL;
+
+	lprintf("Handing the session over to %s", path);
+	execv(path, argv);
+
+	lprintf("Failed to exec %s: %s", path, strerror(errno));
+	sigprocmask(SIG_SETMASK, &old, NULL);
+	close(fd);
+	d_out();
+}
@@ -54,7 +54,12 @@ static void do_env(void)
 	setenv("DISPLAY", displayname, 1);
 	snprintf(buf, PATH_MAX, "/usr/local/sbin:/usr/local/bin:/sbin:/bin:/usr/sbin:/usr/bin:%s/bin", pass->pw_dir);
 	setenv("PATH", buf, 1);
-	snprintf(user_xauth_path, PATH_MAX, "%s/.Xauthority", pass->pw_dir);
+	if (runtime_dir[0] != '\0') {
+		setenv("XDG_RUNTIME_DIR", runtime_dir, 1);
+		snprintf(user_xauth_path, PATH_MAX, "%s/Xauthority", runtime_dir);
+	} else {
+		snprintf(user_xauth_path, PATH_MAX, "%s/.Xauthority", pass->pw_dir);
+	}
 	setenv("XAUTHORITY", user_xauth_path, 1);
 
 	file = popen("/bin/bash -l -c export", "r");
@@ -94,6 +99,13 @@ static void do_env(void)
 	}
 
 	pclose(file);
+
+	/* make the helpers in a relocated root take precedence */
+	if (sysroot[0] != '\0') {
+		snprintf(buf, PATH_MAX, "%s/usr/bin:%s", sysroot, getenv("PATH"));
+		setenv("PATH", buf, 1);
+	}
+
 	d_out();
 }
 
@@ -168,9 +180,11 @@ void switch_to_user(void)
 	initgroups(pass->pw_name, pass->pw_gid);
 
 	/* make sure that the user owns /dev/ttyX */
-	ret = chown(displaydev, pass->pw_uid, pass->pw_gid);
-	if (ret)
-		lprintf("Failed to fix /dev/tty permission");
+	if (displaydev[0] != '\0') {
+		ret = chown(displaydev, pass->pw_uid, pass->pw_gid);
+		if (ret)
+			lprintf("Failed to fix /dev/tty permission");
+	}
 
 	/* make sure the user owns the X backlight devices */
 	set_backlight_perms (BACKLIGHT_CLASS);
@@ -180,6 +194,10 @@ void switch_to_user(void)
 		exit(EXIT_FAILURE);
 	}
 
+	/* with a network home, get the lookups below going in parallel */
+	check_home();
+	prefetch_home();
+
 	if (access(pass->pw_dir, R_OK || W_OK || X_OK) != 0) {
 		lprintf("Fatal: \"%s\" has incompatible permissions", pass->pw_dir);
 		exit(EXIT_FAILURE);
@@ -206,16 +224,18 @@ void switch_to_user(void)
 		fclose(fp);
 	}
 
-	/* redirect further IO to .xsession-errors */
-	snprintf(fn, PATH_MAX, "%s/.xsession-errors", pass->pw_dir);
-	fp = fopen(fn, "w");
-	if (fp) {
-		fclose(fp);
-		/* xserver.c already truncates this file, so append */
-		fp = freopen(fn, "a", stdout);
-		fp = freopen(fn, "a", stderr);
-	} else {
-		lprintf("Unable to open \"%s\n\" for writing", fn);
+	/* further IO goes to the logger, or .xsession-errors without it */
+	if (start_logger()) {
+		snprintf(fn, PATH_MAX, "%s/.xsession-errors", pass->pw_dir);
+		fp = fopen(fn, "w");
+		if (fp) {
+			fclose(fp);
+			/* xserver.c already truncates this file, so append */
+			fp = freopen(fn, "a", stdout);
+			fp = freopen(fn, "a", stderr);
+		} else {
+			lprintf("Unable to open \"%s\n\" for writing", fn);
+		}
 	}
 
 	d_out();
@@ -240,7 +260,8 @@ void setup_user_environment (void)
 
 	/* setup misc. user directories and variables */
 	snprintf(buf, PATH_MAX, "%s/.cache", pass->pw_dir);
-	mkdir(buf, 0700);
+	if (remote_home <= 0 && !dry_run)
+		mkdir(buf, 0700);
 	setenv("XDG_CACHE_HOME", buf, 0);
 	snprintf(buf, PATH_MAX, "%s/.config", pass->pw_dir);
 	setenv("XDG_CONFIG_HOME", buf, 0);
@@ -270,7 +291,8 @@ void set_i18n(void)
 	if (f)
 		goto parse;
 	dprintf("Unable to open ~/.config/i18n, trying /etc/sysconfig/i18n");
-	f = fopen("/etc/sysconfig/i18n", "r");
+	snprintf(path, PATH_MAX, "%s/etc/sysconfig/i18n", sysroot);
+	f = fopen(path, "r");
 	if (f)
 		goto parse;
 	d_out();
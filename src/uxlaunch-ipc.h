@@ -3,9 +3,43 @@
 
 #include <limits.h>
 
-#define UXLAUNCH_IPC_VERSION 1
+/*
+ * uxlaunch <-> chooser protocol
+ *
+ * The chooser is started with one end of a connected SOCK_STREAM unix
+ * socket, the fd number of which is in $UXLAUNCH_IPC_FD. Messages are
+ * lines of space separated fields, the last field of a line may
+ * contain spaces.
+ *
+ * Right after starting the chooser, uxlaunch sends:
+ *
+ *   VERSION <version>
+ *   USER <name> <uid> <full name>        one per eligible user
+ *   SESSION <user> <session> <path>      one per session available to <user>
+ *   LAST <user> <session>                session <user> picked last time
+ *   DEFAULT <user>                       user uxlaunch would pick itself
+ *   END
+ *
+ * The chooser replies, as soon as the choice is made:
+ *
+ *   SELECT <user> <session>
+ *
+ * and may then take its time to exit. uxlaunch starts preparing the
+ * session for <user> right away.
+ *
+ * Version 1 choosers still work: $SHM_ID names a SysV shm segment with
+ * a uxlaunch_chooser_shm in it, prefilled with the default user and
+ * session. If the chooser closes the socket without a SELECT, uxlaunch
+ * takes the choice from there once the chooser has exited. The choice
+ * has to be one of the users and sessions offered on the socket.
+ */
+
+#define UXLAUNCH_IPC_VERSION 2
+#define UXLAUNCH_IPC_FD_ENV "UXLAUNCH_IPC_FD"
+#define UXLAUNCH_IPC_SHM_ENV "SHM_ID"
 #define UXLAUNCH_NAME_LIMIT 50
 
+/* protocol version 1 */
 typedef struct _uxlaunch_chooser_shm uxlaunch_chooser_shm;
 struct _uxlaunch_chooser_shm {
 	char user[255];
@@ -0,0 +1,112 @@
+/*
+ * This file is part of uxlaunch
+ *
+ * uxlaunch-notify: tell uxlaunch the session is ready, see notify.c
+ *
+ *   uxlaunch-notify
+ *	send READY=1 right away, e.g. from a session script
+ *
+ *   uxlaunch-notify --wm <session> [args]
+ *	run <session> in place, and send READY=1 once a window manager
+ *	has set _NET_SUPPORTING_WM_CHECK on the root window. For session
+ *	programs that don't send READY=1 themselves.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define NOTIFY_FD_ENV "UXLAUNCH_NOTIFY_FD"
+
+/* give up on the window manager after this many 100ms polls */
+#define WM_POLLS 300
+
+
+static int notify_ready(int fd)
+{
+	const char *msg = "READY=1";
+
+	if (send(fd, msg, strlen(msg), MSG_NOSIGNAL) < 0) {
+		perror("uxlaunch-notify: send");
+		return 1;
+	}
+	return 0;
+}
+
+
+static int wm_running(void)
+{
+	FILE *p;
+	char line[256];
+	int ret = 0;
+
+	p = popen("xprop -root _NET_SUPPORTING_WM_CHECK 2>/dev/null", "r");
+	if (!p)
+		return 0;
+	while (fgets(line, sizeof(line), p))
+		if (strstr(line, "window id"))
+			ret = 1;
+	pclose(p);
+
+	return ret;
+}
+
+
+int main(int argc, char **argv)
+{
+	pid_t pid;
+	int fd;
+	int i;
+
+	if (!getenv(NOTIFY_FD_ENV)) {
+		if (argc > 2 && !strcmp(argv[1], "--wm")) {
+			/* not started by uxlaunch, just run the session */
+			execvp(argv[2], &argv[2]);
+			perror("uxlaunch-notify: exec");
+			return 1;
+		}
+		fprintf(stderr, "uxlaunch-notify: %s is not set\n", NOTIFY_FD_ENV);
+		return 1;
+	}
+	fd = atoi(getenv(NOTIFY_FD_ENV));
+
+	if (argc == 1)
+		return notify_ready(fd);
+
+	if (argc < 3 || strcmp(argv[1], "--wm")) {
+		fprintf(stderr, "usage: uxlaunch-notify [--wm <session> [args]]\n");
+		return 1;
+	}
+
+	/*
+	 * The session keeps our pid, the watcher is forked twice so the
+	 * session never has to reap it
+	 */
+	pid = fork();
+	if (pid == 0) {
+		if (fork() != 0)
+			_exit(0);
+		for (i = 0; i < WM_POLLS; i++) {
+			if (wm_running())
+				_exit(notify_ready(fd));
+			usleep(100000);
+		}
+		_exit(1);
+	}
+	if (pid > 0)
+		waitpid(pid, NULL, 0);
+
+	close(fd);
+	unsetenv(NOTIFY_FD_ENV);
+	execvp(argv[2], &argv[2]);
+	perror("uxlaunch-notify: exec");
+	return 1;
+}
@@ -0,0 +1,302 @@
+/*
+ * This file is part of uxlaunch
+ *
+ * uxlaunch-supervisor: exec'd by uxlaunch once the session is up, see
+ * supervise.c. Waits for X or the session to exit and tears the
+ * session down, like uxlaunch itself used to. Only links libc, so it
+ * has the footprint of the few teardown steps it carries its own
+ * copies of.
+ *
+ *   uxlaunch-supervisor <memfd>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <linux/kd.h>
+
+#include "uxlaunch.h"
+
+int verbose = 0;
+
+static struct handover *h;
+
+static volatile int exiting = 0;
+
+
+static struct handover *map_handover(int fd)
+{
+	struct handover *state;
+
+	/* private, so the phase names can be terminated in place */
+	state = mmap(NULL, sizeof(*state), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (state == MAP_FAILED)
+		return NULL;
+
+	if (state->magic != HANDOVER_MAGIC || state->size != sizeof(*state)) {
+		munmap(state, sizeof(*state));
+		return NULL;
+	}
+
+	return state;
+}
+
+
+static void termhandler(int foo)
+{
+	(void)foo;
+
+	exiting = 1;
+	/* like uxlaunch: kill the session, and let X go */
+	if (h->session_pid)
+		kill(h->session_pid, SIGKILL);
+	if (h->xpid)
+		kill(h->xpid, SIGTERM);
+}
+
+
+static void reap_daemon(pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < MAX_DAEMONS; i++) {
+		if (h->daemons[i].pid != pid)
+			continue;
+		lprintf("%s[%d] exited", h->daemons[i].name, pid);
+		h->daemons[i].pid = 0;
+	}
+}
+
+
+static int crash_status(int status)
+{
+	if (!WIFSIGNALED(status))
+		return 0;
+
+	switch (WTERMSIG(status)) {
+	case SIGSEGV:
+	case SIGBUS:
+	case SIGILL:
+	case SIGFPE:
+	case SIGABRT:
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Like wait_for_X_exit()
+ */
+static void wait_for_exit(void)
+{
+	int status;
+	pid_t pid;
+
+	while (!exiting) {
+		pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			lprintf("No more children to wait for");
+			break;
+		}
+
+		if (WIFEXITED(status))
+			lprintf("process %d exited with exit code %d",
+				pid, WEXITSTATUS(status));
+		if (WIFSIGNALED(status))
+			lprintf("process %d was killed by signal %d",
+				pid, WTERMSIG(status));
+		if (WIFEXITED(status) || WIFSIGNALED(status))
+			reap_daemon(pid);
+		if (crash_status(status) && h->logger_pid > 0)
+			kill(h->logger_pid, SIGUSR1);
+
+		if (pid == h->xpid) {
+			lprintf("Xorg[%d] exited, cleaning up", pid);
+			break;
+		}
+		if (pid == h->session_pid) {
+			lprintf("Session process [%d] exited, cleaning up", pid);
+			if (!h->xpid)
+				break;
+			kill(h->xpid, SIGTERM);
+		}
+	}
+}
+
+
+/*
+ * Like stop_gconf()
+ */
+static void shut_down_gconf(void)
+{
+	int status = 0;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		return;
+	if (pid == 0) {
+		execlp("gconftool-2", "gconftool-2", "--shutdown", NULL);
+		_exit(EXIT_FAILURE);
+	}
+	while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+		;
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		lprintf("failed to shut down gconf");
+}
+
+
+/*
+ * Like set_text_mode()
+ */
+static void console_text_mode(void)
+{
+	int fd;
+
+	if (h->no_vt)
+		return;
+
+	fd = open(h->displaydev, O_RDWR);
+	if (fd < 0) {
+		lprintf("Unable to open /dev/console, using stdin");
+		fd = 0;
+	}
+	ioctl(fd, KDSETMODE, KD_TEXT);
+	if (fd != 0)
+		close(fd);
+}
+
+
+/*
+ * Like stop_ssh_agent(), stop_daemons() and stop_dbus_session_bus()
+ */
+static void stop_helpers(void)
+{
+	int i;
+
+	for (i = 0; i < MAX_DAEMONS; i++) {
+		if (!h->daemons[i].pid)
+			continue;
+		kill(h->daemons[i].pid, SIGTERM);
+		waitpid(h->daemons[i].pid, NULL, WNOHANG);
+		h->daemons[i].pid = 0;
+	}
+
+	if (h->ssh_agent_dir[0] != '\0') {
+		unlink(h->ssh_agent_sock);
+		rmdir(h->ssh_agent_dir);
+	}
+
+	if (h->dbus_pid > 0)
+		kill(h->dbus_pid, SIGTERM);
+}
+
+
+/*
+ * Like close_pam_session(), release_runtime_dir() and stop_oom_task()
+ */
+static void release_session(void)
+{
+	struct oom_adj_struct request;
+
+	if (h->pam_pid > 0) {
+		close(h->pam_fd);
+		while (waitpid(h->pam_pid, NULL, 0) < 0 && errno == EINTR)
+			;
+	}
+
+	if (h->helper_fd < 0)
+		return;
+
+	if (h->runtime_uid >= 0) {
+		memset(&request, 0, sizeof(request));
+		request.type = REQ_RUNTIME_RELEASE;
+		request.prio = h->runtime_uid;
+		if (write(h->helper_fd, &request, sizeof(request)) < 0)
+			lprintf("Error: unable to write to oom_adj pipe");
+	}
+	close(h->helper_fd);
+}
+
+
+int main(int argc, char **argv)
+{
+	struct sigaction term;
+	sigset_t mask;
+	uint64_t rss, pss;
+
+	if (argc != 2 || !(h = map_handover(atoi(argv[1])))) {
+		fprintf(stderr, "uxlaunch-supervisor: only uxlaunch runs this\n");
+		return EXIT_FAILURE;
+	}
+
+	/* the exec of an unreadable file kept this off already, see supervise.c */
+	prctl(PR_SET_DUMPABLE, 0);
+
+	take_over_phases(h);
+	take_over_metrics(h);
+
+	/* uxlaunch blocked these for the exec */
+	memset(&term, 0, sizeof(struct sigaction));
+	term.sa_handler = termhandler;
+	sigaction(SIGTERM, &term, NULL);
+	sigaction(SIGINT, &term, NULL);
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigprocmask(SIG_UNBLOCK, &mask, NULL);
+
+	if (!memory_usage(&rss, &pss)) {
+		lprintf("Supervising the session: Rss %llu kB, Pss %llu kB, was %llu kB, %llu kB",
+			(unsigned long long)rss / 1024, (unsigned long long)pss / 1024,
+			(unsigned long long)h->rss[MEM_STARTUP] / 1024,
+			(unsigned long long)h->pss[MEM_STARTUP] / 1024);
+		metrics_memory(MEM_SUPERVISOR, rss, pss);
+	}
+	write_metrics();
+
+	/*
+	 * The desktop session runs here, until X or the compositor exits
+	 */
+	wait_for_exit();
+	mark_phase("exit");
+	write_metrics();
+
+	shut_down_gconf();
+
+	console_text_mode();
+
+	stop_helpers();
+	release_session();
+
+	if (h->zygote_fd >= 0)
+		close(h->zygote_fd);
+	unlink(h->xauth_cookie_file);
+	mark_phase("teardown");
+
+	/* Make sure that we clean up after ourselves */
+	sleep(2);
+
+	lprintf("Terminating uxlaunch and all children");
+	kill(0, SIGKILL);
+
+	return EXIT_SUCCESS;
+}
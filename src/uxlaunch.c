@@ -17,6 +17,8 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <pwd.h>
+#include <grp.h>
+#include <limits.h>
 
 #include "uxlaunch.h"
 
@@ -26,14 +28,19 @@
 static void
 launch_user_session(void)
 {
-	char xhost_cmd[80];
-
 	dprintf("entering launch_user_session()");
 
-	setup_user_environment();
+	/* before the zygote starts any watchdog */
+	init_metrics(current_seat, new_vt ? atoi(displayname + 1) : -1);
 
-	/* this needs XDG_* set in environ */
-	get_session_type();
+	/* otherwise done before starting X, to know if it's needed at all */
+	if (x_session_only) {
+		setup_user_environment();
+
+		/* this needs XDG_* set in environ */
+		get_session_type();
+		mark_phase("environment");
+	}
 
 	start_ssh_agent();
 
@@ -42,22 +49,48 @@ launch_user_session(void)
 
 	/* gconf needs dbus */
 	start_gconf();
+	mark_phase("agents");
 
 	log_environment();
 
-	maybe_start_screensaver();
+	if (!wayland_session)
+		maybe_start_screensaver();
 
-	start_desktop_session();
+	/* the environment is final, everything from here on is started by the zygote */
+	setup_zygote();
 
-	/* finally, set local username to be allowed at any time,
-	 * which is not depenedent on hostname changes */
-	snprintf(xhost_cmd, 80, "/usr/bin/xhost +SI:localuser:%s",
-		 pass->pw_name);
-	if (system(xhost_cmd) != 0)
-		lprintf("%s failed", xhost_cmd);
+	if (wayland_session) {
+		prepare_wayland();
+	} else {
+		/* the window manager reads Xft.dpi when it starts */
+		setup_X_display();
+		mark_phase("xsetup");
+	}
+	start_desktop_session();
+	boost_pid(session_pid);
+	if (wayland_session) {
+		/* the zygote and the autostart need WAYLAND_DISPLAY */
+		wait_for_wayland();
+		mark_phase("compositor");
+	}
+	start_zygote();
+	mark_phase("session");
 
 	autostart_desktop_files();
+
+	/* panels and applets want the window manager up first */
+	wait_for_session_ready();
+	mark_phase("session-ready");
+
 	do_autostart();
+	unboost();
+	mark_phase("autostart");
+
+	/* held back with a remote home, finish_history() writes to ~/.cache */
+	flush_home_writes();
+
+	/* in the background, once the autostart entries settled */
+	finish_history();
 	dprintf("leaving launch_user_session()");
 }
 
@@ -88,37 +121,87 @@ int main(int argc, char **argv)
 	 */
 
 	get_options(argc, argv);
+	mark_phase("options");
+
+	if (dry_run) {
+		/* resolve and filter everything, but launch nothing */
+		if (!getuid() && (initgroups(pass->pw_name, pass->pw_gid) ||
+				  setgid(pass->pw_gid) || setuid(pass->pw_uid))) {
+			lprintf("Fatal: Unable to setgid()/setuid()");
+			return EXIT_FAILURE;
+		}
+		setup_user_environment();
+		get_session_type();
+		autostart_desktop_files();
+		print_autostart_plan();
+		return EXIT_SUCCESS;
+	}
 
 	if (x_session_only) {
 		dprintf("X session only: skipping major parts of setup");
 		launch_user_session();
+		write_metrics();
 		wait_for_session_exit();
 		stop_gconf();
+		stop_ssh_agent();
+		stop_daemons();
 		return 0;
 	}
 
+	/* in multi-seat mode, we continue here once for each seat */
+	if (seat_count)
+		start_seats();
+
 	set_tty();
+	mark_phase("tty");
 
 	setup_xauth();
+	mark_phase("xauth");
 
 #ifdef ENABLE_CHOOSER
-	if (chooser[0] != '\0')
+	if (chooser[0] != '\0') {
 		setup_chooser();
+		mark_phase("chooser");
+	}
 #endif
 
 #ifdef ENABLE_ECRYPTFS
+	/* runs in the background until wait_for_efs() */
 	setup_efs();
 #endif
 
 	start_oom_task();
+	mark_phase("oom");
 
 	setup_pam_session();
+	mark_phase("pam");
 
 #ifdef WITH_CONSOLEKIT
 	setup_consolekit_session();
+	mark_phase("consolekit");
 #endif
 
+	/* after PAM, which may have made one for us */
+	setup_runtime_dir();
+
+#ifdef ENABLE_CHOOSER
+	/* the selection came in early, the chooser may still be exiting */
+	wait_for_chooser();
+	mark_phase("chooser-exit");
+#endif
+
+#ifdef ENABLE_ECRYPTFS
+	wait_for_efs();
+	mark_phase("efs");
+#endif
+
+	/* needs root, the fds stay usable afterwards */
+	open_input_devices();
+
+	unlock_runtime_dir();
+
 	switch_to_user();
+	mark_phase("user");
 
 	/*
 	 * BUG: udev is sometimes not done when we go and start Xorg,
@@ -128,20 +211,43 @@ int main(int argc, char **argv)
 	 */
 	if (settle) {
 		dprintf("Waiting for udev to settle for 10 seconds max...");
-		if (system("/sbin/udevadm settle --timeout 10") != EXIT_SUCCESS)
+		char cmd[PATH_MAX];
+
+		snprintf(cmd, PATH_MAX, "%s/sbin/udevadm settle --timeout 10", sysroot);
+		if (system(cmd) != EXIT_SUCCESS)
 			lprintf("udevadm settle bash returned an error");
+		mark_phase("settle");
 	}
 
-	start_X_server();
-
-	/*
-	 * These steps don't need X running
-	 * so can happen while X is talking to the
-	 * hardware
-	 */
-	wait_for_X_signal();
+	/* the session file says whether we need X or a compositor */
+	setup_user_environment();
+	get_session_type();
+	mark_phase("environment");
+
+	if (wayland_session) {
+		/* the compositor is the session, and starts with it */
+		if (xpid)
+			stop_X_server();
+		arm_termhandler();
+	} else if (!xpid) {
+		start_X_server();
+		boost_pid(xpid);
+		mark_phase("xstart");
+
+		/*
+		 * These steps don't need X running
+		 * so can happen while X is talking to the
+		 * hardware
+		 */
+		wait_for_X_signal();
+		mark_phase("xready");
+	} else {
+		boost_pid(xpid);
+		mark_phase("xready");
+	}
 
 	launch_user_session();
+	write_metrics();
 
 	/*
 	 * we do this now to make sure dbus etc are not spawning
@@ -149,14 +255,20 @@ int main(int argc, char **argv)
 	 * tasks at non-oomkillable priorities
 	 */
 
-	oom_adj(xpid, -1000);
+	if (xpid)
+		oom_adj(xpid, -1000);
 	oom_adj(session_pid, -1000);
 	oom_adj(getpid(), -1000);
 
+	/* leave the rest to uxlaunch-supervisor, if we can */
+	supervise();
+
 	/*
-	 * The desktop session runs here
+	 * The desktop session runs here, until X or the compositor exits
 	 */
 	wait_for_X_exit();
+	mark_phase("exit");
+	write_metrics();
 
 	stop_gconf();
 
@@ -164,11 +276,14 @@ int main(int argc, char **argv)
 
 	// close_consolekit_session();
 	stop_ssh_agent();
+	stop_daemons();
 	stop_dbus_session_bus();
 	close_pam_session();
+	release_runtime_dir();
 	stop_oom_task();
 
 	unlink(xauth_cookie_file);
+	mark_phase("teardown");
 
 	/* Make sure that we clean up after ourselves */
 	sleep(2);
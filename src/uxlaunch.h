@@ -3,6 +3,8 @@
 
 #include <X11/Xauth.h>
 #include <sys/types.h>
+#include <stdint.h>
+#include <limits.h>
 #include <pwd.h>
 #include <glib.h>
 
@@ -28,20 +30,45 @@ extern int session_pid;
 extern int xpid;
 extern int settle;
 
+extern char sysroot[];
+
 extern int verbose;
 extern int x_session_only;
+extern int dry_run;
 extern char addn_xopts[];
 
 extern void get_options(int argc, char **argv);
 extern void set_i18n(void);
 extern void setup_pam_session(void);
 extern void close_pam_session(void);
+extern const char *pam_runtime_dir(void);
+extern char runtime_dir[];
+extern void setup_runtime_dir(void);
+extern void unlock_runtime_dir(void);
+extern void release_runtime_dir(void);
+extern void helper_runtime_dir(uid_t uid, int hold);
+extern void helper_runtime_exit(void);
 extern void switch_to_user(void);
 extern void setup_user_environment(void);
 extern void set_tty(void);
 extern void setup_xauth(void);
 extern void start_X_server(void);
+extern void prepare_X_handover(void);
+extern int x_noreset;
+extern void hand_over_X_server(void);
+extern void take_over_X_server(void);
 extern void wait_for_X_signal(void);
+extern void stop_X_server(void);
+extern char display_backend[];
+extern char headless_screen[];
+extern int no_vt;
+extern void arm_termhandler(void);
+extern char x_background[];
+extern void setup_X_display(void);
+
+extern int wayland_session;
+extern void prepare_wayland(void);
+extern void wait_for_wayland(void);
 extern void start_dbus_session_bus(void);
 extern void stop_dbus_session_bus(void);
 extern void start_ssh_agent(void);
@@ -51,32 +78,283 @@ extern void stop_gconf(void);
 extern void init_screensaver(int);
 extern void maybe_start_screensaver(void);
 extern void get_session_type(void);
+
+struct session_entry {
+	gchar *name;
+	gchar *path;
+	gchar *exec;
+	gchar *filter;
+	gchar *target;		/* symlink target, NULL if not a link */
+	long long mtime;
+	int notify;		/* X-UXLaunch-Notify=true */
+	int wayland;		/* runs a compositor instead of X */
+};
+
+/* .desktop files, see keyfile.c */
+struct keyfile {
+	char *data;
+	size_t size;
+};
+
+struct keyfile_key {
+	const char *name;
+	const char *value;	/* into the file, not terminated */
+	int len;
+};
+
+extern int keyfile_open(struct keyfile *kf, const char *path);
+extern void keyfile_close(struct keyfile *kf);
+extern int keyfile_lookup(struct keyfile *kf, struct keyfile_key *keys, int count);
+extern char *keyfile_string(const struct keyfile_key *key, char *buf, int size);
+extern int keyfile_list_match(const struct keyfile_key *key, const char *word);
+extern int keyfile_value_has(const struct keyfile_key *key, const char *word);
+extern int keyfile_boolean(const struct keyfile_key *key);
+
+extern void index_sessions(const char *config_home);
+extern void watch_sessions(void);
+extern void unwatch_sessions(void);
+extern void flush_sessions_cache(void);
+
+extern int remote_home;
+extern void check_home(void);
+extern void prefetch_home(void);
+extern void home_file_path(char *path, const char *name);
+extern void flush_home_writes(void);
+extern struct session_entry *lookup_session(const char *name);
+extern void foreach_session(void (*func)(struct session_entry *, void *), void *data);
 extern void autostart_desktop_files(void);
+extern void sort_desktop_entries(void);
+extern void free_desktop_entries(void);
+extern void print_autostart_plan(void);
 extern void do_autostart(void);
+
+extern int log_size;
+extern int log_rate;
+extern pid_t logger_pid;
+extern int start_logger(void);
+extern int log_output(const char *tag);
+extern void flush_log(void);
+extern int crashed(int status);
+
+/* watchdog types */
+#define WD_NONE 0
+#define WD_HALT 1
+#define WD_RESTART 2
+#define WD_FAIL 3
+
+extern void setup_zygote(void);
+extern void start_zygote(void);
+extern pid_t zygote_spawn(const char *name, const char *exec, int prio, int watchdog);
+
+extern int session_notify;
+extern int session_ready_timeout;
+extern void setup_session_notify(void);
+extern void session_notify_child(void);
+extern void session_notify_parent(void);
+extern void drop_session_notify(void);
+extern void wait_for_session_ready(void);
 extern void start_desktop_session(void);
 extern void wait_for_session_exit(void);
 extern void start_bash(void);
 extern void wait_for_X_exit(void);
 extern void set_text_mode(void);
 
+extern int seat_count;
+extern int current_seat;
+extern void add_seat(const char *spec);
+extern void start_seats(void);
+extern int seat_uids(uid_t *uids, int max);
+
 extern void oom_adj(int, int);
 extern void start_oom_task(void);
 extern void stop_oom_task(void);
 
+/* requests to the oom_adj helper */
+#define REQ_OOM_ADJ	0
+#define REQ_BOOST	1
+#define REQ_UNBOOST	2
+#define REQ_BACKGROUND	3
+#define REQ_NICE	4
+#define REQ_RUNTIME_HOLD	5
+#define REQ_RUNTIME_RELEASE	6
+#define REQ_SESSION	7
+
+/*
+ * Requests to the helper, which stays root after we switch to the
+ * user. REQ_OOM_ADJ is the original purpose, hence the name.
+ */
+struct oom_adj_struct {
+	int type;
+	pid_t pid;
+	int prio;
+};
+
+extern void helper_request(int type, pid_t pid, int val);
+extern int helper_uid_allowed(uid_t uid);
+extern int helper_pid_allowed(pid_t pid);
+
+extern int boost_util;
+extern int boost_timeout;
+extern char boost_epp[];
+extern void boost_pid(pid_t pid);
+extern void unboost(void);
+extern void helper_boost(pid_t pid);
+extern void helper_unboost(const char *why);
+extern int helper_boost_timeout(void);
+extern void helper_boost_expire(void);
+
+/* memory and io */
+#define PSI_FDS 2
+
+struct pollfd;
+extern int pressure_ms;
+extern void background_pid(pid_t pid);
+extern void helper_background(pid_t pid);
+extern void background_nice(int lower);
+extern void helper_background_nice(int lower);
+extern int pressure_pollfds(struct pollfd *fds);
+extern int pressure_timeout(void);
+extern void pressure_check(struct pollfd *fds, int n);
+extern void helper_pressure_exit(void);
+extern void helper_session(pid_t pid);
+extern void helper_session_hidden(int hide);
+
+/* fast user switching */
+extern int new_vt;
+extern int vt_freeze;
+extern void pick_new_vt(int fd);
+extern void pick_free_display(void);
+extern void freeze_when_hidden(pid_t zygote);
+extern void helper_watch_vt(void);
+extern int vt_pollfds(struct pollfd *fds);
+extern void vt_check(struct pollfd *fds, int n);
+
+/* keyboard and mouse activity */
+extern int input_quiet;
+extern int input_max;
+extern void open_input_devices(void);
+extern void wait_for_input_quiet(void);
+
 extern void lprintf(const char *, ...);
 extern void log_environment(void);
+extern uint64_t elapsed_usecs(void);
+extern uint64_t boot_usecs(void);
+extern void mark_phase(const char *);
+extern int phase_usecs(const char *, uint64_t *);
+extern int phase_at(int, const char **, uint64_t *);
+
+extern char metrics_dir[];
+extern void init_metrics(int seat, int display);
+extern void write_metrics(void);
+extern void metrics_bracket_done(int prio);
+extern void metrics_autostart(const char *outcome);
+extern void metrics_watchdog_restart(const char *file, int restarts);
+extern void metrics_memory(int stage, uint64_t rss, uint64_t pss);
+extern int memory_usage(uint64_t *rss, uint64_t *pss);
+
+/*
+ * Once the session is up, we exec uxlaunch-supervisor, which waits
+ * for it to end and tears it down. Everything it needs is passed in
+ * this struct, in a memfd.
+ */
+#define HANDOVER_MAGIC 0x75786c32	/* "uxl2" */
+
+#define MAX_PHASES 32
+#define MAX_DAEMONS 16
+#define BRACKETS 5
+#define OUTCOMES 3
+
+/* metrics_memory() stages */
+#define MEM_STARTUP 0
+#define MEM_SUPERVISOR 1
+#define MEM_STAGES 2
+
+struct handover {
+	uint32_t magic;
+	uint32_t size;
+
+	/* lib.c and metrics.c */
+	int verbose;
+	char sysroot[PATH_MAX];
+	uint64_t start_usecs;
+	uint64_t start_boottime;
+	int phase_count;
+	struct {
+		char name[32];
+		uint64_t usecs;
+	} phases[MAX_PHASES];
+	char metrics_dir[PATH_MAX];
+	char metrics_name[32];
+	int bracket_done[BRACKETS];
+	uint64_t bracket_usecs[BRACKETS];
+	int outcomes[OUTCOMES];
+	uint64_t rss[MEM_STAGES];
+	uint64_t pss[MEM_STAGES];
+
+	/* what wait_for_X_exit() waits for */
+	pid_t xpid;
+	pid_t session_pid;
+	pid_t logger_pid;
+
+	/* the teardown */
+	int no_vt;
+	char displaydev[PATH_MAX];
+	char xauth_cookie_file[PATH_MAX];
+	pid_t dbus_pid;
+	pid_t ssh_agent_pid;
+	char ssh_agent_dir[PATH_MAX];
+	char ssh_agent_sock[PATH_MAX];
+	struct {
+		pid_t pid;
+		char name[64];
+	} daemons[MAX_DAEMONS];
+	pid_t pam_pid;		/* keeps the PAM handle, see pam.c */
+	int pam_fd;
+	int helper_fd;		/* the oom_adj helper */
+	int runtime_uid;	/* -1 if the runtime dir isn't ours */
+	int zygote_fd;
+};
+
+extern void supervise(void);
+extern void keep_fd(int fd);
+extern void hand_over_phases(struct handover *h);
+extern void take_over_phases(struct handover *h);
+extern void hand_over_metrics(struct handover *h);
+extern void take_over_metrics(struct handover *h);
+extern void hand_over_dbus(struct handover *h);
+extern void hand_over_ssh_agent(struct handover *h);
+extern void hand_over_daemons(struct handover *h);
+extern void hand_over_pam(struct handover *h);
+extern void hand_over_runtime_dir(struct handover *h);
+extern void hand_over_oom_task(struct handover *h);
+extern void hand_over_zygote(struct handover *h);
 
 #ifdef WITH_CONSOLEKIT
 extern void setup_consolekit_session(void);
+extern void hand_over_consolekit(void);
 #endif
 
 #ifdef ENABLE_ECRYPTFS
 extern void setup_efs(void);
+extern void wait_for_efs(void);
 #endif
 
 #ifdef ENABLE_CHOOSER
+#define MAX_HOME_USERS 64
+
+struct home_user_struct {
+	char name[256];
+	char gecos[256];
+	char dir[256];
+	uid_t uid;
+	gid_t gid;
+};
+
 extern char chooser[];
+extern struct home_user_struct home_users[];
+extern int home_user_count;
 extern void setup_chooser(void);
+extern void wait_for_chooser(void);
 #endif
 
 #define NORMAL 0
@@ -85,7 +363,25 @@ extern void setup_chooser(void);
 #define DELAYED 4
 #define BACKGROUND 8
 
-extern void start_daemon(int flags, char *cmd, char *args);
+extern char pin_cpus[];
+extern int start_daemon(int flags, const char *cmd, const char *args);
+extern void daemon_exited(pid_t pid);
+extern void stop_daemon(pid_t pid);
+extern void stop_daemons(void);
+extern void set_low_priority(void);
+extern void wait_for_idle(void (*tick)(void));
+
+extern void load_history(void);
+extern uint64_t history_cost(const char *file);
+extern void history_forked(const char *file, int prio, pid_t pid);
+extern void sample_history(void);
+extern void history_write_entries(FILE *f);
+extern void finish_history(void);
+
+extern int analyze_percentile;
+extern int analyze_threshold;
+extern void write_boot_record(void);
+extern int analyze_boots(int diff_mode, int argc, char **argv);
 
 #define d_in() dprintf("Enter: %s/%s", __FILE__, __func__)
 #define d_out() dprintf("Exit: %s/%s", __FILE__, __func__)
@@ -0,0 +1,155 @@
+/*
+ * This file is part of uxlaunch
+ *
+ * Fast user switching: with --new-vt, a second uxlaunch starts its
+ * session on the first free VT with the first free display, next to
+ * the sessions that are already running. Each session has its own
+ * oom_adj helper, which freezes everything the launch zygote started
+ * while the VT of its session isn't the active one, so hidden sessions
+ * don't compete for the CPU.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <linux/vt.h>
+
+#include "uxlaunch.h"
+
+#define VT_ACTIVE_FILE "/sys/class/tty/tty0/active"
+
+/* look for a free display up to this number */
+#define MAX_DISPLAY 64
+
+int new_vt = 0;
+int vt_freeze = 0;
+
+static int vt_fd = -1;
+
+
+static int display_in_use(int n)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, PATH_MAX, "/tmp/.X%d-lock", n);
+	if (!access(path, F_OK))
+		return 1;
+	snprintf(path, PATH_MAX, "/tmp/.X11-unix/X%d", n);
+	return !access(path, F_OK);
+}
+
+
+void pick_free_display(void)
+{
+	int n;
+
+	for (n = 0; n < MAX_DISPLAY; n++) {
+		if (display_in_use(n))
+			continue;
+		snprintf(displayname, 256, ":%d", n);
+		lprintf("Using free display %s", displayname);
+		break;
+	}
+}
+
+
+/*
+ * Called from set_tty() with the console fd, picks the VT and display
+ * for a session next to the running ones
+ */
+void pick_new_vt(int fd)
+{
+	int n;
+
+	d_in();
+
+	if (ioctl(fd, VT_OPENQRY, &n) || n <= 0) {
+		lprintf("VT_OPENQRY failed, using tty%d", tty);
+	} else {
+		tty = n;
+		lprintf("Using free tty%d", tty);
+	}
+
+	pick_free_display();
+
+	d_out();
+}
+
+
+/*
+ * Have the helper freeze the zygote and everything it starts while
+ * our VT is hidden
+ */
+void freeze_when_hidden(pid_t zygote)
+{
+	/* the other seats and Xvfb don't have a VT of their own */
+	if (!vt_freeze || seat_count || no_vt || zygote <= 0)
+		return;
+	helper_request(REQ_SESSION, zygote, 0);
+}
+
+
+/*
+ * The rest runs in the helper. The kernel notifies pollers of the sysfs
+ * file on every VT switch.
+ */
+static void check_active_vt(void)
+{
+	char buf[32];
+	char ours[32];
+	ssize_t len;
+
+	if (lseek(vt_fd, 0, SEEK_SET) < 0)
+		return;
+	len = read(vt_fd, buf, sizeof(buf) - 1);
+	if (len <= 0)
+		return;
+	buf[len] = '\0';
+
+	snprintf(ours, sizeof(ours), "tty%d\n", tty);
+	helper_session_hidden(strcmp(buf, ours) != 0);
+}
+
+
+void helper_watch_vt(void)
+{
+	if (vt_fd >= 0)
+		return;
+
+	vt_fd = open(VT_ACTIVE_FILE, O_RDONLY | O_CLOEXEC);
+	if (vt_fd < 0) {
+		lprintf("vt: unable to open %s, not freezing hidden sessions", VT_ACTIVE_FILE);
+		return;
+	}
+	/* the first read arms the notification */
+	check_active_vt();
+}
+
+
+int vt_pollfds(struct pollfd *fds)
+{
+	if (vt_fd < 0)
+		return 0;
+	fds[0].fd = vt_fd;
+	fds[0].events = POLLPRI | POLLERR;
+	fds[0].revents = 0;
+	return 1;
+}
+
+
+void vt_check(struct pollfd *fds, int n)
+{
+	if (n > 0 && fds[0].revents)
+		check_active_vt();
+}
@@ -0,0 +1,198 @@
+/*
+ * This file is part of uxlaunch
+ *
+ * Wayland sessions: the session program is a compositor that we start
+ * directly on the VT, without an X server. It's ready once it listens
+ * on a new wayland-<n> socket in $XDG_RUNTIME_DIR, which then becomes
+ * WAYLAND_DISPLAY for everything started after it.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <sys/wait.h>
+
+#include "uxlaunch.h"
+
+/* wayland-0 up to this, the compositor takes the first free one */
+#define MAX_WAYLAND 32
+
+/* same as we give X */
+#define WAYLAND_TIMEOUT 10000
+
+/* ms between looks at whether the compositor is still there */
+#define WAYLAND_CHECK 100
+
+/* probes 10 ms apart after a file showed up, it binds before it listens */
+#define WAYLAND_RETRIES 10
+
+int wayland_session = 0;
+
+static uint32_t existing;
+
+
+/*
+ * Is there a compositor listening on it? It binds before it listens.
+ */
+static int wayland_listening(const char *dir, int n)
+{
+	struct sockaddr_un addr;
+	int fd, ret;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/wayland-%d", dir, n);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return 0;
+	ret = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+	close(fd);
+
+	return ret == 0;
+}
+
+
+/*
+ * Before starting the compositor, so a socket of another session of
+ * the same user isn't mistaken for ours
+ */
+void prepare_wayland(void)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	char vtnr[16];
+	int n;
+
+	d_in();
+
+	unsetenv("DISPLAY");
+	unsetenv("WAYLAND_DISPLAY");
+	setenv("XDG_SESSION_TYPE", "wayland", 1);
+	/* the compositor takes over this VT itself */
+	snprintf(vtnr, sizeof(vtnr), "%d", tty);
+	setenv("XDG_VTNR", vtnr, 1);
+
+	existing = 0;
+	for (n = 0; dir && n < MAX_WAYLAND; n++)
+		if (wayland_listening(dir, n))
+			existing |= 1u << n;
+
+	d_out();
+}
+
+
+static int new_socket(const char *dir)
+{
+	int n;
+
+	for (n = 0; n < MAX_WAYLAND; n++) {
+		if (existing & (1u << n))
+			continue;
+		if (wayland_listening(dir, n))
+			return n;
+	}
+
+	return -1;
+}
+
+
+/*
+ * Has the compositor died on us? Leaves it for wait_for_X_exit() to reap.
+ */
+static int compositor_exited(void)
+{
+	siginfo_t info;
+
+	memset(&info, 0, sizeof(info));
+	if (session_pid <= 0)
+		return 0;
+	if (waitid(P_PID, session_pid, &info, WEXITED | WNOHANG | WNOWAIT) < 0)
+		return errno == ECHILD;
+	return info.si_pid == session_pid;
+}
+
+
+/*
+ * Wait for the compositor to come up, like wait_for_X_signal()
+ */
+void wait_for_wayland(void)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	struct pollfd pfd;
+	char buf[4096];
+	char name[32];
+	uint64_t deadline;
+	int64_t left;
+	int timeout;
+	int retry = 0;
+	int n = -1;
+	int fd;
+
+	d_in();
+
+	if (!dir) {
+		lprintf("No XDG_RUNTIME_DIR, can't wait for the compositor");
+		d_out();
+		return;
+	}
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd >= 0 && inotify_add_watch(fd, dir, IN_CREATE | IN_MOVED_TO) < 0) {
+		close(fd);
+		fd = -1;
+	}
+
+	deadline = elapsed_usecs() + WAYLAND_TIMEOUT * 1000ULL;
+	while ((n = new_socket(dir)) < 0) {
+		if (compositor_exited()) {
+			lprintf("The compositor exited before creating a socket");
+			break;
+		}
+
+		left = (int64_t)(deadline - elapsed_usecs()) / 1000;
+		if (left <= 0) {
+			lprintf("The compositor didn't create a socket in %s", dir);
+			break;
+		}
+
+		/* without inotify, or between bind() and listen(), poll */
+		timeout = fd < 0 || retry ? 10 : WAYLAND_CHECK;
+		if (timeout > left)
+			timeout = left;
+		if (retry)
+			retry--;
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, fd < 0 ? 0 : 1, timeout) > 0) {
+			while (read(fd, buf, sizeof(buf)) > 0)
+				;
+			retry = WAYLAND_RETRIES;
+		}
+	}
+
+	if (fd >= 0)
+		close(fd);
+
+	if (n >= 0) {
+		snprintf(name, sizeof(name), "wayland-%d", n);
+		setenv("WAYLAND_DISPLAY", name, 1);
+		lprintf("Compositor is listening on %s/%s", dir, name);
+	}
+
+	d_out();
+}
@@ -12,6 +12,7 @@
  * of the License.
  */
 
+#define _GNU_SOURCE
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -29,11 +30,13 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/utsname.h>
+#include <sys/prctl.h>
 #include <pwd.h>
 
 #include "uxlaunch.h"
 
 #include <X11/Xauth.h>
+#include <xcb/xcb.h>
 #include <glib.h>
 
 char displaydev[PATH_MAX];	/* "/dev/tty1" */
@@ -46,6 +49,17 @@ static pthread_cond_t notify_condition = PTHREAD_COND_INITIALIZER;
 
 int xpid;
 
+/* xorg, xvfb or dummy (Xorg with the dummy video driver) */
+char display_backend[16] = "xorg";
+char headless_screen[32] = "1280x1024x24";
+/* Xvfb needs no VT, so we leave the console alone */
+int no_vt = 0;
+
+/* not for a greeter's X server, see take_over_X_server() */
+int x_noreset = 1;
+
+#define DUMMY_CONFIG "uxlaunch-dummy.conf"
+
 #define XAUTH_DIR "/var/run/uxlaunch"
 
 static volatile int exiting = 0;
@@ -63,6 +77,15 @@ void set_tty(void)
 
 	d_in();
 
+	if (no_vt) {
+		lprintf("Headless, not using a VT");
+		displaydev[0] = '\0';
+		if (new_vt)
+			pick_free_display();
+		d_out();
+		return;
+	}
+
 	/* switch to this console */
 	fd = open("/dev/console", O_RDWR);
 	if (fd < 0) {
@@ -70,13 +93,18 @@ void set_tty(void)
 		fd = 0;
 	}
 
+	/* next to the sessions that are running already */
+	if (new_vt && current_seat <= 0)
+		pick_new_vt(fd);
+
 	if (ioctl(fd, VT_GETSTATE, &v)) {
 		lprintf("VT_GETSTATE failed");
 		close(fd);
 		return;
 	}
 
-	if (v.v_active != tty) {
+	/* with several seats, only the first one takes over the console */
+	if (v.v_active != tty && current_seat <= 0) {
 		if (ioctl(fd, VT_ACTIVATE, tty))
 			lprintf("VT_ACTIVATE failed");
 	}
@@ -89,27 +117,37 @@ void set_tty(void)
 	d_out();
 }
 
+static char cookie[16];
+
+static int random_cookie(void)
+{
+	FILE *fp;
+	int ret;
+
+	fp = fopen("/dev/urandom", "r");
+	if (!fp)
+		return -1;
+	ret = fread(cookie, sizeof(cookie), 1, fp) == 1 ? 0 : -1;
+	fclose(fp);
+
+	return ret;
+}
+
 void setup_xauth(void)
 {
 	FILE *fp;
 	int fd;
-	static char cookie[16];
 	struct utsname uts;
 
 	static char xau_address[80];
-	static char xau_number[] = "0"; // FIXME, detect correct displaynum
+	static char xau_number[16];
 	static char xau_name[] = "MIT-MAGIC-COOKIE-1";
+	char xau_dir[PATH_MAX];
 
 	d_in();
 
-	fp = fopen("/dev/urandom", "r");
-	if (!fp)
-		return;
-	if (fgets(cookie, sizeof(cookie), fp) == NULL) {
-		fclose(fp);
+	if (random_cookie())
 		return;
-	}
-	fclose(fp);
 
 	/* construct xauth data */
 	if (uname(&uts) < 0) {
@@ -118,6 +156,7 @@ void setup_xauth(void)
 	}
 
 	sprintf(xau_address, "%s", uts.nodename);
+	snprintf(xau_number, sizeof(xau_number), "%d", atoi(displayname + 1));
 	x_auth.family = FamilyLocal;
 	x_auth.address = xau_address;
 	x_auth.number = xau_number;
@@ -129,8 +168,9 @@ void setup_xauth(void)
 	x_auth.data_length = sizeof(cookie);
 
 
-	mkdir(XAUTH_DIR, 01755);
-	snprintf(xauth_cookie_file, PATH_MAX, "%s/Xauth-%s-XXXXXX", XAUTH_DIR, pass->pw_name);
+	snprintf(xau_dir, PATH_MAX, "%s%s", sysroot, XAUTH_DIR);
+	mkdir(xau_dir, 01755);
+	snprintf(xauth_cookie_file, PATH_MAX, "%s/Xauth-%s-XXXXXX", xau_dir, pass->pw_name);
 
 	fd = mkstemp(xauth_cookie_file);
 	if (fd < 0) {
@@ -186,7 +226,232 @@ static void termhandler(int foo)
 	if (session_pid)
 		kill(session_pid, SIGKILL);
 
-	kill(xpid, SIGTERM);
+	if (xpid)
+		kill(xpid, SIGTERM);
+	d_out();
+}
+
+void arm_termhandler(void)
+{
+	struct sigaction term;
+
+	memset(&term, 0, sizeof(struct sigaction));
+	term.sa_handler = termhandler;
+	sigaction(SIGTERM, &term, NULL);
+	sigaction(SIGINT, &term, NULL);
+}
+
+
+/*
+ * The chooser and the ecryptfs greeter run in a child process with
+ * their own X server. Instead of tearing that X server down and
+ * starting a new one for the session, the child passes it back to
+ * us through this pipe. We become the subreaper so that the X server
+ * gets reparented to us when the child exits and we can still
+ * waitpid() for it.
+ */
+struct X_handover_struct {
+	pid_t pid;
+	uid_t uid;
+	char auth[PATH_MAX];	/* the -auth file it was started with */
+};
+
+static int handover_pipe[2] = { -1, -1 };
+
+/* keeps a reused X server from resetting, see new_X_cookie() */
+static xcb_connection_t *x_hold;
+
+void prepare_X_handover(void)
+{
+	d_in();
+
+	if (prctl(PR_SET_CHILD_SUBREAPER, 1) < 0)
+		lprintf("Unable to become subreaper, X server can't be reused");
+	else if (pipe2(handover_pipe, O_CLOEXEC) < 0)
+		lprintf("Unable to create X handover pipe");
+
+	d_out();
+}
+
+/*
+ * child side: pass the running X server on, or shut it down if
+ * it can't be reused
+ */
+void hand_over_X_server(void)
+{
+	struct X_handover_struct h;
+
+	d_in();
+
+	if (handover_pipe[1] < 0) {
+		kill(xpid, SIGTERM);
+		waitpid(xpid, NULL, 0);
+		return;
+	}
+
+	close(handover_pipe[0]);
+	memset(&h, 0, sizeof(h));
+	h.pid = xpid;
+	h.uid = getuid();
+	strncpy(h.auth, user_xauth_path, PATH_MAX - 1);
+	if (write(handover_pipe[1], &h, sizeof(h)) != sizeof(h)) {
+		lprintf("Unable to hand over X server, stopping it");
+		kill(xpid, SIGTERM);
+	}
+	close(handover_pipe[1]);
+
+	d_out();
+}
+
+/*
+ * Write the cookie to the -auth file of the X server, in the home
+ * or runtime dir of the user, so as the user
+ */
+static int write_X_auth(const char *path)
+{
+	FILE *fp;
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (pid == 0) {
+		if (setgid(pass->pw_gid) || setuid(pass->pw_uid))
+			_exit(EXIT_FAILURE);
+		fp = fopen(path, "w");
+		if (!fp)
+			_exit(EXIT_FAILURE);
+		if (XauWriteAuth(fp, &x_auth) != 1) {
+			fclose(fp);
+			_exit(EXIT_FAILURE);
+		}
+		_exit(fclose(fp) ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+		return -1;
+	return 0;
+}
+
+static xcb_connection_t *connect_with_cookie(const char *data)
+{
+	xcb_auth_info_t auth;
+	xcb_connection_t *c;
+
+	auth.namelen = x_auth.name_length;
+	auth.name = x_auth.name;
+	auth.datalen = sizeof(cookie);
+	auth.data = (char *) data;
+	c = xcb_connect_to_display_with_auth_info(displayname, &auth, NULL);
+	if (xcb_connection_has_error(c)) {
+		xcb_disconnect(c);
+		return NULL;
+	}
+	return c;
+}
+
+/*
+ * The greeter and whatever it started know the cookie of its X server,
+ * so the session gets a new one. A greeter's X server runs without
+ * -noreset: once its last client is gone, it resets, which also drops
+ * any host access the greeter granted, and it reads its -auth file
+ * again on the next connection. We keep a connection open afterwards,
+ * so it doesn't reset again whenever the session has no clients.
+ *
+ * Returns 0 when only the new cookie is accepted.
+ */
+static int new_X_cookie(const char *auth_file)
+{
+	char old[sizeof(cookie)];
+	xcb_connection_t *c;
+	FILE *fp;
+	int i;
+
+	/* from a previous take-over, e.g. of the chooser's X by the greeter */
+	if (x_hold) {
+		xcb_disconnect(x_hold);
+		x_hold = NULL;
+	}
+
+	if (x_auth.data_length != sizeof(cookie) || auth_file[0] == '\0')
+		return -1;
+
+	memcpy(old, cookie, sizeof(old));
+	if (random_cookie() || write_X_auth(auth_file)) {
+		lprintf("Unable to write a new X cookie to %s", auth_file);
+		return -1;
+	}
+	/* and our own copy, which the supervisor removes */
+	fp = fopen(xauth_cookie_file, "w");
+	if (fp) {
+		if (XauWriteAuth(fp, &x_auth) != 1)
+			lprintf("unable to write xauth data to disk");
+		fclose(fp);
+	}
+
+	/* X resets once it has noticed that the greeter's clients are gone */
+	for (i = 0; i < 20; i++) {
+		c = connect_with_cookie(old);
+		if (!c)
+			break;
+		xcb_disconnect(c);
+		usleep(50000);
+	}
+	if (i == 20)
+		return -1;
+
+	x_hold = connect_with_cookie(cookie);
+	return x_hold ? 0 : -1;
+}
+
+/*
+ * parent side: adopt the X server left running by the child, if it
+ * runs as the user that the session is for, and takes a new cookie
+ */
+void take_over_X_server(void)
+{
+	struct X_handover_struct h;
+	ssize_t ret;
+
+	d_in();
+
+	if (handover_pipe[0] < 0)
+		return;
+
+	/*
+	 * The child has been reaped by now, so it either wrote to the pipe
+	 * or never will. Don't wait for EOF, other children we forked in
+	 * the meantime may hold the write end too.
+	 */
+	close(handover_pipe[1]);
+	fcntl(handover_pipe[0], F_SETFL, O_NONBLOCK);
+	ret = read(handover_pipe[0], &h, sizeof(h));
+	close(handover_pipe[0]);
+	handover_pipe[0] = handover_pipe[1] = -1;
+
+	if (ret != sizeof(h) || h.pid <= 0)
+		return;
+	h.auth[PATH_MAX - 1] = '\0';
+
+	if (h.uid != pass->pw_uid) {
+		lprintf("Xorg[%d] runs as a different user, restarting it", h.pid);
+		kill(h.pid, SIGTERM);
+		waitpid(h.pid, NULL, 0);
+		return;
+	}
+
+	if (new_X_cookie(h.auth)) {
+		lprintf("Xorg[%d] still accepts the greeter's cookie, restarting it", h.pid);
+		kill(h.pid, SIGTERM);
+		waitpid(h.pid, NULL, 0);
+		return;
+	}
+
+	xpid = h.pid;
+	arm_termhandler();
+	lprintf("Reusing Xorg[%d] for the session, with a new cookie", xpid);
+
 	d_out();
 }
 
@@ -201,8 +466,7 @@ static void termhandler(int foo)
 void start_X_server(void)
 {
 	struct sigaction usr1;
-	struct sigaction term;
-	char *xserver = NULL;
+	char xserver[PATH_MAX] = "";
 	int ret;
 	char vt[80];
 	char xorg_log[PATH_MAX];
@@ -228,10 +492,7 @@ void start_X_server(void)
 		xpid = ret;
 		lprintf("Started Xorg[%d]", xpid);
 		/* setup sighandler for main thread */
-		memset(&term, 0, sizeof(struct sigaction));
-		term.sa_handler = termhandler;
-		sigaction(SIGTERM, &term, NULL);
-		sigaction(SIGINT, &term, NULL);
+		arm_termhandler();
 		d_out();
 		return; /* we're the main thread */
 	}
@@ -246,15 +507,21 @@ void start_X_server(void)
 	 */
 	signal(SIGUSR1, SIG_IGN);
 
-	if (!xserver) {
-		if (!access("/usr/bin/Xorg", X_OK))
-			xserver = "/usr/bin/Xorg";
-		else if (!access("/usr/bin/X", X_OK))
-			xserver = "/usr/bin/X";
-		else {
-			lprintf("No X server found!");
+	if (no_vt) {
+		snprintf(xserver, PATH_MAX, "%s/usr/bin/Xvfb", sysroot);
+		if (access(xserver, X_OK)) {
+			lprintf("No Xvfb found!");
 			_exit(EXIT_FAILURE);
 		}
+	} else {
+		snprintf(xserver, PATH_MAX, "%s/usr/bin/Xorg", sysroot);
+		if (access(xserver, X_OK)) {
+			snprintf(xserver, PATH_MAX, "%s/usr/bin/X", sysroot);
+			if (access(xserver, X_OK)) {
+				lprintf("No X server found!");
+				_exit(EXIT_FAILURE);
+			}
+		}
 	}
 
 	snprintf(vt, 80, "vt%d", tty);
@@ -266,10 +533,24 @@ void start_X_server(void)
 
 	ptrs[++count] = displayname;
 
+	if (no_vt) {
+		/* Xvfb: one screen, and no log file */
+		ptrs[++count] = strdup("-screen");
+		ptrs[++count] = strdup("0");
+		ptrs[++count] = headless_screen;
+	} else if (!strcmp(display_backend, "dummy")) {
+		/* Xorg only takes a relative path from the user, see xorg.conf(5) */
+		ptrs[++count] = strdup("-config");
+		ptrs[++count] = strdup(DUMMY_CONFIG);
+	}
+
 	/* non-suid root Xorg? */
 	ret = stat(xserver, &statbuf);
-	if (!(!ret && (statbuf.st_mode & S_ISUID))) {
-		snprintf(xorg_log, PATH_MAX, "%s/.Xorg.0.log", pass->pw_dir);
+	if (no_vt) {
+		/* no log */
+	} else if (!(!ret && (statbuf.st_mode & S_ISUID))) {
+		snprintf(fn, PATH_MAX, "Xorg.%d.log", atoi(displayname + 1));
+		home_file_path(xorg_log, fn);
 		ptrs[++count] = strdup("-logfile");
 		ptrs[++count] = xorg_log;
 	} else {
@@ -287,7 +568,8 @@ void start_X_server(void)
 	ptrs[++count] = strdup("-nolisten");
 	ptrs[++count] = strdup("tcp");
 
-	ptrs[++count] = strdup("-noreset");
+	if (x_noreset)
+		ptrs[++count] = strdup("-noreset");
 
 	ptrs[++count] = strdup("-auth");
 	ptrs[++count] = user_xauth_path;
@@ -298,7 +580,8 @@ void start_X_server(void)
 		ptrs[++count] = strdup(opt);
 		opt = strtok(NULL, " ");
 	}
-	ptrs[++count] = vt;
+	if (!no_vt)
+		ptrs[++count] = vt;
 
 	for (i = 0; i <= count; i++) {
 		strncat(all, ptrs[i], PATH_MAX - strlen(all) - 1);
@@ -307,15 +590,17 @@ void start_X_server(void)
 	}
 	lprintf("starting X server with: \"%s\"", all);
 
-	/* redirect further IO to .xsession-errors */
-	snprintf(fn, PATH_MAX, "%s/.xsession-errors", pass->pw_dir);
-	fp = fopen(fn, "w");
-	if (fp) {
-		fclose(fp);
-		fp = freopen(fn, "w", stdout);
-		fp = freopen(fn, "w", stderr);
-	} else {
-		lprintf("Unable to open \"%s\n\" for writing", fn);
+	/* redirect further IO to the logger, or .xsession-errors */
+	if (log_output("Xorg")) {
+		snprintf(fn, PATH_MAX, "%s/.xsession-errors", pass->pw_dir);
+		fp = fopen(fn, "w");
+		if (fp) {
+			fclose(fp);
+			fp = freopen(fn, "w", stdout);
+			fp = freopen(fn, "w", stderr);
+		} else {
+			lprintf("Unable to open \"%s\n\" for writing", fn);
+		}
 	}
 
 	execv(ptrs[0], ptrs);
@@ -325,6 +610,20 @@ void start_X_server(void)
 	exit(EXIT_FAILURE);
 }
 
+/*
+ * The chooser or greeter left us an X server, but the session chosen
+ * brings its own compositor
+ */
+void stop_X_server(void)
+{
+	d_in();
+	lprintf("Stopping Xorg[%d], the session doesn't need it", xpid);
+	kill(xpid, SIGTERM);
+	waitpid(xpid, NULL, 0);
+	xpid = 0;
+	d_out();
+}
+
 /*
  * The X server will send us a SIGUSR1 when it's ready to serve clients,
  * wait for this.
@@ -363,6 +662,10 @@ void wait_for_X_exit(void)
 				ret, WTERMSIG(status));
 		if (WIFCONTINUED(status))
 			lprintf("process %d continued", ret);
+		if (ret > 0 && (WIFEXITED(status) || WIFSIGNALED(status)))
+			daemon_exited(ret);
+		if (ret > 0 && crashed(status))
+			flush_log();
 
 		if (ret == xpid) {
 			lprintf("Xorg[%d] exited, cleaning up", ret);
@@ -371,6 +674,9 @@ void wait_for_X_exit(void)
 		if (ret == session_pid) {
 			lprintf("Session process [%d] exited, cleaning up",
 				ret);
+			/* a compositor session has no X server to wait for */
+			if (!xpid)
+				break;
 			kill(xpid, SIGTERM);
 		}
 	}
@@ -382,6 +688,9 @@ void set_text_mode(void)
 {
 	int fd;
 
+	if (no_vt)
+		return;
+
 	d_in();
 
 	fd = open(displaydev, O_RDWR);
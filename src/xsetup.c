@@ -0,0 +1,210 @@
+/*
+ * This file is part of uxlaunch
+ *
+ * What we set up in the X server for the session, over one xcb
+ * connection instead of running xhost and friends:
+ * - access for the session user by name (SI:localuser), so that
+ *   clients without the cookie, e.g. started through sudo -E, work
+ * - Xft.dpi in RESOURCE_MANAGER, so toolkits agree with the server
+ * - optionally, the root window background
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include <xcb/xcb.h>
+
+#include "uxlaunch.h"
+
+/* "#rrggbb", empty leaves the root window alone */
+char x_background[16] = "";
+
+/* the most of RESOURCE_MANAGER we keep, in bytes */
+#define MAX_RESOURCES 65536
+
+
+static xcb_void_cookie_t allow_local_user(xcb_connection_t *c)
+{
+	char address[256 + 16];
+	int len;
+
+	/* a server interpreted address is "<type>\0<value>" */
+	len = snprintf(address, sizeof(address), "localuser%c%s", '\0', pass->pw_name);
+	if (len >= (int)sizeof(address))
+		len = sizeof(address) - 1;
+
+	return xcb_change_hosts_checked(c, XCB_HOST_MODE_INSERT,
+					XCB_FAMILY_SERVER_INTERPRETED, len,
+					(uint8_t *)address);
+}
+
+
+/*
+ * The -dpi we started X with, or what X derived from the monitor
+ */
+static int screen_dpi(xcb_screen_t *screen)
+{
+	if (strcmp(dpinum, "auto"))
+		return atoi(dpinum);
+	if (!screen->width_in_millimeters)
+		return 0;
+	return (screen->width_in_pixels * 254 + screen->width_in_millimeters * 5) /
+		(screen->width_in_millimeters * 10);
+}
+
+
+/*
+ * Replace Xft.dpi in what's there already, like xrdb -merge
+ */
+static void set_dpi_resource(xcb_connection_t *c, xcb_screen_t *screen,
+			     xcb_get_property_cookie_t cookie)
+{
+	xcb_get_property_reply_t *reply;
+	char *res, *line, *next;
+	const char *old = "";
+	int old_len = 0;
+	int len = 0;
+	int dpi;
+
+	reply = xcb_get_property_reply(c, cookie, NULL);
+	if (reply && reply->type == XCB_ATOM_STRING && reply->format == 8) {
+		/* more than we asked for, replacing it would cut it short */
+		if (reply->bytes_after) {
+			lprintf("Resources over %d bytes, leaving them alone", MAX_RESOURCES);
+			free(reply);
+			return;
+		}
+		old = xcb_get_property_value(reply);
+		old_len = xcb_get_property_value_length(reply);
+	}
+
+	dpi = screen_dpi(screen);
+	if (dpi <= 0) {
+		lprintf("No DPI for Xft.dpi, leaving the resources alone");
+		free(reply);
+		return;
+	}
+
+	res = malloc(old_len + 32);
+	if (!res) {
+		free(reply);
+		return;
+	}
+
+	/* copy every line but Xft.dpi */
+	for (line = (char *)old; line < old + old_len; line = next) {
+		next = memchr(line, '\n', old + old_len - line);
+		next = next ? next + 1 : (char *)old + old_len;
+		/* the value isn't NUL terminated */
+		if (next - line >= 8 && !strncmp(line, "Xft.dpi:", 8))
+			continue;
+		memcpy(res + len, line, next - line);
+		len += next - line;
+	}
+	if (len > 0 && res[len - 1] != '\n')
+		res[len++] = '\n';
+	len += sprintf(res + len, "Xft.dpi:\t%d\n", dpi);
+
+	xcb_change_property(c, XCB_PROP_MODE_REPLACE, screen->root,
+			    XCB_ATOM_RESOURCE_MANAGER, XCB_ATOM_STRING, 8, len, res);
+	lprintf("Set Xft.dpi to %d", dpi);
+
+	free(res);
+	free(reply);
+}
+
+
+static void set_background(xcb_connection_t *c, xcb_screen_t *screen,
+			   xcb_alloc_color_cookie_t cookie)
+{
+	xcb_alloc_color_reply_t *reply;
+	uint32_t pixel;
+
+	reply = xcb_alloc_color_reply(c, cookie, NULL);
+	if (!reply) {
+		lprintf("Unable to allocate background color %s", x_background);
+		return;
+	}
+	pixel = reply->pixel;
+	free(reply);
+
+	xcb_change_window_attributes(c, screen->root, XCB_CW_BACK_PIXEL, &pixel);
+	xcb_clear_area(c, 0, screen->root, 0, 0, 0, 0);
+}
+
+
+/*
+ * Once X is ready, before the session starts. The requests go out
+ * together, so this costs about one round trip.
+ */
+void setup_X_display(void)
+{
+	xcb_connection_t *c;
+	xcb_auth_info_t auth;
+	xcb_screen_t *screen;
+	xcb_void_cookie_t hosts;
+	xcb_get_property_cookie_t resources;
+	xcb_alloc_color_cookie_t color = { 0 };
+	xcb_generic_error_t *error;
+	unsigned int r, g, b;
+	int want_color = 0;
+
+	d_in();
+
+	/* our cookie, unless X isn't ours (-x) */
+	if (x_auth.data_length) {
+		auth.namelen = x_auth.name_length;
+		auth.name = x_auth.name;
+		auth.datalen = x_auth.data_length;
+		auth.data = x_auth.data;
+		c = xcb_connect_to_display_with_auth_info(displayname, &auth, NULL);
+	} else {
+		c = xcb_connect(displayname, NULL);
+	}
+	if (xcb_connection_has_error(c)) {
+		lprintf("Unable to connect to X on %s", displayname);
+		xcb_disconnect(c);
+		d_out();
+		return;
+	}
+
+	screen = xcb_setup_roots_iterator(xcb_get_setup(c)).data;
+
+	hosts = allow_local_user(c);
+	resources = xcb_get_property(c, 0, screen->root, XCB_ATOM_RESOURCE_MANAGER,
+				     XCB_ATOM_STRING, 0, MAX_RESOURCES / 4);
+	if (x_background[0] != '\0') {
+		if (sscanf(x_background, "#%2x%2x%2x", &r, &g, &b) == 3) {
+			color = xcb_alloc_color(c, screen->default_colormap,
+						r * 257, g * 257, b * 257);
+			want_color = 1;
+		} else {
+			lprintf("Invalid background=%s, expected #rrggbb", x_background);
+		}
+	}
+
+	set_dpi_resource(c, screen, resources);
+	if (want_color)
+		set_background(c, screen, color);
+
+	error = xcb_request_check(c, hosts);
+	if (error) {
+		lprintf("Unable to allow SI:localuser:%s access to X (error %d)",
+			pass->pw_name, error->error_code);
+		free(error);
+	}
+
+	/* the server keeps all of it after we disconnect, we run it with -noreset */
+	xcb_flush(c);
+	xcb_disconnect(c);
+
+	d_out();
+}
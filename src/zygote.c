@@ -0,0 +1,542 @@
+/*
+ * This file is part of uxlaunch
+ *
+ * Launch zygote: a process forked once the user environment is set up,
+ * that starts the autostart programs, restarts them for their
+ * X-Watchdog, and serves the same for other launchers in the session.
+ * Starting a program then no longer means forking all of uxlaunch, and
+ * PATH lookups are only done once per program.
+ *
+ * Requests are single SOCK_SEQPACKET messages of newline separated
+ * KEY=VALUE fields:
+ *
+ *   NAME=<name>                         for the log, e.g. the .desktop file
+ *   PRIO=<-1..3>                        X-Priority, 1 and up run niced
+ *   WATCHDOG=<none|halt|restart|fail>   X-Watchdog
+ *   EXEC=<command line>                 split at whitespace
+ *
+ * and are answered with "PID=<pid>" or "ERROR=<message>". uxlaunch has
+ * its own connection, other launchers connect to the socket named by
+ * $UXLAUNCH_SPAWN_SOCKET: uxlaunch-spawn-<display> in the runtime dir, or without
+ * one an abstract socket ("@" stands for the leading NUL).
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <glib.h>
+
+#include "uxlaunch.h"
+
+#define SPAWN_SOCKET_ENV "UXLAUNCH_SPAWN_SOCKET"
+
+#define MAX_CLIENTS 16
+#define MAX_WATCHED 64
+
+static int zygote_fd = -1;	/* our end of the connection to the zygote */
+static int listen_fd = -1;
+
+/*
+ * The rest is zygote state
+ */
+
+static int client_fd[MAX_CLIENTS];
+static int client_count = 0;
+
+/* programs with a watchdog */
+static struct {
+	pid_t pid;
+	char name[256];
+	gchar *exec;
+	int prio;
+	int watchdog;
+	int restarts;
+	uint64_t restart_at;	/* 0 while running */
+} watched[MAX_WATCHED];
+
+/* program name -> full path */
+static GHashTable *paths;
+
+
+/*
+ * Called before the session is started, so it inherits the socket name
+ */
+void setup_zygote(void)
+{
+	struct sockaddr_un addr;
+	char name[108];
+	socklen_t len;
+	int fds[2];
+
+	d_in();
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds)) {
+		lprintf("Unable to create the zygote socket: %s", strerror(errno));
+		return;
+	}
+	zygote_fd = fds[0];
+	client_fd[client_count++] = fds[1];
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (getenv("XDG_RUNTIME_DIR")) {
+		/* the user may have more than one session, e.g. with --new-vt */
+		snprintf(name, sizeof(name), "%s/uxlaunch-spawn-%d", getenv("XDG_RUNTIME_DIR"),
+			 atoi(displayname + 1));
+		strncpy(addr.sun_path, name, sizeof(addr.sun_path) - 1);
+		len = offsetof(struct sockaddr_un, sun_path) + strlen(name) + 1;
+		/* left over from an earlier session */
+		unlink(name);
+	} else {
+		snprintf(name, sizeof(name), "@uxlaunch-spawn-%d-%d", getuid(), getpid());
+		/* abstract: sun_path[0] stays 0 */
+		strncpy(addr.sun_path + 1, name + 1, sizeof(addr.sun_path) - 2);
+		len = offsetof(struct sockaddr_un, sun_path) + strlen(name);
+	}
+
+	listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (listen_fd < 0 ||
+	    bind(listen_fd, (struct sockaddr *)&addr, len) ||
+	    listen(listen_fd, 8)) {
+		lprintf("Unable to create the spawn socket: %s", strerror(errno));
+		if (listen_fd >= 0)
+			close(listen_fd);
+		listen_fd = -1;
+	} else {
+		setenv(SPAWN_SOCKET_ENV, name, 1);
+	}
+
+	d_out();
+}
+
+
+static const char *resolve_path(const char *name)
+{
+	const char *path;
+	gchar **dirs;
+	gchar *full;
+	int i;
+
+	if (strchr(name, '/'))
+		return name;
+
+	path = g_hash_table_lookup(paths, name);
+	if (path && !access(path, X_OK))
+		return path;
+
+	if (!getenv("PATH"))
+		return name;
+
+	dirs = g_strsplit(getenv("PATH"), ":", 0);
+	for (i = 0; dirs[i]; i++) {
+		full = g_strdup_printf("%s/%s", dirs[i][0] ? dirs[i] : ".", name);
+		if (!access(full, X_OK)) {
+			g_hash_table_replace(paths, g_strdup(name), full);
+			g_strfreev(dirs);
+			return full;
+		}
+		g_free(full);
+	}
+	g_strfreev(dirs);
+
+	/* let execvp() report it */
+	return name;
+}
+
+
+static pid_t spawn(const char *name, const char *exec, int prio)
+{
+	char *ptrs[256];
+	const char *path;
+	sigset_t mask;
+	char *buf;
+	int count = 0;
+	pid_t pid;
+
+	buf = strdup(exec);
+	memset(ptrs, 0, sizeof(ptrs));
+	ptrs[0] = strtok(buf, " \t");
+	while (ptrs[count] && count < 255)
+		ptrs[++count] = strtok(NULL, " \t");
+	if (!ptrs[0]) {
+		free(buf);
+		errno = EINVAL;
+		return -1;
+	}
+
+	path = resolve_path(ptrs[0]);
+
+	pid = fork();
+	if (pid == 0) {
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+		if (prio >= 1)
+			set_low_priority();
+		log_output(name);
+		execv(path, ptrs);
+		execvp(ptrs[0], ptrs);
+		lprintf("Failed to execvp(%s)", exec);
+		_exit(EXIT_FAILURE);
+	}
+
+	free(buf);
+	if (pid > 0)
+		dprintf("Started %s:%s with prio %d as %d", name, exec, prio, pid);
+
+	return pid;
+}
+
+
+static int watchdog_from_name(const char *name)
+{
+	if (!g_ascii_strcasecmp(name, "halt"))
+		return WD_HALT;
+	if (!g_ascii_strcasecmp(name, "restart"))
+		return WD_RESTART;
+	if (!g_ascii_strcasecmp(name, "fail"))
+		return WD_FAIL;
+	return WD_NONE;
+}
+
+
+static void handle_request(int fd)
+{
+	char msg[4096];
+	char reply[64];
+	char name[256] = "-";
+	char *exec = NULL;
+	char *line, *save = NULL;
+	int prio = 0;
+	int wd = WD_NONE;
+	ssize_t len;
+	pid_t pid;
+	int i;
+
+	len = recv(fd, msg, sizeof(msg) - 1, 0);
+	if (len <= 0)
+		return;
+	msg[len] = '\0';
+
+	for (line = strtok_r(msg, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+		if (!strncmp(line, "NAME=", 5))
+			strncpy(name, line + 5, sizeof(name) - 1);
+		else if (!strncmp(line, "PRIO=", 5))
+			prio = atoi(line + 5);
+		else if (!strncmp(line, "WATCHDOG=", 9))
+			wd = watchdog_from_name(line + 9);
+		else if (!strncmp(line, "EXEC=", 5))
+			exec = line + 5;
+	}
+
+	if (!exec) {
+		snprintf(reply, sizeof(reply), "ERROR=no EXEC");
+		goto out;
+	}
+
+	pid = spawn(name, exec, prio);
+	if (pid < 0) {
+		snprintf(reply, sizeof(reply), "ERROR=%s", strerror(errno));
+		goto out;
+	}
+	snprintf(reply, sizeof(reply), "PID=%d", pid);
+
+	if (wd == WD_NONE)
+		goto out;
+	for (i = 0; i < MAX_WATCHED; i++) {
+		if (watched[i].pid || watched[i].restart_at)
+			continue;
+		watched[i].pid = pid;
+		strcpy(watched[i].name, name);
+		watched[i].exec = g_strdup(exec);
+		watched[i].prio = prio;
+		watched[i].watchdog = wd;
+		watched[i].restarts = 0;
+		break;
+	}
+	if (i == MAX_WATCHED)
+		lprintf("Watchdog: too many entries, not watching %s", name);
+
+out:
+	send(fd, reply, strlen(reply), MSG_NOSIGNAL);
+}
+
+
+static void child_exited(pid_t pid, int status)
+{
+	int i;
+
+	for (i = 0; i < MAX_WATCHED; i++)
+		if (watched[i].pid == pid)
+			break;
+
+	if (crashed(status))
+		flush_log();
+
+	if (i == MAX_WATCHED) {
+		if (WIFEXITED(status))
+			dprintf("process %d exited with exit code %d", pid, WEXITSTATUS(status));
+		return;
+	}
+
+	if (WIFEXITED(status))
+		lprintf("process %d (%s:%s) exited with exit code %d",
+			pid, watched[i].name, watched[i].exec, WEXITSTATUS(status));
+	if (WIFSIGNALED(status))
+		lprintf("process %d (%s:%s) was killed by signal %d",
+			pid, watched[i].name, watched[i].exec, WTERMSIG(status));
+
+	watched[i].pid = 0;
+
+	if ((watched[i].watchdog == WD_FAIL && (WEXITSTATUS(status) || WIFSIGNALED(status))) ||
+	    watched[i].watchdog == WD_RESTART) {
+		/* safety: reasonable sleep here */
+		watched[i].restarts++;
+		watched[i].restart_at = elapsed_usecs() + 1000000ULL *
+			((watched[i].restarts <= 5) ? watched[i].restarts : 900); /* 15 mins */
+		return;
+	}
+
+	if (watched[i].watchdog == WD_HALT) {
+		/* tear down the session */
+		lprintf("Watchdog: %s:%s exited, tearing down session",
+			watched[i].name, watched[i].exec);
+		kill(session_pid, SIGTERM);
+	}
+
+	g_free(watched[i].exec);
+	watched[i].exec = NULL;
+}
+
+
+static void restart_due(void)
+{
+	uint64_t now = elapsed_usecs();
+	pid_t pid;
+	int i;
+
+	for (i = 0; i < MAX_WATCHED; i++) {
+		if (!watched[i].restart_at || watched[i].restart_at > now)
+			continue;
+
+		watched[i].restart_at = 0;
+		lprintf("Watchdog: restarting %s:%s", watched[i].name, watched[i].exec);
+		metrics_watchdog_restart(watched[i].name, watched[i].restarts);
+
+		pid = spawn(watched[i].name, watched[i].exec, watched[i].prio);
+		if (pid < 0) {
+			lprintf("Failed to fork for %s", watched[i].exec);
+			g_free(watched[i].exec);
+			watched[i].exec = NULL;
+			continue;
+		}
+		watched[i].pid = pid;
+		if (watched[i].prio >= 2)
+			background_pid(pid);
+	}
+}
+
+
+/* ms until the next restart, -1 if none */
+static int restart_timeout(void)
+{
+	uint64_t now = elapsed_usecs();
+	uint64_t next = UINT64_MAX;
+	int i;
+
+	for (i = 0; i < MAX_WATCHED; i++)
+		if (watched[i].restart_at && watched[i].restart_at < next)
+			next = watched[i].restart_at;
+
+	if (next == UINT64_MAX)
+		return -1;
+	if (next <= now)
+		return 0;
+	return (next - now + 999) / 1000;
+}
+
+
+static void accept_client(void)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	int fd;
+
+	fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	/* only the session user may start programs through us */
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) ||
+	    cred.uid != getuid() || client_count >= MAX_CLIENTS) {
+		close(fd);
+		return;
+	}
+	client_fd[client_count++] = fd;
+}
+
+
+static void zygote_loop(int sfd)
+{
+	struct pollfd pfd[2 + MAX_CLIENTS];
+	struct signalfd_siginfo si;
+	int status;
+	pid_t pid;
+	int i, n;
+
+	paths = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	for (;;) {
+		pfd[0].fd = sfd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = listen_fd;
+		pfd[1].events = POLLIN;
+		for (i = 0; i < client_count; i++) {
+			pfd[2 + i].fd = client_fd[i];
+			pfd[2 + i].events = POLLIN;
+		}
+		n = 2 + client_count;
+
+		if (poll(pfd, n, restart_timeout()) < 0 && errno != EINTR)
+			break;
+
+		if (pfd[0].revents & POLLIN) {
+			while (read(sfd, &si, sizeof(si)) > 0)
+				;
+			while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+				child_exited(pid, status);
+		}
+
+		restart_due();
+
+		if (listen_fd >= 0 && (pfd[1].revents & POLLIN))
+			accept_client();
+
+		for (i = n - 3; i >= 0; i--) {
+			if (pfd[2 + i].revents & POLLIN)
+				handle_request(client_fd[i]);
+			if (!(pfd[2 + i].revents & (POLLHUP | POLLERR)))
+				continue;
+			/* client 0 is uxlaunch, we're done when it is */
+			if (i == 0)
+				return;
+			close(client_fd[i]);
+			client_fd[i] = client_fd[--client_count];
+		}
+	}
+}
+
+
+/*
+ * Called once the session is started, so a Halt watchdog can stop it
+ */
+void start_zygote(void)
+{
+	sigset_t mask;
+	pid_t pid;
+	int sfd;
+
+	if (zygote_fd < 0)
+		return;
+
+	d_in();
+
+	pid = fork();
+	if (pid < 0) {
+		lprintf("Failed to fork the zygote");
+		close(zygote_fd);
+		zygote_fd = -1;
+		return;
+	}
+
+	if (pid > 0) {
+		/* the zygote owns the other ends */
+		close(client_fd[0]);
+		if (listen_fd >= 0)
+			close(listen_fd);
+		lprintf("Started the launch zygote [%d]", pid);
+		freeze_when_hidden(pid);
+		d_out();
+		return;
+	}
+
+	close(zygote_fd);
+	drop_session_notify();
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sfd < 0) {
+		lprintf("zygote: signalfd failed: %s", strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+
+	zygote_loop(sfd);
+	_exit(EXIT_SUCCESS);
+}
+
+
+/*
+ * Start a program through the zygote. Returns its pid, or -1.
+ */
+pid_t zygote_spawn(const char *name, const char *exec, int prio, int watchdog)
+{
+	static const char *wd_names[] = { "none", "halt", "restart", "fail" };
+	char msg[4096];
+	char reply[64];
+	ssize_t len;
+
+	if (zygote_fd < 0)
+		return -1;
+
+	snprintf(msg, sizeof(msg), "NAME=%s\nPRIO=%d\nWATCHDOG=%s\nEXEC=%s",
+		 name, prio, wd_names[watchdog], exec);
+	if (send(zygote_fd, msg, strlen(msg), MSG_NOSIGNAL) < 0) {
+		lprintf("Unable to reach the zygote: %s", strerror(errno));
+		return -1;
+	}
+
+	len = recv(zygote_fd, reply, sizeof(reply) - 1, 0);
+	if (len <= 0) {
+		lprintf("No answer from the zygote");
+		return -1;
+	}
+	reply[len] = '\0';
+
+	if (strncmp(reply, "PID=", 4)) {
+		lprintf("zygote: %s: %s", exec, reply);
+		return -1;
+	}
+
+	return atoi(reply + 4);
+}
+
+
+/*
+ * The zygote keeps the watchdogs running until our end of the
+ * connection closes, so the supervisor holds on to it
+ */
+void hand_over_zygote(struct handover *h)
+{
+	h->zygote_fd = zygote_fd;
+	keep_fd(zygote_fd);
+}